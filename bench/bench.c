@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <fcntl.h>
+#include <limits.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Runs lps end to end (init, graph, closure, version scan, sort) against
+// databases from lps-gen-db at several sizes, and prints the wall time and
+// peak RSS of each. lps is run with --dry-run so it exits before opening the
+// terminal, and with HOME pointed into the generated root so the keep list
+// and upgrade cache there are used instead of the real ones.
+
+#define BENCH_MAX_RUNS 64
+
+typedef struct _run_result
+{
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    long max_rss_kib;
+} run_result_t;
+
+double get_time_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+double timeval_ms(struct timeval time)
+{
+    return time.tv_sec * 1000.0 + time.tv_usec / 1000.0;
+}
+
+// Returns the exit status of the command, or -1 if it couldn't be run. The
+// command's stdout is discarded.
+int run_command(char *const *command, const char *home_path, run_result_t *result)
+{
+    const double start_ms = get_time_ms();
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        if (home_path != NULL)
+        {
+            setenv("HOME", home_path, 1);
+        }
+
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+
+        execv(command[0], command);
+        perror(command[0]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1)
+    {
+        return -1;
+    }
+
+    if (result != NULL)
+    {
+        result->wall_ms = get_time_ms() - start_ms;
+        result->user_ms = timeval_ms(usage.ru_utime);
+        result->sys_ms = timeval_ms(usage.ru_stime);
+        result->max_rss_kib = usage.ru_maxrss;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double median_wall_ms(const run_result_t *results, int count)
+{
+    double times[BENCH_MAX_RUNS];
+    for (int i = 0; i < count; i++)
+    {
+        times[i] = results[i].wall_ms;
+    }
+    qsort(times, count, sizeof(double), compare_doubles);
+
+    return count % 2 == 1 ? times[count / 2] : (times[count / 2 - 1] + times[count / 2]) / 2;
+}
+
+// Runs lps the given number of times and summarizes the runs. Returns false
+// if any run failed.
+bool bench_lps(const char *lps_path, const char *root_dir, const char *jobs, bool use_cache, int runs,
+               run_result_t *summary)
+{
+    char config_path[PATH_MAX];
+    char home_path[PATH_MAX];
+    snprintf(config_path, sizeof(config_path), "%s/pacman.conf", root_dir);
+    snprintf(home_path, sizeof(home_path), "%s/home", root_dir);
+
+    char *command[8];
+    int argument_count = 0;
+    command[argument_count++] = (char *)lps_path;
+    command[argument_count++] = "--dry-run";
+    command[argument_count++] = "--config";
+    command[argument_count++] = config_path;
+    if (!use_cache)
+    {
+        command[argument_count++] = "--no-cache";
+    }
+    if (jobs != NULL)
+    {
+        command[argument_count++] = "--jobs";
+        command[argument_count++] = (char *)jobs;
+    }
+    command[argument_count] = NULL;
+
+    run_result_t results[BENCH_MAX_RUNS];
+    memset(summary, 0, sizeof(run_result_t));
+
+    for (int i = 0; i < runs; i++)
+    {
+        if (run_command(command, home_path, &results[i]) != 0)
+        {
+            return false;
+        }
+
+        summary->user_ms += results[i].user_ms / runs;
+        summary->sys_ms += results[i].sys_ms / runs;
+        if (results[i].max_rss_kib > summary->max_rss_kib)
+        {
+            summary->max_rss_kib = results[i].max_rss_kib;
+        }
+    }
+    summary->wall_ms = median_wall_ms(results, runs);
+
+    return true;
+}
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [OPTION]... LPS GEN_DB DIR [PACKAGES]...\n", program_name);
+    printf("Generate synthetic databases under DIR with GEN_DB for each package count\n");
+    printf("(default 1000 5000 20000 50000) and time the LPS binary against them.\n\n");
+    printf("  -i, --runs=N         time N runs of each size and report the median\n");
+    printf("                       (default 5)\n");
+    printf("  -j, --jobs=N         passed on to lps\n");
+    printf("  -f, --fan-out=N      passed on to GEN_DB\n");
+    printf("  -d, --depth=N        passed on to GEN_DB\n");
+    printf("  -u, --upgrades=FRAC  passed on to GEN_DB\n");
+    printf("  -h, --help           display this help and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+    int runs = 5;
+    const char *jobs = NULL;
+    const char *fan_out = NULL;
+    const char *depth = NULL;
+    const char *upgrades = NULL;
+
+    static const struct option long_options[] = {
+        {"runs", required_argument, NULL, 'i'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"fan-out", required_argument, NULL, 'f'},
+        {"depth", required_argument, NULL, 'd'},
+        {"upgrades", required_argument, NULL, 'u'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:j:f:d:u:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            runs = atoi(optarg);
+            if (runs < 1 || runs > BENCH_MAX_RUNS)
+            {
+                fprintf(stderr, "%s: the number of runs must be between 1 and %d\n", argv[0], BENCH_MAX_RUNS);
+                return 2;
+            }
+            break;
+        case 'j':
+            jobs = optarg;
+            break;
+        case 'f':
+            fan_out = optarg;
+            break;
+        case 'd':
+            depth = optarg;
+            break;
+        case 'u':
+            upgrades = optarg;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (argc - optind < 3)
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    const char *lps_path = argv[optind];
+    const char *gen_db_path = argv[optind + 1];
+    const char *bench_dir = argv[optind + 2];
+
+    static const char *default_sizes[] = {"1000", "5000", "20000", "50000"};
+    const char **sizes = (const char **)argv + optind + 3;
+    int size_count = argc - optind - 3;
+    if (size_count == 0)
+    {
+        sizes = default_sizes;
+        size_count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    }
+
+    printf("%9s %12s %12s %12s %12s %12s\n", "packages", "full ms", "user ms", "sys ms", "cached ms", "peak RSS MiB");
+
+    for (int i = 0; i < size_count; i++)
+    {
+        char root_dir[PATH_MAX];
+        snprintf(root_dir, sizeof(root_dir), "%s/%s", bench_dir, sizes[i]);
+
+        char *gen_command[16];
+        int argument_count = 0;
+        gen_command[argument_count++] = (char *)gen_db_path;
+        gen_command[argument_count++] = "--packages";
+        gen_command[argument_count++] = (char *)sizes[i];
+        if (fan_out != NULL)
+        {
+            gen_command[argument_count++] = "--fan-out";
+            gen_command[argument_count++] = (char *)fan_out;
+        }
+        if (depth != NULL)
+        {
+            gen_command[argument_count++] = "--depth";
+            gen_command[argument_count++] = (char *)depth;
+        }
+        if (upgrades != NULL)
+        {
+            gen_command[argument_count++] = "--upgrades";
+            gen_command[argument_count++] = (char *)upgrades;
+        }
+        gen_command[argument_count++] = root_dir;
+        gen_command[argument_count] = NULL;
+
+        if (run_command(gen_command, NULL, NULL) != 0)
+        {
+            fprintf(stderr, "%s: failed to generate databases in %s\n", argv[0], root_dir);
+            return 1;
+        }
+
+        // The full pipeline is timed with the cache disabled. Those runs
+        // still write the cache, so the runs after them measure a cache hit.
+        run_result_t full;
+        run_result_t cached;
+        if (!bench_lps(lps_path, root_dir, jobs, false, runs, &full)
+            || !bench_lps(lps_path, root_dir, jobs, true, runs, &cached))
+        {
+            fprintf(stderr, "%s: lps failed on %s\n", argv[0], root_dir);
+            return 1;
+        }
+
+        printf("%9s %12.1f %12.1f %12.1f %12.1f %12.1f\n", sizes[i], full.wall_ms, full.user_ms, full.sys_ms,
+               cached.wall_ms, full.max_rss_kib / 1024.0);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,720 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <ftw.h>
+
+#include <limits.h>
+
+#include <sys/stat.h>
+
+// Generates a fake pacman root for benchmarking lps:
+//
+//   DIR/pacman.conf                         points RootDir, DBPath and CacheDir into DIR
+//   DIR/var/lib/pacman/local/NAME-VER/desc  the installed packages
+//   DIR/var/lib/pacman/sync/REPO.db         uncompressed tar, like repo-add's
+//   DIR/var/cache/pacman/pkg/FILENAME       empty archives of some of the upgrades
+//   DIR/home/.config/lps/keep_packages      the keep roots
+//
+// Packages are split into depth layers. Each package depends on packages in
+// the layers below it, so the keep roots (taken from the top layer) pull in a
+// closure whose size is controlled by the fan-out and depth. Some packages
+// also provide a soname-style virtual name (NAME.so=VER), which is what their
+// dependents depend on instead of their package name. Everything is derived
+// from the seed, so the same options always give the same databases.
+
+typedef struct _gen_options
+{
+    int package_count;
+    int fan_out;
+    int depth;
+    int desc_length;
+    double upgrade_fraction;
+    double cached_fraction;
+    double provides_fraction;
+    int repo_count;
+    int keep_count;
+    uint64_t seed;
+} gen_options_t;
+
+typedef struct _gen_pkg
+{
+    char name[64];
+    char old_version[16];
+    char new_version[16];
+    int layer;
+    int repo;
+    int *deps;
+    int dep_count;
+    long isize;
+    bool is_provided; // Depended on through NAME.so rather than NAME
+} gen_pkg_t;
+
+// xorshift64*, good enough for picking names and edges
+uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+int rng_below(uint64_t *state, int limit)
+{
+    return (int)(rng_next(state) % (uint64_t)limit);
+}
+
+double rng_unit(uint64_t *state)
+{
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static const char *name_prefixes[] = {
+    "", "", "", "lib", "lib", "python-", "perl-", "qt6-", "haskell-", "ttf-", "xf86-", "ruby-", "lib32-", "gst-",
+};
+
+static const char *name_stems[] = {
+    "core", "util", "font", "net", "xml", "sound", "gtk", "image", "crypt", "audio", "video", "shell",
+    "data", "proto", "kit", "term", "mesa", "zip", "config", "doc",
+};
+
+static const char *desc_words[] = {
+    "a", "library", "for", "the", "fast", "small", "portable", "toolkit", "implementation", "of",
+    "and", "protocol", "bindings", "with", "support", "graphical", "command-line", "utilities",
+    "plugins", "framework", "naïve", "façade", "déjà", "vu", "日本語", "ümlaut",
+};
+
+#define ARRAY_LEN(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+const char *repo_name(int repo, char *buffer, size_t buffer_size)
+{
+    static const char *known_repos[] = {"core", "extra", "multilib"};
+    if (repo < ARRAY_LEN(known_repos))
+    {
+        return known_repos[repo];
+    }
+
+    snprintf(buffer, buffer_size, "repo%d", repo);
+    return buffer;
+}
+
+int make_dirs(const char *path)
+{
+    char buffer[PATH_MAX];
+    snprintf(buffer, sizeof(buffer), "%s", path);
+
+    for (char *p = buffer + 1; *p != '\0'; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            if (mkdir(buffer, 0755) == -1 && errno != EEXIST)
+            {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+
+    if (mkdir(buffer, 0755) == -1 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+void remove_tree(const char *path)
+{
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/// Package generation
+
+gen_pkg_t *generate_pkgs(const gen_options_t *options)
+{
+    uint64_t rng = options->seed;
+    gen_pkg_t *pkgs = calloc(options->package_count, sizeof(gen_pkg_t));
+
+    for (int i = 0; i < options->package_count; i++)
+    {
+        gen_pkg_t *pkg = &pkgs[i];
+
+        // Layer 0 holds the applications, the last layer the base libraries
+        pkg->layer = (int)((long)i * options->depth / options->package_count);
+        pkg->repo = rng_below(&rng, options->repo_count);
+        pkg->isize = 1024 + (long)(rng_unit(&rng) * rng_unit(&rng) * 512 * 1024 * 1024);
+
+        const char *prefix = name_prefixes[rng_below(&rng, ARRAY_LEN(name_prefixes))];
+        const char *stem = name_stems[rng_below(&rng, ARRAY_LEN(name_stems))];
+        snprintf(pkg->name, sizeof(pkg->name), "%s%s%d", prefix, stem, i);
+
+        const int major = 1 + rng_below(&rng, 9);
+        const int minor = rng_below(&rng, 20);
+        snprintf(pkg->old_version, sizeof(pkg->old_version), "%d.%d-1", major, minor);
+
+        if (rng_unit(&rng) < options->upgrade_fraction)
+        {
+            // Mix of pkgrel, minor and major bumps
+            switch (rng_below(&rng, 3))
+            {
+            case 0:
+                snprintf(pkg->new_version, sizeof(pkg->new_version), "%d.%d-2", major, minor);
+                break;
+            case 1:
+                snprintf(pkg->new_version, sizeof(pkg->new_version), "%d.%d-1", major, minor + 1);
+                break;
+            default:
+                snprintf(pkg->new_version, sizeof(pkg->new_version), "%d.0-1", major + 1);
+                break;
+            }
+        }
+        else
+        {
+            memcpy(pkg->new_version, pkg->old_version, sizeof(pkg->new_version));
+        }
+    }
+
+    // Each package depends on packages from the next few layers down
+    const int layer_size = options->package_count / options->depth;
+    for (int i = 0; i < options->package_count; i++)
+    {
+        gen_pkg_t *pkg = &pkgs[i];
+        if (pkg->layer >= options->depth - 1 || layer_size <= 0)
+        {
+            continue;
+        }
+
+        const int first = (int)((long)(pkg->layer + 1) * options->package_count / options->depth);
+        const int span = options->package_count - first;
+        pkg->deps = malloc(sizeof(int) * options->fan_out);
+
+        for (int d = 0; d < options->fan_out; d++)
+        {
+            // Favour the layer directly below, like real dependency trees
+            const int range = rng_below(&rng, 4) == 0 ? span : (layer_size < span ? layer_size : span);
+            pkg->deps[pkg->dep_count++] = first + rng_below(&rng, range);
+        }
+    }
+
+    // From a stream of its own, so that the rest doesn't change with the fraction
+    uint64_t provides_rng = options->seed ^ 0x9e0f;
+    for (int i = 0; i < options->package_count; i++)
+    {
+        pkgs[i].is_provided = pkgs[i].layer > 0 && rng_unit(&provides_rng) < options->provides_fraction;
+    }
+
+    return pkgs;
+}
+
+void free_pkgs(gen_pkg_t *pkgs, int package_count)
+{
+    for (int i = 0; i < package_count; i++)
+    {
+        free(pkgs[i].deps);
+    }
+    free(pkgs);
+}
+
+void write_description(FILE *file, uint64_t *rng, int desc_length)
+{
+    int written = 0;
+    while (written < desc_length)
+    {
+        const char *word = desc_words[rng_below(rng, ARRAY_LEN(desc_words))];
+        written += fprintf(file, written == 0 ? "%s" : " %s", word);
+    }
+    fputc('\n', file);
+}
+
+void write_depends(FILE *file, const gen_pkg_t *pkgs, const gen_pkg_t *pkg)
+{
+    if (pkg->dep_count <= 0)
+    {
+        return;
+    }
+
+    fprintf(file, "%%DEPENDS%%\n");
+    for (int d = 0; d < pkg->dep_count; d++)
+    {
+        // Some with version constraints, as in real desc files
+        const gen_pkg_t *dep = &pkgs[pkg->deps[d]];
+        const char *suffix = dep->is_provided ? ".so" : "";
+        if (d % 3 == 2)
+        {
+            fprintf(file, "%s%s>=1.0\n", dep->name, suffix);
+        }
+        else
+        {
+            fprintf(file, "%s%s\n", dep->name, suffix);
+        }
+    }
+    fputc('\n', file);
+}
+
+// version is the package's, whose pkgrel is left out of the provision
+void write_provides(FILE *file, const gen_pkg_t *pkg, const char *version)
+{
+    if (!pkg->is_provided)
+    {
+        return;
+    }
+
+    fprintf(file, "%%PROVIDES%%\n%s.so=%.*s\n\n", pkg->name, (int)strcspn(version, "-"), version);
+}
+
+/// Local database
+
+int write_local_db(const char *local_dir, const gen_pkg_t *pkgs, const gen_options_t *options)
+{
+    char path[PATH_MAX];
+    uint64_t rng = options->seed ^ 0x10ca1;
+
+    snprintf(path, sizeof(path), "%s/ALPM_DB_VERSION", local_dir);
+    FILE *version_file = fopen(path, "w");
+    if (version_file == NULL)
+    {
+        return -1;
+    }
+    fprintf(version_file, "9\n");
+    fclose(version_file);
+
+    for (int i = 0; i < options->package_count; i++)
+    {
+        const gen_pkg_t *pkg = &pkgs[i];
+
+        snprintf(path, sizeof(path), "%s/%s-%s", local_dir, pkg->name, pkg->old_version);
+        if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        {
+            return -1;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s-%s/desc", local_dir, pkg->name, pkg->old_version);
+        FILE *desc = fopen(path, "w");
+        if (desc == NULL)
+        {
+            return -1;
+        }
+
+        fprintf(desc, "%%NAME%%\n%s\n\n", pkg->name);
+        fprintf(desc, "%%VERSION%%\n%s\n\n", pkg->old_version);
+        fprintf(desc, "%%DESC%%\n");
+        write_description(desc, &rng, options->desc_length);
+        fprintf(desc, "\n%%ARCH%%\nx86_64\n\n");
+        fprintf(desc, "%%BUILDDATE%%\n1600000000\n\n");
+        fprintf(desc, "%%INSTALLDATE%%\n1600000000\n\n");
+        fprintf(desc, "%%SIZE%%\n%ld\n\n", pkg->isize);
+        fprintf(desc, "%%REASON%%\n%d\n\n", pkg->layer == 0 ? 0 : 1);
+        write_depends(desc, pkgs, pkg);
+        write_provides(desc, pkg, pkg->old_version);
+        fclose(desc);
+
+        snprintf(path, sizeof(path), "%s/%s-%s/files", local_dir, pkg->name, pkg->old_version);
+        FILE *files = fopen(path, "w");
+        if (files == NULL)
+        {
+            return -1;
+        }
+        fclose(files);
+    }
+
+    return 0;
+}
+
+/// Sync databases
+// Written as plain ustar archives, which libalpm reads through libarchive
+// just like the compressed ones from a mirror
+
+#define TAR_BLOCK_SIZE 512
+
+void tar_write_header(FILE *file, const char *name, size_t size, char type)
+{
+    unsigned char header[TAR_BLOCK_SIZE];
+    memset(header, 0, sizeof(header));
+
+    snprintf((char *)header, 100, "%s", name);
+    snprintf((char *)header + 100, 8, "%07o", type == '5' ? 0755 : 0644);
+    snprintf((char *)header + 108, 8, "%07o", 0);
+    snprintf((char *)header + 116, 8, "%07o", 0);
+    snprintf((char *)header + 124, 12, "%011zo", size);
+    snprintf((char *)header + 136, 12, "%011o", 1600000000);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    // The checksum is computed with its own field filled with spaces
+    memset(header + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+    {
+        checksum += header[i];
+    }
+    snprintf((char *)header + 148, 8, "%06o", checksum);
+    header[155] = ' ';
+
+    fwrite(header, 1, sizeof(header), file);
+}
+
+void tar_write_file(FILE *file, const char *name, const char *content, size_t size)
+{
+    static const char padding[TAR_BLOCK_SIZE];
+
+    tar_write_header(file, name, size, '0');
+    fwrite(content, 1, size, file);
+    if (size % TAR_BLOCK_SIZE != 0)
+    {
+        fwrite(padding, 1, TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE, file);
+    }
+}
+
+void tar_finish(FILE *file)
+{
+    static const char end[TAR_BLOCK_SIZE * 2];
+    fwrite(end, 1, sizeof(end), file);
+}
+
+int write_sync_db(const char *sync_dir, int repo, const gen_pkg_t *pkgs, const gen_options_t *options)
+{
+    char path[PATH_MAX];
+    char repo_buffer[32];
+    const char *repo_str = repo_name(repo, repo_buffer, sizeof(repo_buffer));
+    uint64_t rng = options->seed ^ (0x5c0ULL + repo);
+
+    snprintf(path, sizeof(path), "%s/%s.db", sync_dir, repo_str);
+    FILE *db = fopen(path, "w");
+    if (db == NULL)
+    {
+        return -1;
+    }
+
+    char *content = NULL;
+    size_t content_size = 0;
+
+    for (int i = 0; i < options->package_count; i++)
+    {
+        const gen_pkg_t *pkg = &pkgs[i];
+        if (pkg->repo != repo)
+        {
+            continue;
+        }
+
+        FILE *desc = open_memstream(&content, &content_size);
+        fprintf(desc, "%%FILENAME%%\n%s-%s-x86_64.pkg.tar.zst\n\n", pkg->name, pkg->new_version);
+        fprintf(desc, "%%NAME%%\n%s\n\n", pkg->name);
+        fprintf(desc, "%%VERSION%%\n%s\n\n", pkg->new_version);
+        fprintf(desc, "%%DESC%%\n");
+        write_description(desc, &rng, options->desc_length);
+        fprintf(desc, "\n%%CSIZE%%\n%ld\n\n", pkg->isize / 3 + 512);
+        fprintf(desc, "%%ISIZE%%\n%ld\n\n", pkg->isize + rng_below(&rng, 64 * 1024));
+        fprintf(desc, "%%ARCH%%\nx86_64\n\n");
+        fprintf(desc, "%%BUILDDATE%%\n1600000000\n\n");
+        write_depends(desc, pkgs, pkg);
+        write_provides(desc, pkg, pkg->new_version);
+        fclose(desc);
+
+        char entry_name[100];
+        snprintf(entry_name, sizeof(entry_name), "%s-%s/", pkg->name, pkg->new_version);
+        tar_write_header(db, entry_name, 0, '5');
+        snprintf(entry_name, sizeof(entry_name), "%s-%s/desc", pkg->name, pkg->new_version);
+        tar_write_file(db, entry_name, content, content_size);
+
+        free(content);
+        content = NULL;
+    }
+
+    tar_finish(db);
+    return fclose(db) == 0 ? 0 : -1;
+}
+
+/// Package cache
+
+// Creates an empty archive for roughly cached_fraction of the upgrades, as if
+// they'd already been downloaded
+int write_pkg_cache(const char *cache_dir, const gen_pkg_t *pkgs, const gen_options_t *options)
+{
+    uint64_t rng = options->seed ^ 0xcac4eULL;
+
+    for (int i = 0; i < options->package_count; i++)
+    {
+        const gen_pkg_t *pkg = &pkgs[i];
+        if (strcmp(pkg->old_version, pkg->new_version) == 0 || rng_unit(&rng) >= options->cached_fraction)
+        {
+            continue;
+        }
+
+        char path[PATH_MAX + 128];
+        snprintf(path, sizeof(path), "%s/%s-%s-x86_64.pkg.tar.zst", cache_dir, pkg->name, pkg->new_version);
+        FILE *archive = fopen(path, "w");
+        if (archive == NULL || fclose(archive) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// Configuration
+
+int write_pacman_conf(const char *root_dir, const gen_options_t *options)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/pacman.conf", root_dir);
+
+    FILE *conf = fopen(path, "w");
+    if (conf == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(conf, "# Generated by lps-gen-db\n");
+    fprintf(conf, "[options]\n");
+    fprintf(conf, "RootDir = %s/\n", root_dir);
+    fprintf(conf, "DBPath = %s/var/lib/pacman/\n", root_dir);
+    fprintf(conf, "CacheDir = %s/var/cache/pacman/pkg/\n", root_dir);
+    fprintf(conf, "Architecture = x86_64\n");
+    fprintf(conf, "SigLevel = Never\n");
+
+    for (int repo = 0; repo < options->repo_count; repo++)
+    {
+        char repo_buffer[32];
+        fprintf(conf, "\n[%s]\nServer = file://%s/repo\n", repo_name(repo, repo_buffer, sizeof(repo_buffer)), root_dir);
+    }
+
+    return fclose(conf) == 0 ? 0 : -1;
+}
+
+int write_keep_file(const char *root_dir, const gen_pkg_t *pkgs, const gen_options_t *options)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/home/.config/lps", root_dir);
+    if (make_dirs(path) == -1)
+    {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/home/.config/lps/keep_packages", root_dir);
+    FILE *keep = fopen(path, "w");
+    if (keep == NULL)
+    {
+        return -1;
+    }
+
+    // Spread the roots over the top layer
+    const int top_layer_size = options->package_count / options->depth;
+    const int keep_count = options->keep_count < top_layer_size ? options->keep_count : top_layer_size;
+    for (int i = 0; i < keep_count; i++)
+    {
+        fprintf(keep, "%s\n", pkgs[(long)i * top_layer_size / keep_count].name);
+    }
+
+    return fclose(keep) == 0 ? 0 : -1;
+}
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [OPTION]... DIR\n", program_name);
+    printf("Generate fake local and sync pacman databases under DIR, along with a\n");
+    printf("pacman.conf and keep list that point lps at them.\n\n");
+    printf("  -n, --packages=N     number of installed packages (default 5000)\n");
+    printf("  -f, --fan-out=N      dependencies per package (default 4)\n");
+    printf("  -d, --depth=N        number of dependency layers (default 6)\n");
+    printf("  -l, --desc-length=N  approximate description length in bytes (default 80)\n");
+    printf("  -u, --upgrades=FRAC  fraction of packages with a newer sync version\n");
+    printf("                       (default 0.3)\n");
+    printf("  -c, --cached=FRAC    fraction of upgrades whose archive is already in the\n");
+    printf("                       package cache (default 0.1)\n");
+    printf("  -p, --provides=FRAC  fraction of packages depended on through a provided\n");
+    printf("                       NAME.so instead of their name (default 0.1)\n");
+    printf("  -r, --repos=N        number of sync repos (default 3)\n");
+    printf("  -k, --keep=N         number of keep roots (default 10)\n");
+    printf("  -s, --seed=N         random seed (default 1)\n");
+    printf("  -h, --help           display this help and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+    gen_options_t options = {
+        .package_count = 5000,
+        .fan_out = 4,
+        .depth = 6,
+        .desc_length = 80,
+        .upgrade_fraction = 0.3,
+        .cached_fraction = 0.1,
+        .provides_fraction = 0.1,
+        .repo_count = 3,
+        .keep_count = 10,
+        .seed = 1,
+    };
+
+    static const struct option long_options[] = {
+        {"packages", required_argument, NULL, 'n'},
+        {"fan-out", required_argument, NULL, 'f'},
+        {"depth", required_argument, NULL, 'd'},
+        {"desc-length", required_argument, NULL, 'l'},
+        {"upgrades", required_argument, NULL, 'u'},
+        {"cached", required_argument, NULL, 'c'},
+        {"provides", required_argument, NULL, 'p'},
+        {"repos", required_argument, NULL, 'r'},
+        {"keep", required_argument, NULL, 'k'},
+        {"seed", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:f:d:l:u:c:p:r:k:s:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            options.package_count = atoi(optarg);
+            break;
+        case 'f':
+            options.fan_out = atoi(optarg);
+            break;
+        case 'd':
+            options.depth = atoi(optarg);
+            break;
+        case 'l':
+            options.desc_length = atoi(optarg);
+            break;
+        case 'u':
+            options.upgrade_fraction = strtod(optarg, NULL);
+            break;
+        case 'c':
+            options.cached_fraction = strtod(optarg, NULL);
+            break;
+        case 'p':
+            options.provides_fraction = strtod(optarg, NULL);
+            break;
+        case 'r':
+            options.repo_count = atoi(optarg);
+            break;
+        case 'k':
+            options.keep_count = atoi(optarg);
+            break;
+        case 's':
+            options.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    if (options.package_count < 1 || options.fan_out < 0 || options.depth < 1 || options.desc_length < 0
+        || options.upgrade_fraction < 0 || options.upgrade_fraction > 1 || options.cached_fraction < 0
+        || options.cached_fraction > 1 || options.provides_fraction < 0 || options.provides_fraction > 1
+        || options.repo_count < 1
+        || options.keep_count < 0)
+    {
+        fprintf(stderr, "%s: invalid option value\n", argv[0]);
+        return 2;
+    }
+
+    if (options.seed == 0)
+    {
+        options.seed = 1; // xorshift would only ever return 0
+    }
+
+    if (make_dirs(argv[optind]) == -1)
+    {
+        perror("Failed to create output directory");
+        return 1;
+    }
+
+    char root_dir[PATH_MAX];
+    if (realpath(argv[optind], root_dir) == NULL)
+    {
+        perror("Failed to resolve output directory");
+        return 1;
+    }
+
+    // Start from empty databases so a previous run's packages don't linger
+    char db_dir[PATH_MAX + 16];
+    char local_dir[PATH_MAX + 32];
+    char sync_dir[PATH_MAX + 32];
+    char cache_dir[PATH_MAX + 32];
+    snprintf(db_dir, sizeof(db_dir), "%s/var/lib/pacman", root_dir);
+    snprintf(local_dir, sizeof(local_dir), "%s/local", db_dir);
+    snprintf(sync_dir, sizeof(sync_dir), "%s/sync", db_dir);
+    snprintf(cache_dir, sizeof(cache_dir), "%s/var/cache/pacman/pkg", root_dir);
+    remove_tree(db_dir);
+    remove_tree(cache_dir);
+
+    if (make_dirs(local_dir) == -1 || make_dirs(sync_dir) == -1 || make_dirs(cache_dir) == -1)
+    {
+        perror("Failed to create database directories");
+        return 1;
+    }
+
+    int err_return = 0;
+    gen_pkg_t *pkgs = generate_pkgs(&options);
+
+    if (write_local_db(local_dir, pkgs, &options) == -1)
+    {
+        perror("Failed to write local database");
+        err_return = 1;
+        goto exit;
+    }
+
+    for (int repo = 0; repo < options.repo_count; repo++)
+    {
+        if (write_sync_db(sync_dir, repo, pkgs, &options) == -1)
+        {
+            perror("Failed to write sync database");
+            err_return = 1;
+            goto exit;
+        }
+    }
+
+    if (write_pkg_cache(cache_dir, pkgs, &options) == -1)
+    {
+        perror("Failed to write package cache");
+        err_return = 1;
+        goto exit;
+    }
+
+    if (write_pacman_conf(root_dir, &options) == -1 || write_keep_file(root_dir, pkgs, &options) == -1)
+    {
+        perror("Failed to write configuration");
+        err_return = 1;
+        goto exit;
+    }
+
+    int upgrade_count = 0;
+    for (int i = 0; i < options.package_count; i++)
+    {
+        upgrade_count += strcmp(pkgs[i].old_version, pkgs[i].new_version) != 0;
+    }
+    printf("%s: %d packages, %d with upgrades, %d repos\n", root_dir, options.package_count, upgrade_count,
+           options.repo_count);
+
+exit:
+    free_pkgs(pkgs, options.package_count);
+
+    return err_return;
+}
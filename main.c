@@ -1,134 +1,226 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <locale.h>
+#include <wchar.h>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/uio.h>
 
 #include <alpm.h>
 #include <termbox.h>
 
-#define MAX_PACKAGE_NAME_SIZE 200
+// Tracing
+// When enabled (with --trace or LPS_TRACE), the time spent in each startup
+// phase is recorded along with counters of the work done, and written out as
+// Chrome trace-event JSON (viewable in chrome://tracing or Perfetto). A
+// one-line summary is also printed to stderr on exit.
 
-// alpm.h specific functions/structs
+#define TRACE_MAX_EVENTS 256
 
-typedef struct _pkg_state_t
+typedef struct _trace_event
 {
-    alpm_pkg_t *underlying_pkg;
-    bool is_selected;
-} pkg_state_t;
+    const char *name;
+    double start_ms;
+    double end_ms;
+    int thread_id; // 0 for the main thread, -1 for the loader thread, then 1 + the index of each worker
+} trace_event_t;
 
-typedef struct _pkg_state_list_t
+typedef struct _trace_counters
 {
-    pkg_state_t *ary;
-    int size;
-    int capacity;
-} pkg_state_list_t;
+    long packages_visited; // Packages walked by the closure or compared by the scan
+    long hash_probes; // Slots examined by name_set lookups
+    long allocations; // Allocations made to create or grow lps' data structures
+} trace_counters_t;
 
-void pkg_state_list_add_pkg(pkg_state_list_t *list, alpm_pkg_t *underlying_pkg)
+typedef struct _trace
 {
-    if (list->size >= list->capacity)
-    {
-        list->capacity *= 2;
-        list->ary = realloc(list->ary, sizeof(pkg_state_t) * list->capacity);
-    }
-    pkg_state_t *new_item = &list->ary[list->size];
-    new_item->underlying_pkg = underlying_pkg;
-    new_item->is_selected = false;
-    list->size++;
-}
-
-void pkg_state_list_delete_at(pkg_state_list_t *list, int index)
+    bool is_enabled;
+    const char *path;
+    double origin_ms; // Event times are written relative to this
+    trace_event_t events[TRACE_MAX_EVENTS];
+    int event_count; // Claimed with an atomic fetch-and-add, so workers can add events
+} trace_t;
+
+trace_t trace;
+trace_counters_t trace_counters;
+
+// The thread_id given to phases recorded by code that runs on either the main
+// or the loader thread
+__thread int trace_thread_id = 0;
+
+// Returns the current time of the monotonic clock, in milliseconds
+double get_time_ms()
 {
-    memmove(&list->ary[index], &list->ary[index + 1], sizeof(pkg_state_t) * (list->size - index));
-    list->size--;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
 }
 
-pkg_state_list_t *pkg_state_list_new(int capacity)
+void trace_init(const char *path)
 {
-    pkg_state_list_t *list = malloc(sizeof(pkg_state_list_t));
-    list->ary = malloc(sizeof(pkg_state_t) * capacity);
-    list->size = 0;
-    list->capacity = capacity;
-    return list;
+    trace.is_enabled = path != NULL && path[0] != '\0';
+    trace.path = path;
+    trace.origin_ms = get_time_ms();
+    trace.event_count = 0;
 }
 
-void pkg_state_list_free(pkg_state_list_t *list)
+// Records that the phase called name ran from start_ms until now. name must
+// outlive the trace (string literals are what's expected).
+void trace_record(const char *name, double start_ms, int thread_id)
 {
-    // This deallocates any allocated pkg_state_t *s
-    free(list->ary);
+    if (!trace.is_enabled)
+    {
+        return;
+    }
 
-    free(list);
+    const double end_ms = get_time_ms();
+    const int index = __atomic_fetch_add(&trace.event_count, 1, __ATOMIC_RELAXED);
+    if (index >= TRACE_MAX_EVENTS)
+    {
+        return;
+    }
+
+    trace.events[index].name = name;
+    trace.events[index].start_ms = start_ms;
+    trace.events[index].end_ms = end_ms;
+    trace.events[index].thread_id = thread_id;
 }
 
-// Compare the size of two alpm_pkg_t *s based off of their
-// installed sizes.
-int compare_pkgs(const void *_pkg_1, const void *_pkg_2)
+void trace_count(long *counter, long amount)
 {
-    alpm_pkg_t *pkg_1 = (alpm_pkg_t *)_pkg_1;
-    alpm_pkg_t *pkg_2 = (alpm_pkg_t *)_pkg_2;
-
-    const int isize_1 = alpm_pkg_get_isize(pkg_1);
-    const int isize_2 = alpm_pkg_get_isize(pkg_2);
-
-    return isize_2 - isize_1;
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
 }
 
-int compare_pkg_states(const void *_pkg_state_1, const void *_pkg_state_2)
+// Writes the Chrome trace-event file, then the summary line on stderr
+void trace_finish()
 {
-    pkg_state_t *pkg_state_1 = (pkg_state_t *)_pkg_state_1;
-    pkg_state_t *pkg_state_2 = (pkg_state_t *)_pkg_state_2;
+    if (!trace.is_enabled)
+    {
+        return;
+    }
 
-    const int isize_1 = alpm_pkg_get_isize(pkg_state_1->underlying_pkg);
-    const int isize_2 = alpm_pkg_get_isize(pkg_state_2->underlying_pkg);
+    const int event_count = trace.event_count < TRACE_MAX_EVENTS ? trace.event_count : TRACE_MAX_EVENTS;
+    const double end_ms = get_time_ms();
 
-    return isize_2 - isize_1;
-}
+    FILE *file = fopen(trace.path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to write trace to %s: %s\n", trace.path, strerror(errno));
+    }
+    else
+    {
+        const int pid = getpid();
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"lps\"}}", pid);
 
-// termbox.h specific functions
+        for (int i = 0; i < event_count; i++)
+        {
+            const trace_event_t *event = &trace.events[i];
+            // Timestamps are in microseconds
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"lps\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    event->name, (event->start_ms - trace.origin_ms) * 1000.0,
+                    (event->end_ms - event->start_ms) * 1000.0, pid, event->thread_id);
+        }
 
-void write_str(int x, int y, const char *line, uint32_t fg, uint32_t bg)
-{
-    while (*line != '\0')
+        fprintf(file, ",\n{\"name\":\"work\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"tid\":0,"
+                      "\"args\":{\"packages_visited\":%ld,\"hash_probes\":%ld,\"allocations\":%ld}}",
+                (end_ms - trace.origin_ms) * 1000.0, pid, trace_counters.packages_visited,
+                trace_counters.hash_probes, trace_counters.allocations);
+
+        fprintf(file, "\n]}\n");
+        fclose(file);
+    }
+
+    fprintf(stderr, "lps trace:");
+    for (int i = 0; i < event_count; i++)
     {
-        tb_change_cell(x, y, *line, fg, bg);
-        line++;
-        x++;
+        // Worker threads' events overlap the main and loader threads', so leave them out
+        if (trace.events[i].thread_id <= 0)
+        {
+            fprintf(stderr, " %s %.2fms,", trace.events[i].name, trace.events[i].end_ms - trace.events[i].start_ms);
+        }
     }
+    fprintf(stderr, " total %.2fms; %ld packages visited, %ld hash probes, %ld allocations -> %s\n",
+            end_ms - trace.origin_ms, trace_counters.packages_visited, trace_counters.hash_probes,
+            trace_counters.allocations, trace.path);
 }
 
-// miscellaneous functions
+// Interned package names
+// Every name is stored exactly once in a name_arena_t, and is referred to by
+// a small pkg_name_t handle instead of by a copy of its characters.
 
-int min(int a, int b)
+typedef struct _pkg_name
 {
-    return a < b ? a : b;
-}
+    uint32_t offset; // Position of the name's first character in the arena
+    uint32_t size; // Length of the name, excluding the NUL char
+    uint32_t hash_value; // Cached hash of the name's characters
+} pkg_name_t;
 
-// File size formatter based off of
-// https://stackoverflow.com/questions/3898840/converting-a-number-of-bytes-into-a-file-size-in-c
-void read_size(char *buf, size_t capacity, size_t size)
+// The arena is split into blocks which never move once allocated, so
+// pointers returned by name_arena_str stay valid as the arena grows.
+// Block k holds NAME_ARENA_BLOCK_SIZE << k bytes, and starts at offset
+// NAME_ARENA_BLOCK_SIZE * (2^k - 1).
+#define NAME_ARENA_BLOCK_SIZE 4096
+#define NAME_ARENA_MAX_BLOCKS 20
+
+typedef struct _name_arena
 {
-    static const char *SIZES[] = { "B", "kiB", "MiB", "GiB" };
-    size_t div = 0;
-    size_t rem = 0;
+    char *blocks[NAME_ARENA_MAX_BLOCKS];
+    int block_count; // The number of allocated blocks
+    uint32_t size; // Offset of the next free byte
+    struct _name_set *index; // Every interned name, used to deduplicate them
+} name_arena_t;
 
-    while (size >= 1024 && div < (sizeof SIZES / sizeof *SIZES)) {
-        rem = (size % 1024);
-        div++;
-        size /= 1024;
-    }
+// Defined after name_set_t, which they rely on
+pkg_name_t name_arena_intern_n(name_arena_t *arena, const char *str, size_t size);
+pkg_name_t name_arena_intern(name_arena_t *arena, const char *str);
 
-    snprintf(buf, capacity, "%.1f %s", (float)size + (float)rem / 1024.0, SIZES[div]);
+int name_arena_block_of(uint32_t offset)
+{
+    return 63 - __builtin_clzll((uint64_t)offset / NAME_ARENA_BLOCK_SIZE + 1);
 }
 
+uint32_t name_arena_block_start(int block)
+{
+    return NAME_ARENA_BLOCK_SIZE * (((uint32_t)1 << block) - 1);
+}
 
-// FIXME(Chris): Remove if unnecessary
-typedef struct _pkg_name
+// Returns a NUL-terminated pointer to the characters of name
+const char *name_arena_str(const name_arena_t *arena, pkg_name_t name)
 {
-    char name[MAX_PACKAGE_NAME_SIZE];
-    int size; // Size including NUL char
-} pkg_name_t;
+    const int block = name_arena_block_of(name.offset);
+    return &arena->blocks[block][name.offset - name_arena_block_start(block)];
+}
+
+bool pkg_name_eql(const name_arena_t *arena, pkg_name_t name, const char *str, size_t size, uint32_t hash_value)
+{
+    return name.hash_value == hash_value && name.size == size && memcmp(name_arena_str(arena, name), str, size) == 0;
+}
 
 typedef struct _pkg_name_list
 {
@@ -141,562 +233,8391 @@ pkg_name_list_t *pkg_name_list_new(int capacity)
 {
     pkg_name_list_t *list = malloc(sizeof(pkg_name_list_t));
     list->names = malloc(sizeof(pkg_name_t) * capacity);
+    trace_count(&trace_counters.allocations, 2);
     list->size = 0;
     list->capacity = capacity;
     return list;
 }
 
-pkg_name_t *pkg_name_new(pkg_name_list_t *list)
+void pkg_name_list_add(pkg_name_list_t *list, pkg_name_t name)
 {
     if (list->size >= list->capacity)
     {
         list->capacity *= 2;
         list->names = realloc(list->names, sizeof(pkg_name_t) * list->capacity);
+        trace_count(&trace_counters.allocations, 1);
     }
 
-    pkg_name_t *new_name = &list->names[list->size];
-    new_name->name[0] = '\0';
-    // Size is 1 because of the NUL character. strlen(name) would be 0.
-    new_name->size = 1;
+    list->names[list->size] = name;
     list->size++;
+}
 
-    return new_name;
+void pkg_name_list_delete_at(pkg_name_list_t *list, int index)
+{
+    memmove(&list->names[index], &list->names[index + 1], sizeof(pkg_name_t) * (list->size - index - 1));
+    list->size--;
 }
 
 void pkg_name_list_free(pkg_name_list_t *list)
 {
+    if (list == NULL)
+    {
+        return;
+    }
+
     free(list->names);
 
     free(list);
 }
 
-// Returns the number of characters read from *str_ref into buf
-int read_word(const char **str_ref, char *buf, int capacity)
+// alpm.h specific functions/structs
+
+// The fields of an upgrade candidate which are only read one package at a
+// time (e.g. for the details pane), rather than by passes over the list
+typedef struct _pkg_state_t
 {
-    int idx = 0;
-    while (true)
-    {
-        buf[idx] = **str_ref;
-        idx++;
+    alpm_pkg_t *underlying_pkg; // The new version, or NULL until pkg_state_get_pkg looks it up
+    off_t old_isize; // Installed size of the installed version
+    bool is_cached; // Whether the new version's archive is already in a CacheDir
+    bool is_new; // Whether the package wasn't an upgrade candidate in the previous run
+    // Set for a package taken from a daemon, so that an attached session
+    // never reads the databases for them
+    bool has_details;
+    pkg_name_t old_version; // The installed version, if has_details
+    pkg_name_t desc; // The new version's description, if has_details
+} pkg_state_t;
 
-        if (**str_ref == ' ')
-        {
-            *str_ref = &(*str_ref)[1];
-            break;
-        }
+// The upgrade candidates are stored as parallel arrays, one per field that
+// sorting, filtering, totalling or printing the list reads, so that each pass
+// only touches the fields it needs, contiguously. The rest of each package is
+// in ary. The selection is one bit per package, so that selecting or
+// inverting the whole list, or counting the selection, works on 64 packages at
+// a time. Everything that moves packages within the list moves every field
+// (and the bit) with them, through pkg_state_list_copy.
+typedef struct _pkg_state_list_t
+{
+    pkg_name_t *names;
+    pkg_name_t *new_versions;
+    off_t *isizes; // Installed size of the new version
+    off_t *download_sizes; // Size of the new version's package file
+    int *repo_indices; // Position of the new version's syncdb in dbs_sync, or -1
+    uint64_t *sort_keys; // For the mode the list was last sorted by
+    pkg_state_t *ary;
+    uint64_t *selection; // (capacity + 63) / 64 words, where the bits past size are 0
+    int size;
+    int capacity;
+} pkg_state_list_t;
 
-        if (**str_ref == '\0')
-        {
-            break;
-        }
+int selection_word_count(int size)
+{
+    return (size + 63) / 64;
+}
 
-        // Update the single pointer of str_ref to be one item ahead.
-        *str_ref = &(*str_ref)[1];
+bool pkg_state_list_is_selected(const pkg_state_list_t *list, int index)
+{
+    return (list->selection[index / 64] >> (index % 64)) & 1;
+}
 
-        if (idx >= capacity)
-        {
-            buf[capacity - 1] = '\0';
-            break;
-        }
+void pkg_state_list_set_selected(pkg_state_list_t *list, int index, bool is_selected)
+{
+    const uint64_t bit = (uint64_t)1 << (index % 64);
+    if (is_selected)
+    {
+        list->selection[index / 64] |= bit;
     }
+    else
+    {
+        list->selection[index / 64] &= ~bit;
+    }
+}
 
-    buf[idx - 1] = '\0';
-
-    return idx;
+// Clears the bits past the end of the list, after a whole-word operation
+void pkg_state_list_mask_selection(pkg_state_list_t *list)
+{
+    if (list->size % 64 != 0)
+    {
+        list->selection[list->size / 64] &= ((uint64_t)1 << (list->size % 64)) - 1;
+    }
+    for (int i = selection_word_count(list->size); i < selection_word_count(list->capacity); i++)
+    {
+        list->selection[i] = 0;
+    }
 }
 
-// Hash table implementation, which stores a pkg_name_t *
-// Much thanks to https://benhoyt.com/writings/hash-table-in-c/
+void pkg_state_list_select_all(pkg_state_list_t *list, bool is_selected)
+{
+    memset(list->selection, is_selected ? 0xFF : 0, sizeof(uint64_t) * selection_word_count(list->size));
+    pkg_state_list_mask_selection(list);
+}
 
-typedef struct _name_set_item
+void pkg_state_list_invert_selection(pkg_state_list_t *list)
 {
-    unsigned long hash_value;
-    pkg_name_t pkg_name; // Our key, though we store no value
-    bool is_taken; // Will be set to 0 by default in calloc
-} name_set_item_t;
+    for (int i = 0; i < selection_word_count(list->size); i++)
+    {
+        list->selection[i] = ~list->selection[i];
+    }
+    pkg_state_list_mask_selection(list);
+}
 
-typedef struct _name_set
+int pkg_state_list_selected_count(const pkg_state_list_t *list)
 {
-    name_set_item_t *items;
-    size_t size;
-    size_t capacity; // Should always be powers of 2
-} name_set_t;
+    int count = 0;
+    for (int i = 0; i < selection_word_count(list->size); i++)
+    {
+        count += __builtin_popcountll(list->selection[i]);
+    }
+    return count;
+}
 
-// Dan Bernstein's djb2
-// From http://www.cse.yorku.ca/~oz/hash.html
-unsigned long hash(const char *str)
+// Returns the index of the first selected package at or after index, or -1
+int pkg_state_list_next_selected(const pkg_state_list_t *list, int index)
 {
-    unsigned long hash = 5381;
-    int c;
+    if (index >= list->size)
+    {
+        return -1;
+    }
+
+    int word_index = index / 64;
+    uint64_t word = list->selection[word_index] & (~(uint64_t)0 << (index % 64));
+    while (word == 0)
+    {
+        if (++word_index >= selection_word_count(list->size))
+        {
+            return -1;
+        }
+        word = list->selection[word_index];
+    }
+    return word_index * 64 + __builtin_ctzll(word);
+}
 
-    while ((c = *str++))
+// Grows the arrays and the selection to hold at least capacity packages
+void pkg_state_list_reserve(pkg_state_list_t *list, int capacity)
+{
+    if (capacity <= list->capacity)
     {
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
+        return;
     }
 
-    return hash;
+    const int old_word_count = selection_word_count(list->capacity);
+    while (list->capacity < capacity)
+    {
+        list->capacity *= 2;
+    }
+    const int word_count = selection_word_count(list->capacity);
+
+    list->names = realloc(list->names, sizeof(pkg_name_t) * list->capacity);
+    list->new_versions = realloc(list->new_versions, sizeof(pkg_name_t) * list->capacity);
+    list->isizes = realloc(list->isizes, sizeof(off_t) * list->capacity);
+    list->download_sizes = realloc(list->download_sizes, sizeof(off_t) * list->capacity);
+    list->repo_indices = realloc(list->repo_indices, sizeof(int) * list->capacity);
+    list->sort_keys = realloc(list->sort_keys, sizeof(uint64_t) * list->capacity);
+    list->ary = realloc(list->ary, sizeof(pkg_state_t) * list->capacity);
+    list->selection = realloc(list->selection, sizeof(uint64_t) * word_count);
+    memset(list->selection + old_word_count, 0, sizeof(uint64_t) * (word_count - old_word_count));
+    trace_count(&trace_counters.allocations, 8);
 }
 
-name_set_t *name_set_new()
+// Adds an empty package to the end of list, and returns its index
+int pkg_state_list_add(pkg_state_list_t *list)
 {
-    name_set_t *set = malloc(sizeof(name_set_t));
-    set->capacity = 4;
-    set->size = 0;
-    set->items = calloc(set->capacity, sizeof(name_set_item_t));
-    return set;
+    pkg_state_list_reserve(list, list->size + 1);
+    const int index = list->size;
+    memset(&list->names[index], 0, sizeof(pkg_name_t));
+    memset(&list->new_versions[index], 0, sizeof(pkg_name_t));
+    list->isizes[index] = 0;
+    list->download_sizes[index] = 0;
+    list->repo_indices[index] = -1;
+    list->sort_keys[index] = 0;
+    memset(&list->ary[index], 0, sizeof(pkg_state_t));
+    pkg_state_list_set_selected(list, index, false);
+    list->size++;
+    return index;
 }
 
-void linear_probe_insert(name_set_item_t *items, size_t capacity, const pkg_name_t *pkg_name, unsigned long hash_value)
+// Copies every field of the package at src_index in src (and its selection
+// bit) over the package at dest_index in dest, which may be the same list
+void pkg_state_list_copy(pkg_state_list_t *dest, int dest_index, const pkg_state_list_t *src, int src_index)
 {
-    size_t index = (size_t)(hash_value & (unsigned long)(capacity - 1));
+    dest->names[dest_index] = src->names[src_index];
+    dest->new_versions[dest_index] = src->new_versions[src_index];
+    dest->isizes[dest_index] = src->isizes[src_index];
+    dest->download_sizes[dest_index] = src->download_sizes[src_index];
+    dest->repo_indices[dest_index] = src->repo_indices[src_index];
+    dest->sort_keys[dest_index] = src->sort_keys[src_index];
+    dest->ary[dest_index] = src->ary[src_index];
+    pkg_state_list_set_selected(dest, dest_index, pkg_state_list_is_selected(src, src_index));
+}
 
-    // Do a linear probe for insertion
-    for (; index < capacity; index++)
+// Adds the new version underlying_pkg of the installed local_pkg
+void pkg_state_list_add_pkg(pkg_state_list_t *list, name_arena_t *arena, alpm_pkg_t *underlying_pkg, alpm_pkg_t *local_pkg, alpm_list_t *dbs_sync)
+{
+    const int index = pkg_state_list_add(list);
+    list->ary[index].underlying_pkg = underlying_pkg;
+    list->names[index] = name_arena_intern(arena, alpm_pkg_get_name(underlying_pkg));
+    list->new_versions[index] = name_arena_intern(arena, alpm_pkg_get_version(underlying_pkg));
+    list->isizes[index] = alpm_pkg_get_isize(underlying_pkg);
+    list->download_sizes[index] = alpm_pkg_get_size(underlying_pkg);
+    list->ary[index].old_isize = local_pkg != NULL ? alpm_pkg_get_isize(local_pkg) : 0;
+
+    alpm_db_t *db = alpm_pkg_get_db(underlying_pkg);
+    int repo_index = 0;
+    for (alpm_list_t *curr = dbs_sync; curr != NULL; curr = curr->next, repo_index++)
     {
-        if (!items[index].is_taken)
+        if (curr->data == db)
         {
-            items[index].pkg_name = *pkg_name;
-            items[index].hash_value = hash_value;
-            items[index].is_taken = true;
+            list->repo_indices[index] = repo_index;
             break;
         }
     }
 }
 
-void name_set_add_cpy(name_set_t *name_set, const pkg_name_t *pkg_name)
+// Returns the new version of the package at index, looking it up in the
+// syncdbs if it hasn't been needed before (e.g. if it was loaded from the cache)
+alpm_pkg_t *pkg_state_get_pkg(pkg_state_list_t *list, int index, const name_arena_t *arena, alpm_list_t *dbs_sync)
 {
-    name_set->size++;
+    pkg_state_t *state = &list->ary[index];
+    const char *name = name_arena_str(arena, list->names[index]);
 
-    if (name_set->size >= name_set->capacity / 2)
+    for (alpm_list_t *curr = dbs_sync; state->underlying_pkg == NULL && curr != NULL; curr = curr->next)
     {
-        const size_t orig_capacity = name_set->capacity;
-        name_set->capacity *= 2;
-        // name_set->items = realloc(name_set->items, sizeof(name_set_item_t) * name_set->capacity);
-        name_set_item_t *new_items = calloc(name_set->capacity, sizeof(name_set_item_t));
-        for (int i = 0; i < orig_capacity; i++)
+        state->underlying_pkg = alpm_db_get_pkg((alpm_db_t *)curr->data, name);
+    }
+
+    return state->underlying_pkg;
+}
+
+// Returns the description of the new version of the package at index, or ""
+const char *pkg_state_get_desc(pkg_state_list_t *list, int index, const name_arena_t *arena, alpm_list_t *dbs_sync)
+{
+    if (list->ary[index].has_details)
+    {
+        return name_arena_str(arena, list->ary[index].desc);
+    }
+
+    alpm_pkg_t *underlying_pkg = pkg_state_get_pkg(list, index, arena, dbs_sync);
+    const char *desc = underlying_pkg == NULL ? NULL : alpm_pkg_get_desc(underlying_pkg);
+    return desc == NULL ? "" : desc;
+}
+
+// The number of bytes pacman would have to download for the package at index
+off_t pkg_state_download_cost(const pkg_state_list_t *list, int index)
+{
+    return list->ary[index].is_cached ? 0 : list->download_sizes[index];
+}
+
+pkg_state_list_t *pkg_state_list_new(int capacity)
+{
+    pkg_state_list_t *list = malloc(sizeof(pkg_state_list_t));
+    list->names = malloc(sizeof(pkg_name_t) * capacity);
+    list->new_versions = malloc(sizeof(pkg_name_t) * capacity);
+    list->isizes = malloc(sizeof(off_t) * capacity);
+    list->download_sizes = malloc(sizeof(off_t) * capacity);
+    list->repo_indices = malloc(sizeof(int) * capacity);
+    list->sort_keys = malloc(sizeof(uint64_t) * capacity);
+    list->ary = malloc(sizeof(pkg_state_t) * capacity);
+    list->selection = calloc(selection_word_count(capacity), sizeof(uint64_t));
+    trace_count(&trace_counters.allocations, 9);
+    list->size = 0;
+    list->capacity = capacity;
+    return list;
+}
+
+void pkg_state_list_free(pkg_state_list_t *list)
+{
+    free(list->names);
+    free(list->new_versions);
+    free(list->isizes);
+    free(list->download_sizes);
+    free(list->repo_indices);
+    free(list->sort_keys);
+    free(list->ary);
+    free(list->selection);
+
+    free(list);
+}
+
+// Sorting
+// Every sort mode maps a package to a 64-bit key, where smaller keys come
+// first. A sort extracts the keys into a compact array once, radix sorts that
+// (skipping the bytes which are the same in every key), and then moves the
+// packages into place in a single pass. Packages with equal keys are ordered
+// by name.
+
+typedef enum _sort_mode
+{
+    SORT_INSTALLED_SIZE, // Largest first
+    SORT_DOWNLOAD_SIZE, // Largest first, where cached packages count as 0
+    SORT_SIZE_CHANGE, // Largest growth of the installed size first
+    SORT_NAME,
+    SORT_REPO, // In pacman.conf's order, largest first within each repo
+    SORT_MODE_COUNT,
+} sort_mode_t;
+
+// As accepted by --sort
+const char *sort_mode_names[SORT_MODE_COUNT] = {"isize", "dsize", "delta", "name", "repo"};
+const char *sort_mode_labels[SORT_MODE_COUNT] = {"installed size", "download size", "size change", "name", "repo"};
+
+typedef struct _sort_entry
+{
+    uint64_t key;
+    int index; // Of the package in the list
+} sort_entry_t;
+
+// Maps sizes so that the largest get the smallest keys
+uint64_t descending_size_key(off_t size)
+{
+    return UINT64_MAX - (uint64_t)(size < 0 ? 0 : size);
+}
+
+uint64_t pkg_state_sort_key(const pkg_state_list_t *list, int index, sort_mode_t mode, const name_arena_t *arena)
+{
+    switch (mode)
+    {
+    case SORT_DOWNLOAD_SIZE:
+        return descending_size_key(pkg_state_download_cost(list, index));
+    case SORT_SIZE_CHANGE:
+        if (true)
+        {
+            // Flipping the sign bit orders signed values as unsigned ones
+            const int64_t delta = (int64_t)list->isizes[index] - (int64_t)list->ary[index].old_isize;
+            return ~((uint64_t)delta ^ (1ULL << 63));
+        }
+    case SORT_NAME:
+        if (true)
+        {
+            // The first 8 bytes, big-endian; ties are broken by the full name
+            const pkg_name_t name = list->names[index];
+            const char *name_str = name_arena_str(arena, name);
+            uint64_t key = 0;
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                key = key << 8 | (i < name.size ? (unsigned char)name_str[i] : 0);
+            }
+            return key;
+        }
+    case SORT_REPO:
+        if (true)
         {
-            if (name_set->items[i].is_taken)
+            const uint64_t size_mask = (1ULL << 56) - 1;
+            const int repo_index = list->repo_indices[index];
+            const uint64_t repo = repo_index < 0 || repo_index > 254 ? 255 : repo_index;
+            uint64_t size = list->isizes[index] < 0 ? 0 : (uint64_t)list->isizes[index];
+            if (size > size_mask)
             {
-                linear_probe_insert(new_items, name_set->capacity, &name_set->items[i].pkg_name, name_set->items[i].hash_value);
+                size = size_mask;
             }
+            return repo << 56 | (size_mask - size);
         }
-        free(name_set->items);
-        name_set->items = new_items;
+    default:
+        return descending_size_key(list->isizes[index]);
+    }
+}
+
+// Orders packages by the keys of their last sort, then by name
+int compare_pkg_states(const pkg_state_list_t *list_1, int index_1, const pkg_state_list_t *list_2, int index_2, const name_arena_t *arena)
+{
+    if (list_1->sort_keys[index_1] != list_2->sort_keys[index_2])
+    {
+        return list_1->sort_keys[index_1] < list_2->sort_keys[index_2] ? -1 : 1;
     }
 
-    unsigned long hash_value = hash(pkg_name->name);
-    linear_probe_insert(name_set->items, name_set->capacity, pkg_name, hash_value);
+    return strcmp(name_arena_str(arena, list_1->names[index_1]), name_arena_str(arena, list_2->names[index_2]));
 }
 
-void name_set_add_cpy_cstr(name_set_t *name_set, const char *str)
+typedef struct _sort_context
 {
-    pkg_name_t pkg_name;
-    snprintf(pkg_name.name, MAX_PACKAGE_NAME_SIZE, "%s", str);
-    pkg_name.size = strlen(str) + 1;
+    const pkg_state_list_t *list;
+    const name_arena_t *arena;
+} sort_context_t;
 
-    name_set_add_cpy(name_set, &pkg_name);
+// Orders the entries of a run of equal keys by the names of their packages
+int compare_sort_entries_r(const void *_entry_1, const void *_entry_2, void *_context)
+{
+    const sort_context_t *context = (const sort_context_t *)_context;
+    const sort_entry_t *entry_1 = (const sort_entry_t *)_entry_1;
+    const sort_entry_t *entry_2 = (const sort_entry_t *)_entry_2;
+    return strcmp(name_arena_str(context->arena, context->list->names[entry_1->index]),
+                  name_arena_str(context->arena, context->list->names[entry_2->index]));
 }
 
-// TODO(Chris): Move this to be with other pkg_name functions
-bool pkg_name_eql(const pkg_name_t *pkg_name_1, const pkg_name_t *pkg_name_2)
+// Returns the packages of list in the order mode sorts them in, along with
+// their keys, without moving them. The caller frees the entries.
+sort_entry_t *pkg_state_list_order(const pkg_state_list_t *list, sort_mode_t mode, const name_arena_t *arena)
 {
-    if (pkg_name_1->size != pkg_name_2->size)
+    const int size = list->size;
+    sort_entry_t *entries = malloc(sizeof(sort_entry_t) * (size + 1));
+    sort_entry_t *scratch = malloc(sizeof(sort_entry_t) * (size + 1));
+    trace_count(&trace_counters.allocations, 2);
+
+    uint64_t differing_bits = 0;
+    for (int i = 0; i < size; i++)
     {
-        return false;
+        entries[i].key = pkg_state_sort_key(list, i, mode, arena);
+        entries[i].index = i;
+        differing_bits |= entries[i].key ^ entries[0].key;
     }
 
-    for (int i = 0; i < pkg_name_1->size && i < pkg_name_2->size; i++)
+    // Least significant byte first, which keeps each pass stable
+    for (int shift = 0; shift < 64; shift += 8)
     {
-        if (pkg_name_1->name[i] != pkg_name_2->name[i])
+        if (((differing_bits >> shift) & 0xFF) == 0)
         {
-            return false;
+            continue;
         }
-    }
 
-    return true;
-}
+        int counts[256];
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < size; i++)
+        {
+            counts[(entries[i].key >> shift) & 0xFF]++;
+        }
 
-bool name_set_has(name_set_t *name_set, const pkg_name_t *pkg_name)
-{
-    unsigned long hash_value = hash(pkg_name->name);
-    size_t index = (size_t)(hash_value & (unsigned long)(name_set->capacity - 1));
+        int offset = 0;
+        for (int digit = 0; digit < 256; digit++)
+        {
+            const int count = counts[digit];
+            counts[digit] = offset;
+            offset += count;
+        }
 
-    while (name_set->items[index].is_taken)
-    {
-        if (name_set->items[index].hash_value == hash_value && pkg_name_eql(&name_set->items[index].pkg_name, pkg_name))
+        for (int i = 0; i < size; i++)
         {
-            return true;
+            scratch[counts[(entries[i].key >> shift) & 0xFF]++] = entries[i];
         }
 
-        index++;
+        sort_entry_t *swap = entries;
+        entries = scratch;
+        scratch = swap;
+    }
+
+    // Runs of equal keys are usually short, except for names with a common
+    // 8-byte prefix (e.g. haskell-)
+    sort_context_t context = {list, arena};
+    for (int start = 0; start < size;)
+    {
+        int end = start + 1;
+        while (end < size && entries[end].key == entries[start].key)
+        {
+            end++;
+        }
 
-        if (index >= name_set->capacity)
+        if (end - start > 1)
         {
-            index = 0;
+            qsort_r(&entries[start], end - start, sizeof(sort_entry_t), compare_sort_entries_r, &context);
         }
+        start = end;
     }
 
-    return false;
+    free(scratch);
+    return entries;
 }
 
-bool name_set_has_cstr(name_set_t *name_set, char *str)
+// Sorts list by mode. *tracked_index (if it isn't NULL) is updated to keep
+// indexing the same package.
+void pkg_state_list_sort(pkg_state_list_t *list, sort_mode_t mode, const name_arena_t *arena, int *tracked_index)
 {
-    pkg_name_t pkg_name;
-    snprintf(pkg_name.name, MAX_PACKAGE_NAME_SIZE, "%s", str);
-    pkg_name.size = strlen(str) + 1;
+    const int size = list->size;
+    sort_entry_t *entries = pkg_state_list_order(list, mode, arena);
+
+    // The packages and their selection bits are moved into place once, into
+    // new arrays which then replace list's
+    pkg_state_list_t *sorted = pkg_state_list_new(list->capacity);
+    const int old_tracked_index = tracked_index != NULL ? *tracked_index : -1;
+    for (int i = 0; i < size; i++)
+    {
+        const int old_index = entries[i].index;
+        pkg_state_list_copy(sorted, i, list, old_index);
+        sorted->sort_keys[i] = entries[i].key;
+        if (old_index == old_tracked_index)
+        {
+            *tracked_index = i;
+        }
+    }
+    sorted->size = size;
+
+    const pkg_state_list_t unsorted = *list;
+    *list = *sorted;
+    *sorted = unsorted;
+    pkg_state_list_free(sorted);
 
-    return name_set_has(name_set, &pkg_name);
+    free(entries);
 }
 
-void name_set_add_dependencies(name_set_t *name_set, alpm_db_t *localdb, char *name)
+// Merges additions into list in a single pass, where both were sorted by the
+// same mode. Packages already in list stay ahead of equal additions.
+// *tracked_index (if it isn't NULL) is updated to keep indexing the same
+// package of list.
+void pkg_state_list_merge_sorted(pkg_state_list_t *list, const pkg_state_list_t *additions, const name_arena_t *arena, int *tracked_index)
 {
-    // printf("%s\n", name);
+    const int new_size = list->size + additions->size;
+    pkg_state_list_reserve(list, new_size);
 
-    alpm_pkg_t *pkg = alpm_db_get_pkg(localdb, name);
-    if (pkg != NULL && !name_set_has_cstr(name_set, name))
+    // Fill in from the back, so that nothing is overwritten before it's moved
+    int i = list->size - 1;
+    int j = additions->size - 1;
+    for (int out = new_size - 1; j >= 0; out--)
     {
-        name_set_add_cpy_cstr(name_set, name);
-
-        alpm_list_t *deps = alpm_pkg_get_depends(pkg);
-        if (deps != NULL) // NULL deps means that there are no dependencies
+        if (i >= 0 && compare_pkg_states(list, i, additions, j, arena) > 0)
         {
-            // printf("deps size: %lu\n", alpm_list_count(deps));
-            for (alpm_list_t *curr = deps; curr != NULL; curr = curr->next)
+            if (tracked_index != NULL && *tracked_index == i)
             {
-                alpm_depend_t *dependency = (alpm_depend_t *)curr->data;
-                // printf("\t%s\n", dependency->name);
-                name_set_add_dependencies(name_set, localdb, dependency->name);
+                *tracked_index = out;
             }
+            pkg_state_list_copy(list, out, list, i--);
+        }
+        else
+        {
+            pkg_state_list_copy(list, out, additions, j--);
         }
     }
+
+    list->size = new_size;
 }
 
+// termbox.h specific functions
+
+// The number of cells changed through change_cell since the start of the frame
+long cells_written = 0;
 
-void name_set_free(name_set_t *set)
+void change_cell(int x, int y, uint32_t ch, uint32_t fg, uint32_t bg)
 {
-    free(set->items);
-    free(set);
+    tb_change_cell(x, y, ch, fg, bg);
+    cells_written++;
 }
 
-int main()
+void write_str(int x, int y, const char *line, uint32_t fg, uint32_t bg)
 {
-    int err_return = 0;
-    int tb_err = 0;
+    while (*line != '\0')
+    {
+        change_cell(x, y, *line, fg, bg);
+        line++;
+        x++;
+    }
+}
 
-    FILE *keep_file = NULL;
-    pkg_name_list_t *keep_package_names = NULL;
-    pkg_name_list_t *unfound_package_names = NULL;
-    name_set_t *dependencies_set = NULL;
+// miscellaneous functions
+
+int min(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+int max(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+// File size formatter based off of
+// https://stackoverflow.com/questions/3898840/converting-a-number-of-bytes-into-a-file-size-in-c
+void read_size(char *buf, size_t capacity, size_t size)
+{
+    static const char *SIZES[] = { "B", "kiB", "MiB", "GiB" };
+    size_t div = 0;
+    size_t rem = 0;
+
+    while (size >= 1024 && div < (sizeof SIZES / sizeof *SIZES)) {
+        rem = (size % 1024);
+        div++;
+        size /= 1024;
+    }
+
+    snprintf(buf, capacity, "%.1f %s", (float)size + (float)rem / 1024.0, SIZES[div]);
+}
+
+
+// Hash table implementation, which maps interned names to int ids
+// This uses Robin Hood hashing: an insertion which has probed further from its
+// home slot than the item it's looking at takes that slot, and keeps going
+// with the displaced item instead. Probe lengths stay short and even at high
+// load factors, and lookups can stop as soon as they've probed further than
+// the item in the current slot.
+
+#define NAME_SET_DEFAULT_MAX_LOAD 0.8
+#define NAME_SET_HISTOGRAM_SIZE 16
+
+typedef struct _name_set_item
+{
+    pkg_name_t pkg_name; // Our key
+    int id; // The value associated with pkg_name (e.g. a package ID)
+    uint32_t distance; // 1 + the distance from the key's home slot, or 0 if empty
+} name_set_item_t;
+
+typedef struct _name_set
+{
+    const name_arena_t *arena; // Holds the characters of every key
+    name_set_item_t *items;
+    size_t size;
+    size_t capacity; // Should always be powers of 2
+    double max_load; // The set grows when size / capacity would exceed this
+    long lookup_count; // The number of lookups made so far
+    long probe_count; // The number of slots those lookups examined
+} name_set_t;
+
+typedef struct _name_set_stats
+{
+    size_t size;
+    size_t capacity;
+    double load_factor;
+    double mean_probe_length; // Slots examined by a successful lookup, on average
+    int max_probe_length;
+    long lookup_count; // Lookups made over the set's lifetime
+    long probe_count; // Slots examined by those lookups (including unsuccessful ones)
+    size_t probe_histogram[NAME_SET_HISTOGRAM_SIZE]; // The last bucket also counts longer probes
+} name_set_stats_t;
+
+// The max load factor used by name_set_new
+double name_set_default_max_load = NAME_SET_DEFAULT_MAX_LOAD;
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+// Continues a 64-bit FNV-1a hash over size more bytes
+uint64_t fnv1a_64(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// 64-bit FNV-1a, followed by the MurmurHash3 finalizer so that the low bits
+// (which pick the home slot) depend on every character
+uint32_t hash(const char *str, size_t size)
+{
+    uint64_t hash = fnv1a_64(FNV_OFFSET_BASIS, str, size);
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return (uint32_t)hash;
+}
+
+name_set_t *name_set_new_with_load(const name_arena_t *arena, double max_load)
+{
+    name_set_t *set = malloc(sizeof(name_set_t));
+    set->arena = arena;
+    set->capacity = 8;
+    set->size = 0;
+    set->max_load = max_load;
+    set->items = calloc(set->capacity, sizeof(name_set_item_t));
+    set->lookup_count = 0;
+    set->probe_count = 0;
+    trace_count(&trace_counters.allocations, 2);
+    return set;
+}
+
+name_set_t *name_set_new(const name_arena_t *arena)
+{
+    return name_set_new_with_load(arena, name_set_default_max_load);
+}
+
+// Inserts a key which must not already be in items
+void robin_hood_insert(name_set_item_t *items, size_t capacity, pkg_name_t pkg_name, int id)
+{
+    const size_t mask = capacity - 1;
+    size_t index = (size_t)(pkg_name.hash_value & mask);
+
+    name_set_item_t inserting;
+    inserting.pkg_name = pkg_name;
+    inserting.id = id;
+    inserting.distance = 1;
+
+    while (true)
+    {
+        if (items[index].distance == 0)
+        {
+            items[index] = inserting;
+            return;
+        }
+
+        // Take from the rich (items near their home slot) and give to the poor
+        if (items[index].distance < inserting.distance)
+        {
+            name_set_item_t displaced = items[index];
+            items[index] = inserting;
+            inserting = displaced;
+        }
+
+        index = (index + 1) & mask;
+        inserting.distance++;
+    }
+}
+
+void name_set_add(name_set_t *name_set, pkg_name_t pkg_name, int id)
+{
+    if ((double)(name_set->size + 1) > name_set->max_load * name_set->capacity)
+    {
+        const size_t orig_capacity = name_set->capacity;
+        name_set_item_t *orig_items = name_set->items;
+
+        // Keep doubling in case max_load is tiny
+        do
+        {
+            name_set->capacity *= 2;
+        } while ((double)(name_set->size + 1) > name_set->max_load * name_set->capacity);
+
+        name_set->items = calloc(name_set->capacity, sizeof(name_set_item_t));
+        trace_count(&trace_counters.allocations, 1);
+        for (size_t i = 0; i < orig_capacity; i++)
+        {
+            if (orig_items[i].distance != 0)
+            {
+                robin_hood_insert(name_set->items, name_set->capacity, orig_items[i].pkg_name, orig_items[i].id);
+            }
+        }
+        free(orig_items);
+    }
+
+    robin_hood_insert(name_set->items, name_set->capacity, pkg_name, id);
+    name_set->size++;
+}
+
+// Returns the item whose key has the given characters, or NULL if there is none
+name_set_item_t *name_set_find_str(name_set_t *name_set, const char *str, size_t size, uint32_t hash_value)
+{
+    const size_t mask = name_set->capacity - 1;
+    size_t index = (size_t)(hash_value & mask);
+
+    name_set->lookup_count++;
+
+    // Wraps around the table, but can't loop forever since the load factor
+    // is always below 1 and every key ends up at most at its own distance
+    for (uint32_t distance = 1; distance <= name_set->items[index].distance; distance++)
+    {
+        name_set->probe_count++;
+
+        if (pkg_name_eql(name_set->arena, name_set->items[index].pkg_name, str, size, hash_value))
+        {
+            return &name_set->items[index];
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    return NULL;
+}
+
+bool name_set_has(name_set_t *name_set, pkg_name_t pkg_name)
+{
+    const char *str = name_arena_str(name_set->arena, pkg_name);
+    return name_set_find_str(name_set, str, pkg_name.size, pkg_name.hash_value) != NULL;
+}
+
+// Returns the id stored alongside pkg_name, or -1 if pkg_name is not in the set
+int name_set_get(name_set_t *name_set, pkg_name_t pkg_name)
+{
+    const char *str = name_arena_str(name_set->arena, pkg_name);
+    name_set_item_t *item = name_set_find_str(name_set, str, pkg_name.size, pkg_name.hash_value);
+    return item == NULL ? -1 : item->id;
+}
+
+// Returns the id stored alongside str, or -1 if str is not in the set
+int name_set_get_id_cstr(name_set_t *name_set, const char *str)
+{
+    const size_t size = strlen(str);
+    name_set_item_t *item = name_set_find_str(name_set, str, size, hash(str, size));
+    return item == NULL ? -1 : item->id;
+}
+
+// Fills in stats with the load and probe lengths of the set's current contents.
+// The probe length of a key is the number of slots a lookup of it examines.
+void name_set_get_stats(const name_set_t *name_set, name_set_stats_t *stats)
+{
+    memset(stats, 0, sizeof(name_set_stats_t));
+    stats->size = name_set->size;
+    stats->capacity = name_set->capacity;
+    stats->load_factor = (double)name_set->size / name_set->capacity;
+    stats->lookup_count = name_set->lookup_count;
+    stats->probe_count = name_set->probe_count;
+
+    size_t total_probe_length = 0;
+    for (size_t i = 0; i < name_set->capacity; i++)
+    {
+        const int probe_length = name_set->items[i].distance;
+        if (probe_length == 0)
+        {
+            continue;
+        }
+
+        total_probe_length += probe_length;
+
+        if (probe_length > stats->max_probe_length)
+        {
+            stats->max_probe_length = probe_length;
+        }
+
+        stats->probe_histogram[min(probe_length, NAME_SET_HISTOGRAM_SIZE) - 1]++;
+    }
+
+    if (name_set->size > 0)
+    {
+        stats->mean_probe_length = (double)total_probe_length / name_set->size;
+    }
+}
+
+void name_set_print_stats(FILE *file, const char *label, const name_set_t *name_set)
+{
+    name_set_stats_t stats;
+    name_set_get_stats(name_set, &stats);
+
+    fprintf(file, "%s: %zu names, capacity %zu, load %.3f (max %.3f), mean probe %.3f, max probe %d, %ld lookups probed %ld slots\n",
+            label, stats.size, stats.capacity, stats.load_factor, name_set->max_load,
+            stats.mean_probe_length, stats.max_probe_length, stats.lookup_count, stats.probe_count);
+
+    fprintf(file, "  probe lengths:");
+    for (int i = 0; i < NAME_SET_HISTOGRAM_SIZE; i++)
+    {
+        if (stats.probe_histogram[i] > 0)
+        {
+            fprintf(file, " %d%s:%zu", i + 1, i == NAME_SET_HISTOGRAM_SIZE - 1 ? "+" : "", stats.probe_histogram[i]);
+        }
+    }
+    fprintf(file, "\n");
+}
+
+void name_set_free(name_set_t *set)
+{
+    free(set->items);
+    free(set);
+}
+
+// Functions for name_arena_t, which rely on name_set_t
+
+name_arena_t *name_arena_new()
+{
+    name_arena_t *arena = calloc(1, sizeof(name_arena_t));
+    arena->index = name_set_new(arena);
+    return arena;
+}
+
+// Returns the handle of str (which has size characters), copying it into the
+// arena only if an identical name hasn't been interned before
+pkg_name_t name_arena_intern_n(name_arena_t *arena, const char *str, size_t size)
+{
+    const uint32_t hash_value = hash(str, size);
+
+    name_set_item_t *existing = name_set_find_str(arena->index, str, size, hash_value);
+    if (existing != NULL)
+    {
+        return existing->pkg_name;
+    }
+
+    // Names never straddle two blocks, so skip to the start of the next
+    // block if this one can't fit the name and its NUL char
+    int block = name_arena_block_of(arena->size);
+    while (arena->size + size + 1 > name_arena_block_start(block + 1))
+    {
+        block++;
+        arena->size = name_arena_block_start(block);
+    }
+
+    while (arena->block_count <= block)
+    {
+        arena->blocks[arena->block_count] = malloc((size_t)NAME_ARENA_BLOCK_SIZE << arena->block_count);
+        arena->block_count++;
+        trace_count(&trace_counters.allocations, 1);
+    }
+
+    pkg_name_t name;
+    name.offset = arena->size;
+    name.size = size;
+    name.hash_value = hash_value;
+
+    char *dest = &arena->blocks[block][arena->size - name_arena_block_start(block)];
+    memcpy(dest, str, size);
+    dest[size] = '\0';
+    arena->size += size + 1;
+
+    name_set_add(arena->index, name, 0);
+
+    return name;
+}
+
+pkg_name_t name_arena_intern(name_arena_t *arena, const char *str)
+{
+    return name_arena_intern_n(arena, str, strlen(str));
+}
+
+void name_arena_free(name_arena_t *arena)
+{
+    name_set_free(arena->index);
+
+    for (int i = 0; i < arena->block_count; i++)
+    {
+        free(arena->blocks[i]);
+    }
+
+    free(arena);
+}
+
+// Fixed-size bitset, used to mark package IDs
+
+typedef struct _bitset
+{
+    uint64_t *words;
+    int size; // The number of bits
+} bitset_t;
+
+bitset_t *bitset_new(int size)
+{
+    bitset_t *bitset = malloc(sizeof(bitset_t));
+    bitset->size = size;
+    bitset->words = calloc((size + 63) / 64 + 1, sizeof(uint64_t));
+    return bitset;
+}
+
+bool bitset_test(const bitset_t *bitset, int index)
+{
+    return (bitset->words[index / 64] >> (index % 64)) & 1;
+}
+
+void bitset_set(bitset_t *bitset, int index)
+{
+    bitset->words[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+void bitset_clear(bitset_t *bitset, int index)
+{
+    bitset->words[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+void bitset_free(bitset_t *bitset)
+{
+    free(bitset->words);
+    free(bitset);
+}
+
+// Provides index
+// Maps every name that an installed package provides (e.g. sh, libgl or
+// libfoo.so=1-64) to the packages providing it, so that the dependency graph
+// can resolve a dependency on a virtual name with one hash lookup rather than
+// alpm_find_satisfier's scan of the whole local db. It's built in one pass
+// over the packages, after which each name's providers are stored
+// contiguously, in the same layout as the graph's edges.
+
+typedef struct _provision
+{
+    int provider_id; // The package ID of the provider
+    pkg_name_t version; // Empty if the name is provided without a version
+} provision_t;
+
+typedef struct _provides_index
+{
+    name_set_t *slots; // Maps each provided name to its slot
+    int slot_count;
+    int *offsets; // Has slot_count + 1 entries
+    provision_t *provisions; // Slot i's are provisions[offsets[i]] through provisions[offsets[i + 1] - 1]
+    int provision_count;
+} provides_index_t;
+
+// pkgs is indexed by package ID
+provides_index_t *provides_index_new(alpm_pkg_t **pkgs, int pkg_count, name_arena_t *arena)
+{
+    provides_index_t *index = malloc(sizeof(provides_index_t));
+    index->slots = name_set_new(arena);
+    index->slot_count = 0;
+    index->provision_count = 0;
+
+    // Provisions are collected with their slot in package order, and then
+    // grouped by slot (which keeps them in package order within it)
+    int capacity = 64;
+    int *provision_slots = malloc(sizeof(int) * capacity);
+    provision_t *unsorted = malloc(sizeof(provision_t) * capacity);
+    trace_count(&trace_counters.allocations, 2);
+
+    for (int id = 0; id < pkg_count; id++)
+    {
+        for (alpm_list_t *curr = alpm_pkg_get_provides(pkgs[id]); curr != NULL; curr = curr->next)
+        {
+            const alpm_depend_t *provide = (const alpm_depend_t *)curr->data;
+            const pkg_name_t name = name_arena_intern(arena, provide->name);
+            int slot = name_set_get(index->slots, name);
+            if (slot < 0)
+            {
+                slot = index->slot_count++;
+                name_set_add(index->slots, name, slot);
+            }
+
+            if (index->provision_count >= capacity)
+            {
+                capacity *= 2;
+                provision_slots = realloc(provision_slots, sizeof(int) * capacity);
+                unsorted = realloc(unsorted, sizeof(provision_t) * capacity);
+                trace_count(&trace_counters.allocations, 2);
+            }
+
+            provision_t *provision = &unsorted[index->provision_count];
+            provision->provider_id = id;
+            provision->version = name_arena_intern(arena, provide->version != NULL ? provide->version : "");
+            provision_slots[index->provision_count++] = slot;
+        }
+    }
+
+    // Count each slot's provisions, then fill them in from the back, so that
+    // offsets[i] ends up at the start of slot i's
+    index->offsets = calloc(index->slot_count + 1, sizeof(int));
+    index->provisions = malloc(sizeof(provision_t) * (index->provision_count + 1));
+    trace_count(&trace_counters.allocations, 2);
+    for (int i = 0; i < index->provision_count; i++)
+    {
+        index->offsets[provision_slots[i]]++;
+    }
+    for (int slot = 1; slot <= index->slot_count; slot++)
+    {
+        index->offsets[slot] += index->offsets[slot - 1];
+    }
+    for (int i = index->provision_count - 1; i >= 0; i--)
+    {
+        index->provisions[--index->offsets[provision_slots[i]]] = unsorted[i];
+    }
+
+    free(provision_slots);
+    free(unsorted);
+    return index;
+}
+
+void provides_index_free(provides_index_t *index)
+{
+    name_set_free(index->slots);
+    free(index->offsets);
+    free(index->provisions);
+    free(index);
+}
+
+// Whether a provision of version satisfies dependency. As in pacman, a
+// versioned dependency is only satisfied by a versioned provision.
+bool provision_satisfies(const alpm_depend_t *dependency, const char *version)
+{
+    if (dependency->mod == ALPM_DEP_MOD_ANY)
+    {
+        return true;
+    }
+
+    if (version[0] == '\0' || dependency->version == NULL)
+    {
+        return false;
+    }
+
+    const int cmp = alpm_pkg_vercmp(version, dependency->version);
+    switch (dependency->mod)
+    {
+    case ALPM_DEP_MOD_EQ:
+        return cmp == 0;
+    case ALPM_DEP_MOD_GE:
+        return cmp >= 0;
+    case ALPM_DEP_MOD_LE:
+        return cmp <= 0;
+    case ALPM_DEP_MOD_GT:
+        return cmp > 0;
+    case ALPM_DEP_MOD_LT:
+        return cmp < 0;
+    default:
+        return true;
+    }
+}
+
+// Dependency graph of the local database
+// Every local package gets a dense integer ID (its position in the localdb's
+// pkgcache), and the dependencies of package i are stored contiguously in
+// edges[edge_offsets[i]] through edges[edge_offsets[i + 1] - 1]. The packages
+// which depend on package i are stored the same way in rdeps. A dependency on
+// an installed package's name is an edge to that package, if its version
+// satisfies the dependency; otherwise it's an edge to every installed package
+// whose provisions satisfy it (falling back to the named package when there
+// are none).
+
+typedef struct _pkg_graph
+{
+    alpm_pkg_t **pkgs; // Indexed by package ID
+    pkg_name_t *names; // Indexed by package ID
+    int size; // The number of packages (nodes) in the graph
+    int *edge_offsets; // Has size + 1 entries
+    int *edges; // Package IDs of dependencies
+    int edge_count;
+    int *rdep_offsets; // Has size + 1 entries
+    int *rdeps; // Package IDs of reverse dependencies, in ascending order
+    int provided_edge_count; // The edges resolved through the provides index
+    name_set_t *ids; // Maps package names to package IDs
+    provides_index_t *provides;
+    // The position in dbs_sync of the first syncdb with each package, as of
+    // the last time it was looked up: -1 if none has it, or -2 if it hasn't been
+    int *sync_repo_indices;
+} pkg_graph_t;
+
+pkg_graph_t *pkg_graph_new(alpm_db_t *localdb, name_arena_t *arena)
+{
+    const double pkgcache_start_ms = get_time_ms();
+    alpm_list_t *packages = alpm_db_get_pkgcache(localdb);
+    trace_record("alpm_db_get_pkgcache", pkgcache_start_ms, trace_thread_id);
+
+    pkg_graph_t *graph = malloc(sizeof(pkg_graph_t));
+    graph->size = alpm_list_count(packages);
+    graph->pkgs = malloc(sizeof(alpm_pkg_t *) * (graph->size + 1));
+    graph->names = malloc(sizeof(pkg_name_t) * (graph->size + 1));
+    graph->edge_offsets = malloc(sizeof(int) * (graph->size + 1));
+    graph->ids = name_set_new(arena);
+    graph->sync_repo_indices = malloc(sizeof(int) * (graph->size + 1));
+
+    int id = 0;
+    for (alpm_list_t *curr = packages; curr != NULL; curr = curr->next)
+    {
+        graph->pkgs[id] = (alpm_pkg_t *)curr->data;
+        graph->names[id] = name_arena_intern(arena, alpm_pkg_get_name(graph->pkgs[id]));
+        graph->sync_repo_indices[id] = -2;
+        name_set_add(graph->ids, graph->names[id], id);
+        id++;
+    }
+
+    const double provides_start_ms = get_time_ms();
+    graph->provides = provides_index_new(graph->pkgs, graph->size, arena);
+    trace_record("index_provides", provides_start_ms, trace_thread_id);
+
+    int edges_capacity = graph->size * 4 + 4;
+    graph->edges = malloc(sizeof(int) * edges_capacity);
+    graph->edge_count = 0;
+    graph->provided_edge_count = 0;
+
+    for (id = 0; id < graph->size; id++)
+    {
+        graph->edge_offsets[id] = graph->edge_count;
+
+        for (alpm_list_t *curr = alpm_pkg_get_depends(graph->pkgs[id]); curr != NULL; curr = curr->next)
+        {
+            alpm_depend_t *dependency = (alpm_depend_t *)curr->data;
+            const int dep_id = name_set_get_id_cstr(graph->ids, dependency->name);
+
+            // Provisions are only looked up when no installed package with
+            // that name satisfies the dependency's version constraint
+            const provision_t *provisions = NULL;
+            int provision_count = 0;
+            if (dep_id < 0 || !provision_satisfies(dependency, alpm_pkg_get_version(graph->pkgs[dep_id])))
+            {
+                const int slot = name_set_get_id_cstr(graph->provides->slots, dependency->name);
+                if (slot < 0 && dep_id < 0)
+                {
+                    continue; // Nothing installed satisfies it
+                }
+                if (slot >= 0)
+                {
+                    provisions = &graph->provides->provisions[graph->provides->offsets[slot]];
+                    provision_count = graph->provides->offsets[slot + 1] - graph->provides->offsets[slot];
+                }
+            }
+
+            if (graph->edge_count + max(1, provision_count) > edges_capacity)
+            {
+                edges_capacity = max(edges_capacity * 2, graph->edge_count + max(1, provision_count));
+                graph->edges = realloc(graph->edges, sizeof(int) * edges_capacity);
+                trace_count(&trace_counters.allocations, 1);
+            }
+
+            const int provided_start = graph->edge_count;
+            for (int i = 0; i < provision_count; i++)
+            {
+                if (provisions[i].provider_id != id && provisions[i].provider_id != dep_id
+                    && provision_satisfies(dependency, name_arena_str(arena, provisions[i].version)))
+                {
+                    graph->edges[graph->edge_count] = provisions[i].provider_id;
+                    graph->edge_count++;
+                    graph->provided_edge_count++;
+                }
+            }
+
+            // The package with that name is still depended on when nothing
+            // provides a better match, even if its version is out of range
+            if (dep_id >= 0 && graph->edge_count == provided_start)
+            {
+                graph->edges[graph->edge_count] = dep_id;
+                graph->edge_count++;
+            }
+        }
+    }
+    graph->edge_offsets[graph->size] = graph->edge_count;
+
+    // Count each package's dependents, then fill them in from the back, so
+    // that rdep_offsets[i] ends up at the start of package i's
+    graph->rdep_offsets = calloc(graph->size + 1, sizeof(int));
+    graph->rdeps = malloc(sizeof(int) * (graph->edge_count + 1));
+    trace_count(&trace_counters.allocations, 2);
+    for (int e = 0; e < graph->edge_count; e++)
+    {
+        graph->rdep_offsets[graph->edges[e]]++;
+    }
+    for (id = 1; id <= graph->size; id++)
+    {
+        graph->rdep_offsets[id] += graph->rdep_offsets[id - 1];
+    }
+    for (id = graph->size - 1; id >= 0; id--)
+    {
+        for (int e = graph->edge_offsets[id + 1] - 1; e >= graph->edge_offsets[id]; e--)
+        {
+            graph->rdeps[--graph->rdep_offsets[graph->edges[e]]] = id;
+        }
+    }
+
+    return graph;
+}
+
+// Returns the ID of the package with the given name, or -1 if it isn't installed
+int pkg_graph_find(pkg_graph_t *graph, pkg_name_t name)
+{
+    return name_set_get(graph->ids, name);
+}
+
+void pkg_graph_free(pkg_graph_t *graph)
+{
+    name_set_free(graph->ids);
+    provides_index_free(graph->provides);
+    free(graph->edges);
+    free(graph->edge_offsets);
+    free(graph->rdeps);
+    free(graph->rdep_offsets);
+    free(graph->names);
+    free(graph->pkgs);
+    free(graph->sync_repo_indices);
+    free(graph);
+}
+
+// Reference-counted closure of the keep list
+// Every package tracks how many keep roots reach it, so that removing a root
+// only releases the packages no other root needs, and adding one only walks
+// that root's dependencies. Each root's closure is walked on its own, using
+// an explicit worklist, with visits marked by a generation number so that the
+// marks never have to be cleared between walks.
+//
+// Every held package that isn't a root also records a parent: a held package
+// that depends on it, through which it was reached. Following parents always ends at a root,
+// which explains why a package is held without walking the graph again.
+typedef struct _keep_closure
+{
+    pkg_graph_t *graph;
+    int *root_counts; // The number of roots which reach each package
+    bitset_t *held; // The packages with a non-zero root count
+    int *keep_counts; // How many times each package is in the keep list
+    int *parents; // For each held package that isn't a root, or -1
+    unsigned int *visit_marks;
+    unsigned int generation;
+    int *worklist;
+    int *visited; // The packages visited by the last walk, in order
+    int *release_counts; // What removing each root would release, if still valid
+    unsigned int *release_marks; // The version release_counts[i] was computed at
+    unsigned int version; // Bumped whenever a walk changes any root count
+} keep_closure_t;
+
+keep_closure_t *keep_closure_new(pkg_graph_t *graph)
+{
+    keep_closure_t *closure = malloc(sizeof(keep_closure_t));
+    closure->graph = graph;
+    closure->root_counts = calloc(graph->size + 1, sizeof(int));
+    closure->held = bitset_new(graph->size);
+    closure->keep_counts = calloc(graph->size + 1, sizeof(int));
+    closure->parents = malloc(sizeof(int) * (graph->size + 1));
+    memset(closure->parents, 0xFF, sizeof(int) * (graph->size + 1));
+    closure->visit_marks = calloc(graph->size + 1, sizeof(unsigned int));
+    closure->generation = 0;
+    closure->worklist = malloc(sizeof(int) * (graph->size + 1));
+    closure->visited = malloc(sizeof(int) * (graph->size + 1));
+    closure->release_counts = malloc(sizeof(int) * (graph->size + 1));
+    closure->release_marks = calloc(graph->size + 1, sizeof(unsigned int));
+    closure->version = 1;
+    trace_count(&trace_counters.allocations, 10);
+    return closure;
+}
+
+// Gives new parents to the packages visited by a walk that released a root,
+// which are still held but may have had a released parent. They're linked to
+// a dependent whose parent is still valid, and then on to each other in
+// breadth-first order, so no parent chain can loop.
+void keep_closure_relink(keep_closure_t *closure, int visited_count)
+{
+    const pkg_graph_t *graph = closure->graph;
+    const unsigned int unlinked_mark = ++closure->generation;
+
+    for (int i = 0; i < visited_count; i++)
+    {
+        const int id = closure->visited[i];
+        if (bitset_test(closure->held, id) && closure->keep_counts[id] == 0)
+        {
+            closure->visit_marks[id] = unlinked_mark;
+        }
+        else
+        {
+            closure->parents[id] = -1;
+        }
+    }
+
+    int queue_size = 0;
+    for (int i = 0; i < visited_count; i++)
+    {
+        const int id = closure->visited[i];
+        for (int r = graph->rdep_offsets[id]; closure->visit_marks[id] == unlinked_mark && r < graph->rdep_offsets[id + 1]; r++)
+        {
+            const int rdep_id = graph->rdeps[r];
+            if (bitset_test(closure->held, rdep_id) && closure->visit_marks[rdep_id] != unlinked_mark)
+            {
+                closure->parents[id] = rdep_id;
+                closure->visit_marks[id] = 0;
+                closure->worklist[queue_size++] = id;
+            }
+        }
+    }
+
+    for (int head = 0; head < queue_size; head++)
+    {
+        const int id = closure->worklist[head];
+        for (int e = graph->edge_offsets[id]; e < graph->edge_offsets[id + 1]; e++)
+        {
+            const int dep_id = graph->edges[e];
+            if (closure->visit_marks[dep_id] == unlinked_mark)
+            {
+                closure->parents[dep_id] = id;
+                closure->visit_marks[dep_id] = 0;
+                closure->worklist[queue_size++] = dep_id;
+            }
+        }
+    }
+}
+
+// Walks every package reachable from root (including root itself), adding
+// delta to its root count. The IDs of packages which become held or released
+// are appended to changed (if it isn't NULL), which needs room for every
+// package. Returns the number of packages which became held or released, and
+// adds the number of edges followed to *edges_walked (if it isn't NULL).
+// With a delta of 0 nothing changes, and the packages which removing root
+// would release are reported instead.
+int keep_closure_walk(keep_closure_t *closure, int root, int delta, int *changed, int *edges_walked)
+{
+    const pkg_graph_t *graph = closure->graph;
+    const unsigned int mark = ++closure->generation;
+    int worklist_size = 0;
+    int changed_count = 0;
+    int edge_count = 0;
+    int visited_count = 0;
+
+    closure->visit_marks[root] = mark;
+    closure->worklist[worklist_size++] = root;
+
+    if (delta > 0)
+    {
+        closure->keep_counts[root]++;
+        closure->parents[root] = -1;
+    }
+    else if (delta < 0)
+    {
+        closure->keep_counts[root]--;
+    }
+
+    while (worklist_size > 0)
+    {
+        const int id = closure->worklist[--worklist_size];
+        const bool was_held = closure->root_counts[id] > 0;
+        closure->root_counts[id] += delta;
+        const bool is_held = closure->root_counts[id] > 0;
+        closure->visited[visited_count++] = id;
+
+        if (delta == 0 ? closure->root_counts[id] == 1 : was_held != is_held)
+        {
+            if (delta > 0)
+            {
+                bitset_set(closure->held, id);
+            }
+            else if (delta < 0)
+            {
+                bitset_clear(closure->held, id);
+            }
+
+            if (changed != NULL)
+            {
+                changed[changed_count] = id;
+            }
+            changed_count++;
+        }
+
+        for (int e = graph->edge_offsets[id]; e < graph->edge_offsets[id + 1]; e++)
+        {
+            const int dep_id = graph->edges[e];
+            edge_count++;
+
+            // Packages are marked as they're pushed, so each is pushed at most once
+            if (closure->visit_marks[dep_id] != mark)
+            {
+                closure->visit_marks[dep_id] = mark;
+                closure->worklist[worklist_size++] = dep_id;
+
+                // It becomes held once it's popped, reached through id
+                if (delta > 0 && closure->root_counts[dep_id] == 0)
+                {
+                    closure->parents[dep_id] = id;
+                }
+            }
+        }
+    }
+
+    trace_count(&trace_counters.packages_visited, visited_count);
+
+    if (delta < 0)
+    {
+        keep_closure_relink(closure, visited_count);
+    }
+
+    if (delta != 0)
+    {
+        closure->version++;
+    }
+
+    if (edges_walked != NULL)
+    {
+        *edges_walked += edge_count;
+    }
+
+    return changed_count;
+}
+
+// Returns the number of packages which removing root would release, walking
+// its closure only if it has changed since the count was last asked for
+int keep_closure_release_count(keep_closure_t *closure, int root)
+{
+    if (closure->release_marks[root] != closure->version)
+    {
+        closure->release_counts[root] = keep_closure_walk(closure, root, 0, NULL, NULL);
+        closure->release_marks[root] = closure->version;
+    }
+
+    return closure->release_counts[root];
+}
+
+// Adds every name in names that's installed as a root. Names which aren't
+// installed are added to unfound (if it isn't NULL). Returns the number of
+// packages which became held.
+int keep_closure_add_names(keep_closure_t *closure, const pkg_name_list_t *names, pkg_name_list_t *unfound, int *edges_walked)
+{
+    int held_count = 0;
+
+    for (int i = 0; i < names->size; i++)
+    {
+        const int id = pkg_graph_find(closure->graph, names->names[i]);
+
+        if (id >= 0)
+        {
+            held_count += keep_closure_walk(closure, id, 1, NULL, edges_walked);
+        }
+        else if (unfound != NULL)
+        {
+            pkg_name_list_add(unfound, names->names[i]);
+        }
+    }
+
+    return held_count;
+}
+
+// Fills path with the chain of parents from the root that holds id down to id
+// itself, and returns its length. path needs room for every package. A
+// package that isn't held is its own path.
+int keep_closure_path(const keep_closure_t *closure, int id, int *path)
+{
+    int size = 0;
+    for (int curr = id; curr >= 0 && size < closure->graph->size; curr = closure->parents[curr])
+    {
+        path[size++] = curr;
+    }
+
+    for (int i = 0; i < size / 2; i++)
+    {
+        const int swap = path[i];
+        path[i] = path[size - 1 - i];
+        path[size - 1 - i] = swap;
+    }
+
+    return size;
+}
+
+void keep_closure_free(keep_closure_t *closure)
+{
+    bitset_free(closure->held);
+    free(closure->keep_counts);
+    free(closure->parents);
+    free(closure->visited);
+    free(closure->root_counts);
+    free(closure->visit_marks);
+    free(closure->worklist);
+    free(closure->release_counts);
+    free(closure->release_marks);
+    free(closure);
+}
+
+// The chain that the why pane shows, by name, so that it can be filled in from
+// the keep closure or from a daemon alike
+typedef struct _why_path
+{
+    pkg_name_list_t *names; // From a keep root down to the package
+    bool *is_kept; // Whether each package is in the keep list itself
+    // Package i's dependents are required_by[required_by_offsets[i]] through
+    // required_by[required_by_offsets[i + 1] - 1]
+    int *required_by_offsets;
+    pkg_name_list_t *required_by;
+    bool is_held; // If it isn't, names is just the package
+    int capacity; // Of is_kept and required_by_offsets
+} why_path_t;
+
+why_path_t *why_path_new()
+{
+    why_path_t *path = malloc(sizeof(why_path_t));
+    path->names = pkg_name_list_new(8);
+    path->required_by = pkg_name_list_new(8);
+    path->capacity = 8;
+    path->is_kept = malloc(sizeof(bool) * path->capacity);
+    path->required_by_offsets = malloc(sizeof(int) * (path->capacity + 1));
+    path->required_by_offsets[0] = 0;
+    path->is_held = false;
+    return path;
+}
+
+void why_path_clear(why_path_t *path)
+{
+    path->names->size = 0;
+    path->required_by->size = 0;
+    path->required_by_offsets[0] = 0;
+    path->is_held = false;
+}
+
+// Appends name to the path. Its dependents are then added with
+// why_path_add_required_by.
+void why_path_add(why_path_t *path, pkg_name_t name, bool is_kept)
+{
+    if (path->names->size >= path->capacity)
+    {
+        path->capacity *= 2;
+        path->is_kept = realloc(path->is_kept, sizeof(bool) * path->capacity);
+        path->required_by_offsets = realloc(path->required_by_offsets, sizeof(int) * (path->capacity + 1));
+    }
+
+    path->is_kept[path->names->size] = is_kept;
+    pkg_name_list_add(path->names, name);
+    path->required_by_offsets[path->names->size] = path->required_by->size;
+}
+
+// Adds a dependent of the last package in the path
+void why_path_add_required_by(why_path_t *path, pkg_name_t name)
+{
+    pkg_name_list_add(path->required_by, name);
+    path->required_by_offsets[path->names->size] = path->required_by->size;
+}
+
+// Fills path with the chain through which closure holds id
+void why_path_fill(why_path_t *path, const keep_closure_t *closure, int id)
+{
+    const pkg_graph_t *graph = closure->graph;
+    int *ids = malloc(sizeof(int) * (graph->size + 1));
+    const int size = keep_closure_path(closure, id, ids);
+
+    why_path_clear(path);
+    path->is_held = bitset_test(closure->held, id);
+    for (int i = 0; i < size; i++)
+    {
+        why_path_add(path, graph->names[ids[i]], closure->keep_counts[ids[i]] > 0);
+        for (int rdep = graph->rdep_offsets[ids[i]]; rdep < graph->rdep_offsets[ids[i] + 1]; rdep++)
+        {
+            why_path_add_required_by(path, graph->names[graph->rdeps[rdep]]);
+        }
+    }
+
+    free(ids);
+}
+
+void why_path_free(why_path_t *path)
+{
+    if (path == NULL)
+    {
+        return;
+    }
+
+    pkg_name_list_free(path->names);
+    pkg_name_list_free(path->required_by);
+    free(path->is_kept);
+    free(path->required_by_offsets);
+    free(path);
+}
+
+// Builds the graph and the closure of keep_names, unless they already exist
+// (they don't when the upgrade list was loaded from the cache)
+void ensure_keep_closure(pkg_graph_t **graph, keep_closure_t **closure, alpm_db_t *localdb, name_arena_t *arena, const pkg_name_list_t *keep_names)
+{
+    if (*graph == NULL)
+    {
+        *graph = pkg_graph_new(localdb, arena);
+    }
+
+    if (*closure == NULL)
+    {
+        *closure = keep_closure_new(*graph);
+        keep_closure_add_names(*closure, keep_names, NULL, NULL);
+    }
+}
+
+// Removes the packages at the positions set in removed from list in a single
+// pass, keeping the rest in order. Returns the new index of the remaining
+// package closest to the one at cursor_index (preferring the later one on
+// ties), or -1 if none remain.
+int pkg_state_list_remove_marked(pkg_state_list_t *list, const bitset_t *removed, int cursor_index)
+{
+    int kept_count = 0;
+    int before_index = -1; // The last package kept before the cursor
+    int before_distance = 0;
+    int after_index = -1; // The first package kept at or after the cursor
+    int after_distance = 0;
+
+    for (int i = 0; i < list->size; i++)
+    {
+        if (bitset_test(removed, i))
+        {
+            continue;
+        }
+
+        if (i < cursor_index)
+        {
+            before_index = kept_count;
+            before_distance = cursor_index - i;
+        }
+        else if (after_index < 0)
+        {
+            after_index = kept_count;
+            after_distance = i - cursor_index;
+        }
+
+        if (kept_count != i)
+        {
+            pkg_state_list_copy(list, kept_count, list, i);
+        }
+        kept_count++;
+    }
+
+    list->size = kept_count;
+    pkg_state_list_mask_selection(list);
+
+    if (after_index >= 0 && (before_index < 0 || after_distance <= before_distance))
+    {
+        return after_index;
+    }
+
+    return before_index;
+}
+
+// Removes every package in held from list, as pkg_state_list_remove_marked
+int pkg_state_list_remove_held(pkg_state_list_t *list, pkg_graph_t *graph, const bitset_t *held, int cursor_index)
+{
+    bitset_t *removed = bitset_new(list->size);
+    for (int i = 0; i < list->size; i++)
+    {
+        const int id = pkg_graph_find(graph, list->names[i]);
+        if (id >= 0 && bitset_test(held, id))
+        {
+            bitset_set(removed, i);
+        }
+    }
+
+    const int new_cursor_index = pkg_state_list_remove_marked(list, removed, cursor_index);
+    bitset_free(removed);
+    return new_cursor_index;
+}
+
+// Removes every package in names from list, as pkg_state_list_remove_marked
+int pkg_state_list_remove_named(pkg_state_list_t *list, const pkg_name_list_t *names, const name_arena_t *arena, int cursor_index)
+{
+    name_set_t *name_set = name_set_new(arena);
+    for (int i = 0; i < names->size; i++)
+    {
+        name_set_add(name_set, names->names[i], i);
+    }
+
+    bitset_t *removed = bitset_new(list->size);
+    for (int i = 0; i < list->size; i++)
+    {
+        if (name_set_has(name_set, list->names[i]))
+        {
+            bitset_set(removed, i);
+        }
+    }
+
+    const int new_cursor_index = pkg_state_list_remove_marked(list, removed, cursor_index);
+    bitset_free(removed);
+    name_set_free(name_set);
+    return new_cursor_index;
+}
+
+// pacman.conf parsing
+// Only the settings lps needs are read: RootDir, DBPath, CacheDir, IgnorePkg
+// and IgnoreGroup from [options], and the names of the repos in the order
+// they're listed. Include directives are followed (with glob expansion) in any section,
+// just like pacman does.
+
+#define PACMAN_CONFIG_MAX_INCLUDE_DEPTH 10
+
+typedef struct _pacman_config
+{
+    char root_dir[PATH_MAX];
+    char db_path[PATH_MAX];
+    pkg_name_list_t *repos; // In the order pacman.conf lists them
+    pkg_name_list_t *ignore_pkgs; // May be glob patterns
+    pkg_name_list_t *ignore_groups;
+    uint64_t hash; // Changes whenever any of the settings above change
+    pkg_name_list_t *cache_dirs; // Not part of hash, since they don't affect which packages are upgrades
+} pacman_config_t;
+
+// Returns str without leading or trailing whitespace, modifying str in place
+char *trim_whitespace(char *str)
+{
+    while (isspace((unsigned char)*str))
+    {
+        str++;
+    }
+
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+    {
+        end--;
+    }
+    *end = '\0';
+
+    return str;
+}
+
+// Adds every whitespace-separated word in value to list
+void pacman_config_add_words(pkg_name_list_t *list, name_arena_t *arena, char *value)
+{
+    char *save_ptr = NULL;
+    for (char *word = strtok_r(value, " \t", &save_ptr); word != NULL; word = strtok_r(NULL, " \t", &save_ptr))
+    {
+        pkg_name_list_add(list, name_arena_intern(arena, word));
+    }
+}
+
+// Parses the file at path into config. section holds the name of the current
+// section, which carries over into (and back out of) included files.
+// Returns 0 on success, or -1 (after printing an error) on failure.
+int pacman_config_parse_file(pacman_config_t *config, name_arena_t *arena, const char *path, char *section, int depth)
+{
+    if (depth > PACMAN_CONFIG_MAX_INCLUDE_DEPTH)
+    {
+        fprintf(stderr, "%s: Include directives are nested too deeply\n", path);
+        return -1;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int err = 0;
+    int line_number = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (err == 0 && getline(&line, &line_capacity, file) != -1)
+    {
+        line_number++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        char *trimmed = trim_whitespace(line);
+        const size_t trimmed_size = strlen(trimmed);
+
+        if (trimmed_size == 0)
+        {
+            continue;
+        }
+
+        if (trimmed[0] == '[' && trimmed[trimmed_size - 1] == ']')
+        {
+            trimmed[trimmed_size - 1] = '\0';
+            snprintf(section, PATH_MAX, "%s", trimmed + 1);
+
+            if (strcmp(section, "options") != 0)
+            {
+                pkg_name_t repo = name_arena_intern(arena, section);
+
+                bool is_duplicate = false;
+                for (int i = 0; i < config->repos->size; i++)
+                {
+                    is_duplicate |= config->repos->names[i].offset == repo.offset;
+                }
+
+                if (!is_duplicate)
+                {
+                    pkg_name_list_add(config->repos, repo);
+                }
+            }
+
+            continue;
+        }
+
+        char *key = trimmed;
+        char *value = strchr(trimmed, '=');
+        if (value != NULL)
+        {
+            *value = '\0';
+            value = trim_whitespace(value + 1);
+            key = trim_whitespace(key);
+        }
+
+        if (section[0] == '\0')
+        {
+            fprintf(stderr, "%s:%d: directive '%s' is outside of any section\n", path, line_number, key);
+            err = -1;
+        }
+        else if (strcmp(key, "Include") == 0 && value != NULL)
+        {
+            glob_t matches;
+            if (glob(value, GLOB_NOCHECK, NULL, &matches) == 0)
+            {
+                for (size_t i = 0; err == 0 && i < matches.gl_pathc; i++)
+                {
+                    err = pacman_config_parse_file(config, arena, matches.gl_pathv[i], section, depth + 1);
+                }
+                globfree(&matches);
+            }
+        }
+        else if (strcmp(section, "options") == 0 && value != NULL)
+        {
+            if (strcmp(key, "RootDir") == 0)
+            {
+                snprintf(config->root_dir, PATH_MAX, "%s", value);
+            }
+            else if (strcmp(key, "DBPath") == 0)
+            {
+                snprintf(config->db_path, PATH_MAX, "%s", value);
+            }
+            else if (strcmp(key, "CacheDir") == 0)
+            {
+                pacman_config_add_words(config->cache_dirs, arena, value);
+            }
+            else if (strcmp(key, "IgnorePkg") == 0)
+            {
+                pacman_config_add_words(config->ignore_pkgs, arena, value);
+            }
+            else if (strcmp(key, "IgnoreGroup") == 0)
+            {
+                pacman_config_add_words(config->ignore_groups, arena, value);
+            }
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    return err;
+}
+
+uint64_t pacman_config_hash_list(uint64_t hash, const name_arena_t *arena, const pkg_name_list_t *list)
+{
+    for (int i = 0; i < list->size; i++)
+    {
+        // Include the NUL char, so that "a b" and "ab" hash differently
+        hash = fnv1a_64(hash, name_arena_str(arena, list->names[i]), list->names[i].size + 1);
+    }
+
+    // Also separate the lists themselves
+    return fnv1a_64(hash, "\n", 1);
+}
+
+// Reads the pacman.conf at path (and any files it includes). Returns NULL
+// (after printing an error) on failure.
+pacman_config_t *pacman_config_new(name_arena_t *arena, const char *path)
+{
+    pacman_config_t *config = malloc(sizeof(pacman_config_t));
+    snprintf(config->root_dir, PATH_MAX, "/");
+    snprintf(config->db_path, PATH_MAX, "/var/lib/pacman/");
+    config->repos = pkg_name_list_new(8);
+    config->ignore_pkgs = pkg_name_list_new(4);
+    config->ignore_groups = pkg_name_list_new(4);
+    config->cache_dirs = pkg_name_list_new(2);
+
+    char section[PATH_MAX] = "";
+    if (pacman_config_parse_file(config, arena, path, section, 0) == -1)
+    {
+        pkg_name_list_free(config->repos);
+        pkg_name_list_free(config->ignore_pkgs);
+        pkg_name_list_free(config->ignore_groups);
+        pkg_name_list_free(config->cache_dirs);
+        free(config);
+        return NULL;
+    }
+
+    // Like pacman, only fall back to the default if no CacheDir is given
+    if (config->cache_dirs->size == 0)
+    {
+        pkg_name_list_add(config->cache_dirs, name_arena_intern(arena, "/var/cache/pacman/pkg/"));
+    }
+
+    config->hash = fnv1a_64(FNV_OFFSET_BASIS, config->root_dir, strlen(config->root_dir) + 1);
+    config->hash = fnv1a_64(config->hash, config->db_path, strlen(config->db_path) + 1);
+    config->hash = pacman_config_hash_list(config->hash, arena, config->repos);
+    config->hash = pacman_config_hash_list(config->hash, arena, config->ignore_pkgs);
+    config->hash = pacman_config_hash_list(config->hash, arena, config->ignore_groups);
+
+    return config;
+}
+
+void pacman_config_free(pacman_config_t *config)
+{
+    if (config == NULL)
+    {
+        return;
+    }
+
+    pkg_name_list_free(config->repos);
+    pkg_name_list_free(config->ignore_pkgs);
+    pkg_name_list_free(config->ignore_groups);
+    pkg_name_list_free(config->cache_dirs);
+    free(config);
+}
+
+// Registers the config's repos as syncdbs of handle, in order, and applies
+// its IgnorePkg and IgnoreGroup. Registering a syncdb doesn't load it; libalpm
+// only reads a repo's packages the first time a lookup needs them.
+void pacman_config_register(const pacman_config_t *config, alpm_handle_t *handle, const name_arena_t *arena)
+{
+    for (int i = 0; i < config->repos->size; i++)
+    {
+        const char *repo = name_arena_str(arena, config->repos->names[i]);
+        if (alpm_register_syncdb(handle, repo, 0) == NULL)
+        {
+            fprintf(stderr, "Warning: the %s syncdb failed to register\n", repo);
+        }
+    }
+
+    for (int i = 0; i < config->ignore_pkgs->size; i++)
+    {
+        alpm_option_add_ignorepkg(handle, name_arena_str(arena, config->ignore_pkgs->names[i]));
+    }
+
+    for (int i = 0; i < config->ignore_groups->size; i++)
+    {
+        alpm_option_add_ignoregroup(handle, name_arena_str(arena, config->ignore_groups->names[i]));
+    }
+}
+
+// Pattern matchers
+// Bulk selection and the keep list take patterns as well as names: a glob
+// ("qt6-*"), a regex between slashes ("/^python-.*-git$/"), a repo
+// ("repo:multilib") or a bound on the installed size ("size>500M"). Each
+// pattern is compiled once, into the cheapest test that implements it, and is
+// then run over every package in a single pass. Globs which are a literal
+// with a leading and/or trailing * (the common case) become a prefix, suffix
+// or substring comparison instead of going through fnmatch.
+
+typedef enum _pkg_matcher_kind
+{
+    MATCH_NAME,
+    MATCH_PREFIX,
+    MATCH_SUFFIX,
+    MATCH_SUBSTRING,
+    MATCH_GLOB,
+    MATCH_REGEX,
+    MATCH_REPO,
+    MATCH_LARGER, // Than size
+    MATCH_SMALLER, // Than size
+} pkg_matcher_kind_t;
+
+typedef struct _pkg_matcher
+{
+    pkg_matcher_kind_t kind;
+    char *literal; // The name, prefix, suffix or substring, or the whole glob
+    size_t literal_size;
+    regex_t regex;
+    int repo_index; // Position in dbs_sync
+    off_t size;
+} pkg_matcher_t;
+
+// What a matcher looks at, from either an upgrade candidate or an installed package
+typedef struct _pkg_match_subject
+{
+    const char *name;
+    uint32_t name_size;
+    off_t isize;
+    int repo_index; // Position in dbs_sync, or -1
+} pkg_match_subject_t;
+
+// Package names can't contain any of the characters which start a pattern
+bool pkg_matcher_is_pattern(const char *str)
+{
+    return strpbrk(str, "*?[") != NULL || str[0] == '/' || strncmp(str, "repo:", 5) == 0
+           || strncmp(str, "size>", 5) == 0 || strncmp(str, "size<", 5) == 0;
+}
+
+// Parses sizes like "500M", "1.5GiB" or "300k" (binary units). Returns false
+// if str isn't one.
+bool parse_size(const char *str, off_t *size)
+{
+    char *end;
+    const double value = strtod(str, &end);
+    if (end == str || value < 0)
+    {
+        return false;
+    }
+
+    double unit = 1;
+    switch (tolower((unsigned char)*end))
+    {
+    case 'k':
+        unit = 1024.0;
+        end++;
+        break;
+    case 'm':
+        unit = 1024.0 * 1024;
+        end++;
+        break;
+    case 'g':
+        unit = 1024.0 * 1024 * 1024;
+        end++;
+        break;
+    }
+
+    if (unit > 1 && *end == 'i')
+    {
+        end++;
+    }
+    if (tolower((unsigned char)*end) == 'b')
+    {
+        end++;
+    }
+
+    *size = (off_t)(value * unit);
+    return *end == '\0';
+}
+
+// Returns NULL if pattern is an invalid regex or size, or names a repo that
+// isn't in dbs_sync
+pkg_matcher_t *pkg_matcher_new(const char *pattern, alpm_list_t *dbs_sync)
+{
+    pkg_matcher_t *matcher = malloc(sizeof(pkg_matcher_t));
+    matcher->literal = NULL;
+    matcher->literal_size = 0;
+    matcher->repo_index = -1;
+    matcher->size = 0;
+
+    const size_t pattern_size = strlen(pattern);
+    if (pattern[0] == '/')
+    {
+        // The closing slash is optional
+        const size_t regex_size = pattern_size > 1 && pattern[pattern_size - 1] == '/' ? pattern_size - 2 : pattern_size - 1;
+        char *regex = strndup(pattern + 1, regex_size);
+        const int regex_err = regcomp(&matcher->regex, regex, REG_EXTENDED | REG_NOSUB);
+        free(regex);
+        if (regex_err != 0)
+        {
+            free(matcher);
+            return NULL;
+        }
+        matcher->kind = MATCH_REGEX;
+    }
+    else if (strncmp(pattern, "repo:", 5) == 0)
+    {
+        matcher->kind = MATCH_REPO;
+        int repo_index = 0;
+        for (alpm_list_t *curr = dbs_sync; curr != NULL; curr = curr->next, repo_index++)
+        {
+            if (strcmp(alpm_db_get_name((alpm_db_t *)curr->data), pattern + 5) == 0)
+            {
+                matcher->repo_index = repo_index;
+                break;
+            }
+        }
+        if (matcher->repo_index < 0)
+        {
+            free(matcher);
+            return NULL;
+        }
+    }
+    else if (strncmp(pattern, "size>", 5) == 0 || strncmp(pattern, "size<", 5) == 0)
+    {
+        matcher->kind = pattern[4] == '>' ? MATCH_LARGER : MATCH_SMALLER;
+        if (!parse_size(pattern + 5, &matcher->size))
+        {
+            free(matcher);
+            return NULL;
+        }
+    }
+    else
+    {
+        const bool has_leading_star = pattern[0] == '*';
+        const bool has_trailing_star = pattern_size > 1 && pattern[pattern_size - 1] == '*';
+        const char *body = pattern + has_leading_star;
+        const size_t body_size = pattern_size - has_leading_star - has_trailing_star;
+
+        bool is_literal = true;
+        for (size_t i = 0; i < body_size && is_literal; i++)
+        {
+            is_literal = strchr("*?[\\", body[i]) == NULL;
+        }
+
+        if (!is_literal)
+        {
+            matcher->kind = MATCH_GLOB;
+            matcher->literal = strdup(pattern);
+            matcher->literal_size = pattern_size;
+        }
+        else
+        {
+            matcher->kind = has_leading_star && has_trailing_star ? MATCH_SUBSTRING
+                            : has_leading_star                    ? MATCH_SUFFIX
+                            : has_trailing_star                   ? MATCH_PREFIX
+                                                                  : MATCH_NAME;
+            matcher->literal = strndup(body, body_size);
+            matcher->literal_size = body_size;
+        }
+    }
+
+    return matcher;
+}
+
+bool pkg_matcher_match(const pkg_matcher_t *matcher, const pkg_match_subject_t *subject)
+{
+    const char *name = subject->name;
+    const size_t name_size = subject->name_size;
+
+    switch (matcher->kind)
+    {
+    case MATCH_NAME:
+        return name_size == matcher->literal_size && memcmp(name, matcher->literal, name_size) == 0;
+    case MATCH_PREFIX:
+        return name_size >= matcher->literal_size && memcmp(name, matcher->literal, matcher->literal_size) == 0;
+    case MATCH_SUFFIX:
+        return name_size >= matcher->literal_size
+               && memcmp(name + name_size - matcher->literal_size, matcher->literal, matcher->literal_size) == 0;
+    case MATCH_SUBSTRING:
+        return matcher->literal_size == 0 || memmem(name, name_size, matcher->literal, matcher->literal_size) != NULL;
+    case MATCH_GLOB:
+        return fnmatch(matcher->literal, name, 0) == 0;
+    case MATCH_REGEX:
+        return regexec(&matcher->regex, name, 0, NULL, 0) == 0;
+    case MATCH_REPO:
+        return subject->repo_index == matcher->repo_index;
+    case MATCH_LARGER:
+        return subject->isize > matcher->size;
+    case MATCH_SMALLER:
+        return subject->isize < matcher->size;
+    }
+
+    return false;
+}
+
+void pkg_matcher_free(pkg_matcher_t *matcher)
+{
+    if (matcher->kind == MATCH_REGEX)
+    {
+        regfree(&matcher->regex);
+    }
+
+    free(matcher->literal);
+    free(matcher);
+}
+
+// Describes an installed package. Its repo is the first syncdb with a package
+// of the same name, which is only looked up if needs_repo.
+void pkg_match_subject_installed(pkg_match_subject_t *subject, alpm_pkg_t *pkg, alpm_list_t *dbs_sync, bool needs_repo)
+{
+    subject->name = alpm_pkg_get_name(pkg);
+    subject->name_size = strlen(subject->name);
+    subject->isize = alpm_pkg_get_isize(pkg);
+    subject->repo_index = -1;
+
+    int repo_index = 0;
+    for (alpm_list_t *curr = dbs_sync; needs_repo && curr != NULL; curr = curr->next, repo_index++)
+    {
+        if (alpm_db_get_pkg((alpm_db_t *)curr->data, subject->name) != NULL)
+        {
+            subject->repo_index = repo_index;
+            break;
+        }
+    }
+}
+
+// Selects (or deselects) every package in list which matcher matches, a word
+// of the selection at a time. Returns the number of packages matched.
+int pkg_state_list_select_matching(pkg_state_list_t *list, const pkg_matcher_t *matcher, const name_arena_t *arena, bool is_selected)
+{
+    int match_count = 0;
+
+    for (int word_index = 0; word_index < selection_word_count(list->size); word_index++)
+    {
+        uint64_t matches = 0;
+        const int end = min(list->size, (word_index + 1) * 64);
+        for (int i = word_index * 64; i < end; i++)
+        {
+            const pkg_match_subject_t subject = {name_arena_str(arena, list->names[i]), list->names[i].size,
+                                                 list->isizes[i], list->repo_indices[i]};
+            matches |= (uint64_t)pkg_matcher_match(matcher, &subject) << (i % 64);
+        }
+
+        match_count += __builtin_popcountll(matches);
+        if (is_selected)
+        {
+            list->selection[word_index] |= matches;
+        }
+        else
+        {
+            list->selection[word_index] &= ~matches;
+        }
+    }
+
+    return match_count;
+}
+
+// Fills roots (which must be empty) with the keep list's names, where each
+// pattern is replaced by the installed packages it matches. The local db is
+// only read if there are patterns, in one pass which tries every pattern on
+// each package. Patterns which don't compile match nothing.
+void keep_roots_expand(pkg_name_list_t *roots, const pkg_name_list_t *keep_names, alpm_db_t *localdb, alpm_list_t *dbs_sync, name_arena_t *arena)
+{
+    pkg_matcher_t **matchers = malloc(sizeof(pkg_matcher_t *) * (keep_names->size + 1));
+    int matcher_count = 0;
+    bool needs_repo = false;
+
+    for (int i = 0; i < keep_names->size; i++)
+    {
+        const char *name = name_arena_str(arena, keep_names->names[i]);
+        if (!pkg_matcher_is_pattern(name))
+        {
+            pkg_name_list_add(roots, keep_names->names[i]);
+            continue;
+        }
+
+        pkg_matcher_t *matcher = pkg_matcher_new(name, dbs_sync);
+        if (matcher != NULL)
+        {
+            needs_repo |= matcher->kind == MATCH_REPO;
+            matchers[matcher_count++] = matcher;
+        }
+    }
+
+    if (matcher_count > 0)
+    {
+        const double expand_start_ms = get_time_ms();
+        for (alpm_list_t *curr = alpm_db_get_pkgcache(localdb); curr != NULL; curr = curr->next)
+        {
+            pkg_match_subject_t subject;
+            pkg_match_subject_installed(&subject, (alpm_pkg_t *)curr->data, dbs_sync, needs_repo);
+
+            // Every pattern that matches adds a root, the same as listing the name more than once
+            for (int i = 0; i < matcher_count; i++)
+            {
+                if (pkg_matcher_match(matchers[i], &subject))
+                {
+                    pkg_name_list_add(roots, name_arena_intern_n(arena, subject.name, subject.name_size));
+                }
+            }
+        }
+        trace_record("expand_keep_patterns", expand_start_ms, 0);
+    }
+
+    for (int i = 0; i < matcher_count; i++)
+    {
+        pkg_matcher_free(matchers[i]);
+    }
+    free(matchers);
+}
+
+// Whether any entry of keep_names picks packages by their repo, in which case
+// the roots can change along with the syncdbs
+bool keep_names_match_repos(const pkg_name_list_t *keep_names, const name_arena_t *arena)
+{
+    for (int i = 0; i < keep_names->size; i++)
+    {
+        if (strncmp(name_arena_str(arena, keep_names->names[i]), "repo:", 5) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Removes one root for name from roots, returning false if there isn't one
+bool keep_roots_remove(pkg_name_list_t *roots, pkg_name_t name)
+{
+    for (int i = 0; i < roots->size; i++)
+    {
+        if (roots->names[i].offset == name.offset)
+        {
+            pkg_name_list_delete_at(roots, i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Removes the roots that pattern (an entry of the keep list) added, filling
+// ids with the packages they were. Returns how many there were.
+int keep_roots_remove_pattern(pkg_name_list_t *roots, const char *pattern, const pkg_graph_t *graph, alpm_list_t *dbs_sync, int *ids)
+{
+    pkg_matcher_t *matcher = pkg_matcher_new(pattern, dbs_sync);
+    if (matcher == NULL)
+    {
+        return 0;
+    }
+
+    int id_count = 0;
+    for (int id = 0; id < graph->size; id++)
+    {
+        pkg_match_subject_t subject;
+        pkg_match_subject_installed(&subject, graph->pkgs[id], dbs_sync, matcher->kind == MATCH_REPO);
+        if (pkg_matcher_match(matcher, &subject) && keep_roots_remove(roots, graph->names[id]))
+        {
+            ids[id_count++] = id;
+        }
+    }
+
+    pkg_matcher_free(matcher);
+    return id_count;
+}
+
+// Removes the entry at index (a name or a pattern) from keep_names, along with
+// the roots it added to roots, and releases them in closure. Fills
+// released_ids (which needs room for every package) with the packages which
+// are no longer held, and returns how many there are.
+int keep_list_drop(pkg_name_list_t *keep_names, pkg_name_list_t *roots, int index, keep_closure_t *closure, alpm_list_t *dbs_sync, const name_arena_t *arena, int *released_ids)
+{
+    const pkg_graph_t *graph = closure->graph;
+    const pkg_name_t name = keep_names->names[index];
+    pkg_name_list_delete_at(keep_names, index);
+
+    // A pattern drops a root for each installed package it matched
+    int *root_ids = malloc(sizeof(int) * (graph->size + 1));
+    int root_count = 0;
+    if (pkg_matcher_is_pattern(name_arena_str(arena, name)))
+    {
+        root_count = keep_roots_remove_pattern(roots, name_arena_str(arena, name), graph, dbs_sync, root_ids);
+    }
+    else if (keep_roots_remove(roots, name) && name_set_get(graph->ids, name) >= 0)
+    {
+        root_ids[root_count++] = name_set_get(graph->ids, name);
+    }
+
+    int released_count = 0;
+    for (int i = 0; i < root_count; i++)
+    {
+        released_count += keep_closure_walk(closure, root_ids[i], -1, released_ids + released_count, NULL);
+    }
+
+    free(root_ids);
+    return released_count;
+}
+
+// Adds entry (a name or a pattern) to keep_names, and the roots it expands to
+// to roots and closure. Returns the number of packages which became held.
+int keep_list_add(pkg_name_list_t *keep_names, pkg_name_list_t *roots, pkg_name_t entry, keep_closure_t *closure, alpm_db_t *localdb, alpm_list_t *dbs_sync, name_arena_t *arena)
+{
+    pkg_name_list_add(keep_names, entry);
+
+    pkg_name_list_t *entries = pkg_name_list_new(1);
+    pkg_name_list_t *new_roots = pkg_name_list_new(5);
+    pkg_name_list_add(entries, entry);
+    keep_roots_expand(new_roots, entries, localdb, dbs_sync, arena);
+
+    for (int i = 0; i < new_roots->size; i++)
+    {
+        pkg_name_list_add(roots, new_roots->names[i]);
+    }
+    const int held_count = keep_closure_add_names(closure, new_roots, NULL, NULL);
+
+    pkg_name_list_free(entries);
+    pkg_name_list_free(new_roots);
+    return held_count;
+}
+
+// Keep list storage
+// The keep list is stored in ~/.config/lps/keep_packages, one name per line,
+// along with a journal (keep_packages.journal) of the changes made since, as
+// "+name" and "-name" lines. Every change is appended to the journal and
+// synced as soon as it's made, so a killed session loses nothing and saving
+// takes time in proportion to the changes.
+//
+// Once the journal is long enough, it's folded back into keep_packages on a
+// background thread. The journal is first renamed to keep_packages.journal.old
+// (so that new changes go to a fresh journal), then the list is loaded again
+// with the old journal replayed into it, written to a temporary file that's
+// renamed over keep_packages, and only then is the old journal deleted.
+// Replaying changes that are already in keep_packages does nothing, so
+// loading keep_packages, then the old journal, then the journal gives the
+// right list after a crash at any point.
+//
+// Several lps processes can share the keep list, so every change to these
+// files is made holding an flock on keep_packages.lock. A compaction holds it
+// from the rename to the delete, which makes changes from other processes
+// wait for it, and an appender whose journal was renamed away opens the new
+// one before writing.
+
+// The number of journal entries that triggers a compaction
+#define KEEP_JOURNAL_COMPACT_COUNT 64
+
+typedef struct _keep_store
+{
+    char path[PATH_MAX];
+    char journal_path[PATH_MAX + 16];
+    char old_journal_path[PATH_MAX + 16];
+    char lock_path[PATH_MAX + 16];
+    int lock_fd;
+    int journal_fd;
+    int journal_count; // The number of entries in the journal, as far as this process knows
+    bool has_old_journal; // Whether an old journal is waiting to be deleted
+
+    // Owned by the compaction thread while is_compacting is set
+    pthread_t compaction_thread;
+    bool is_compacting;
+    bool is_compaction_done; // Set atomically by the compaction thread as it exits
+    int compaction_err;
+} keep_store_t;
+
+// Applies the change to the keep list, where ids maps each name that's been
+// in names to its position, or to -1 once it's been removed. Names which are
+// removed stay in names until keep_store_open drops them.
+void keep_list_apply(pkg_name_list_t *names, name_set_t *ids, name_arena_t *arena, bool is_added, const char *str, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    const pkg_name_t name = name_arena_intern_n(arena, str, size);
+    name_set_item_t *item = name_set_find_str(ids, name_arena_str(arena, name), name.size, name.hash_value);
+
+    if (!is_added)
+    {
+        if (item != NULL)
+        {
+            item->id = -1;
+        }
+    }
+    else if (item == NULL)
+    {
+        name_set_add(ids, name, names->size);
+        pkg_name_list_add(names, name);
+    }
+    else if (item->id < 0)
+    {
+        item->id = names->size;
+        pkg_name_list_add(names, name);
+    }
+}
+
+// Applies every line of the file at path, where a journal's lines start with
+// + or -. The file is mapped and split in place, and each name is copied only
+// once, as it's interned into arena.
+// Returns the number of lines applied (0 if the file doesn't exist), or -1 on
+// failure.
+int keep_list_replay(const char *path, bool is_journal, pkg_name_list_t *names, name_set_t *ids, name_arena_t *arena)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (s.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    const char *map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    int line_count = 0;
+    const char *end = map + s.st_size;
+    for (const char *line = map; line < end;)
+    {
+        const char *newline = memchr(line, '\n', end - line);
+        const char *line_end = newline != NULL ? newline : end;
+
+        // A journal entry cut short by a crash has no newline, and is ignored
+        if (!is_journal)
+        {
+            keep_list_apply(names, ids, arena, true, line, line_end - line);
+        }
+        else if (newline != NULL && line_end > line && (line[0] == '+' || line[0] == '-'))
+        {
+            keep_list_apply(names, ids, arena, line[0] == '+', line + 1, line_end - line - 1);
+        }
+
+        line_count++;
+        line = line_end + 1;
+    }
+
+    munmap((void *)map, s.st_size);
+    return line_count;
+}
+
+// Loads keep_packages and the old journal into names (which must be empty),
+// followed by the journal if with_journal is set, and drops the names which
+// were removed. The caller holds the lock. Returns the number of journal
+// entries, or -1 on failure.
+int keep_list_load(const keep_store_t *store, bool with_journal, pkg_name_list_t *names, name_arena_t *arena, bool *has_old_journal)
+{
+    name_set_t *ids = name_set_new(arena);
+    const int list_count = keep_list_replay(store->path, false, names, ids, arena);
+    const int old_journal_count = keep_list_replay(store->old_journal_path, true, names, ids, arena);
+    const int journal_count = with_journal ? keep_list_replay(store->journal_path, true, names, ids, arena) : 0;
+
+    // Drop the names that were removed
+    int kept_count = 0;
+    for (int i = 0; i < names->size; i++)
+    {
+        if (name_set_get(ids, names->names[i]) == i)
+        {
+            names->names[kept_count++] = names->names[i];
+        }
+    }
+    names->size = kept_count;
+    name_set_free(ids);
+
+    if (has_old_journal != NULL)
+    {
+        *has_old_journal = old_journal_count > 0;
+    }
+    return list_count == -1 || old_journal_count == -1 ? -1 : journal_count;
+}
+
+// Opens the journal again if another process renamed it away since it was
+// opened, so that nothing is appended to an old journal that's about to be
+// deleted. The caller holds the lock. Returns -1 on failure.
+int keep_store_reopen_journal(keep_store_t *store)
+{
+    struct stat open_stat;
+    struct stat path_stat;
+    if (fstat(store->journal_fd, &open_stat) == -1)
+    {
+        return -1;
+    }
+
+    if (stat(store->journal_path, &path_stat) == 0 && path_stat.st_dev == open_stat.st_dev
+        && path_stat.st_ino == open_stat.st_ino)
+    {
+        return 0;
+    }
+
+    const int journal_fd = open(store->journal_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (journal_fd == -1)
+    {
+        return -1;
+    }
+    close(store->journal_fd);
+    store->journal_fd = journal_fd;
+    store->journal_count = 0;
+    return 0;
+}
+
+// Loads the keep list in dir_path into names (which must be empty), and opens
+// its journal for recording changes. Returns NULL (after printing an error) on
+// failure.
+keep_store_t *keep_store_open(const char *dir_path, name_arena_t *arena, pkg_name_list_t *names)
+{
+    keep_store_t *store = calloc(1, sizeof(keep_store_t));
+    snprintf(store->path, sizeof(store->path), "%s/keep_packages", dir_path);
+    snprintf(store->journal_path, sizeof(store->journal_path), "%s.journal", store->path);
+    snprintf(store->old_journal_path, sizeof(store->old_journal_path), "%s.journal.old", store->path);
+    snprintf(store->lock_path, sizeof(store->lock_path), "%s.lock", store->path);
+
+    // Read-only, so that closing it doesn't look like a change to the keep list
+    store->lock_fd = open(store->lock_path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (store->lock_fd == -1 || flock(store->lock_fd, LOCK_EX) == -1)
+    {
+        perror("Failed to lock the keep list");
+        if (store->lock_fd != -1)
+        {
+            close(store->lock_fd);
+        }
+        free(store);
+        return NULL;
+    }
+
+    store->journal_count = keep_list_load(store, true, names, arena, &store->has_old_journal);
+    if (store->journal_count == -1)
+    {
+        perror("Failed to read the keep list");
+        close(store->lock_fd);
+        free(store);
+        return NULL;
+    }
+
+    store->journal_fd = open(store->journal_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    flock(store->lock_fd, LOCK_UN);
+    if (store->journal_fd == -1)
+    {
+        perror("Failed to open the keep list journal");
+        close(store->lock_fd);
+        free(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+// Loads the keep list into names (which must be empty) again, as it is now,
+// including other processes' changes. The journal stays open, so that reading
+// the list doesn't look like a change to it. Returns -1 on failure.
+int keep_store_reload(keep_store_t *store, name_arena_t *arena, pkg_name_list_t *names)
+{
+    if (flock(store->lock_fd, LOCK_EX) == -1)
+    {
+        return -1;
+    }
+
+    const int journal_count = keep_list_load(store, true, names, arena, NULL);
+    flock(store->lock_fd, LOCK_UN);
+    return journal_count == -1 ? -1 : 0;
+}
+
+// Folds the journal into keep_packages, holding the lock. Returns -1 on failure.
+int keep_store_compact_locked(keep_store_t *store)
+{
+    // Changes from here on go to a fresh journal. An old journal that's still
+    // around (after a crash or a failed compaction) is folded in by itself,
+    // leaving the journal for the next compaction.
+    if (access(store->old_journal_path, F_OK) == -1
+        && rename(store->journal_path, store->old_journal_path) == -1)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    // The list is loaded again, rather than taken from this process, so that
+    // other processes' changes are kept
+    name_arena_t *arena = name_arena_new();
+    pkg_name_list_t *names = pkg_name_list_new(64);
+    if (keep_list_load(store, false, names, arena, NULL) == -1)
+    {
+        pkg_name_list_free(names);
+        name_arena_free(arena);
+        return -1;
+    }
+
+    char *snapshot = NULL;
+    size_t snapshot_size = 0;
+    FILE *snapshot_file = open_memstream(&snapshot, &snapshot_size);
+    for (int i = 0; i < names->size; i++)
+    {
+        fprintf(snapshot_file, "%s\n", name_arena_str(arena, names->names[i]));
+    }
+    fclose(snapshot_file);
+    pkg_name_list_free(names);
+    name_arena_free(arena);
+
+    // A temporary file of its own, so that compactions can't write over each other's
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", store->path);
+
+    const int fd = mkostemp(tmp_path, O_CLOEXEC);
+    bool write_failed = fd == -1 || fchmod(fd, 0644) == -1;
+    for (size_t written = 0; !write_failed && written < snapshot_size;)
+    {
+        const ssize_t size = write(fd, snapshot + written, snapshot_size - written);
+        write_failed = size <= 0;
+        written += size > 0 ? size : 0;
+    }
+    free(snapshot);
+
+    // The new file has to be on disk before it replaces the old one
+    write_failed = write_failed || fsync(fd) == -1;
+    if (fd != -1 && close(fd) == -1)
+    {
+        write_failed = true;
+    }
+
+    if (write_failed || rename(tmp_path, store->path) == -1)
+    {
+        if (fd != -1)
+        {
+            unlink(tmp_path);
+        }
+        return -1;
+    }
+
+    // And the rename has to be before the old journal is deleted
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s", store->path);
+    char *last_slash = strrchr(dir_path, '/');
+    if (last_slash != NULL)
+    {
+        *last_slash = '\0';
+    }
+
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    unlink(store->old_journal_path);
+    return 0;
+}
+
+void *keep_store_compact_run(void *arg)
+{
+    keep_store_t *store = (keep_store_t *)arg;
+
+    // A lock of its own, since flock doesn't keep out other users of the
+    // store's open file, such as this process's own appends
+    const int lock_fd = open(store->lock_path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1)
+    {
+        store->compaction_err = -1;
+    }
+    else
+    {
+        store->compaction_err = keep_store_compact_locked(store);
+    }
+
+    if (lock_fd != -1)
+    {
+        close(lock_fd);
+    }
+    __atomic_store_n(&store->is_compaction_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Waits for a compaction to finish, if one is running. Returns -1 if it failed.
+int keep_store_wait(keep_store_t *store)
+{
+    if (!store->is_compacting)
+    {
+        return 0;
+    }
+
+    pthread_join(store->compaction_thread, NULL);
+    store->is_compacting = false;
+
+    // The old journal is kept until its changes are safely in the list
+    store->has_old_journal = store->compaction_err != 0;
+    return store->compaction_err;
+}
+
+// Starts folding the journal into the list on a background thread, unless a
+// compaction is already running. Returns -1 on failure.
+int keep_store_compact(keep_store_t *store)
+{
+    // A finished compaction makes way for the next one
+    if (store->is_compacting && __atomic_load_n(&store->is_compaction_done, __ATOMIC_ACQUIRE))
+    {
+        keep_store_wait(store);
+    }
+
+    if (store->is_compacting)
+    {
+        return 0;
+    }
+
+    // The journal will be renamed away, and anything appended after that
+    // goes to a fresh one
+    store->journal_count = 0;
+    store->is_compaction_done = false;
+    if (pthread_create(&store->compaction_thread, NULL, keep_store_compact_run, store) != 0)
+    {
+        return -1;
+    }
+
+    store->is_compacting = true;
+    return 0;
+}
+
+// Records that name was added to (or removed from) the keep list. Returns -1
+// if the change couldn't be saved.
+int keep_store_record(keep_store_t *store, bool is_added, pkg_name_t name, const name_arena_t *arena)
+{
+    // Patterns can be any length, so the entry is written from its parts
+    // rather than formatted into a buffer
+    char prefix = is_added ? '+' : '-';
+    char newline = '\n';
+    struct iovec line[] = {
+        {&prefix, 1},
+        {(void *)name_arena_str(arena, name), name.size},
+        {&newline, 1},
+    };
+    const ssize_t line_size = (ssize_t)name.size + 2;
+
+    if (flock(store->lock_fd, LOCK_EX) == -1)
+    {
+        return -1;
+    }
+
+    // A single writev with O_APPEND, so the entry can only be cut short, which
+    // loading ignores
+    const bool write_failed = keep_store_reopen_journal(store) == -1
+                              || writev(store->journal_fd, line, 3) != line_size
+                              || fdatasync(store->journal_fd) == -1;
+    flock(store->lock_fd, LOCK_UN);
+    if (write_failed)
+    {
+        return -1;
+    }
+    store->journal_count++;
+
+    return store->journal_count >= KEEP_JOURNAL_COMPACT_COUNT ? keep_store_compact(store) : 0;
+}
+
+// Waits for any compaction to finish. Returns -1 if it failed.
+int keep_store_close(keep_store_t *store)
+{
+    if (store == NULL)
+    {
+        return 0;
+    }
+
+    const int err = keep_store_wait(store);
+    close(store->journal_fd);
+    close(store->lock_fd);
+    free(store);
+    return err;
+}
+
+// Package cache index
+// A package whose archive is already in one of pacman's CacheDirs costs
+// nothing to download. Rather than stat'ing one file per candidate, every
+// CacheDir is read once into a table of "name-version" keys, sorted by hash,
+// and that's only read again when a directory's mtime changes (i.e. when an
+// archive was added or removed). Lookups don't modify the index, so the
+// candidates can be checked on several threads at once.
+
+// The fewest packages worth giving their own thread
+#define PKG_CACHE_MARK_CHUNK_SIZE 2048
+
+typedef struct _pkg_cache_index
+{
+    char **dirs;
+    struct timespec *dir_mtimes; // As of the last read, or zero if a dir couldn't be read
+    int dir_count;
+    name_arena_t *arena; // Holds the keys
+    pkg_name_t *keys; // Sorted by hash_value
+    int key_count;
+    int key_capacity;
+} pkg_cache_index_t;
+
+typedef struct _pkg_cache_mark_job
+{
+    const pkg_cache_index_t *index;
+    const name_arena_t *arena;
+    pkg_state_list_t *list;
+    int start;
+    int count;
+} pkg_cache_mark_job_t;
+
+int compare_name_hashes(const void *a, const void *b)
+{
+    const uint32_t x = ((const pkg_name_t *)a)->hash_value;
+    const uint32_t y = ((const pkg_name_t *)b)->hash_value;
+    return (x > y) - (x < y);
+}
+
+// Returns the size of the "name-version" prefix of file_name, which is
+// name-pkgver-pkgrel-arch.pkg.tar[.ext] for a package archive, or 0 if
+// file_name isn't an archive (e.g. a signature or a partial download)
+size_t pkg_archive_key_size(const char *file_name)
+{
+    const char *extension = strstr(file_name, ".pkg.tar");
+    const size_t size = strlen(file_name);
+    if (extension == NULL || (size >= 4 && strcmp(file_name + size - 4, ".sig") == 0)
+        || (size >= 5 && strcmp(file_name + size - 5, ".part") == 0))
+    {
+        return 0;
+    }
+
+    // Drop the arch
+    const char *arch_start = extension;
+    while (arch_start > file_name && arch_start[-1] != '-')
+    {
+        arch_start--;
+    }
+
+    return arch_start > file_name ? arch_start - 1 - file_name : 0;
+}
+
+// Replaces the index's keys with the archives currently in its dirs
+void pkg_cache_index_read(pkg_cache_index_t *index)
+{
+    if (index->arena != NULL)
+    {
+        name_arena_free(index->arena);
+    }
+    index->arena = name_arena_new();
+    index->key_count = 0;
+
+    for (int i = 0; i < index->dir_count; i++)
+    {
+        // The mtime is taken first, so an archive added during the read causes another one
+        struct stat s;
+        memset(&index->dir_mtimes[i], 0, sizeof(struct timespec));
+        if (stat(index->dirs[i], &s) == -1)
+        {
+            continue;
+        }
+        index->dir_mtimes[i] = s.st_mtim;
+
+        DIR *dir = opendir(index->dirs[i]);
+        if (dir == NULL)
+        {
+            continue;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            const size_t key_size = pkg_archive_key_size(entry->d_name);
+            if (key_size == 0)
+            {
+                continue;
+            }
+
+            if (index->key_count >= index->key_capacity)
+            {
+                index->key_capacity *= 2;
+                index->keys = realloc(index->keys, sizeof(pkg_name_t) * index->key_capacity);
+                trace_count(&trace_counters.allocations, 1);
+            }
+            index->keys[index->key_count++] = name_arena_intern_n(index->arena, entry->d_name, key_size);
+        }
+        closedir(dir);
+    }
+
+    qsort(index->keys, index->key_count, sizeof(pkg_name_t), compare_name_hashes);
+}
+
+// Indexes the archives in every dir in dirs
+pkg_cache_index_t *pkg_cache_index_new(const pkg_name_list_t *dirs, const name_arena_t *arena)
+{
+    const double start_ms = get_time_ms();
+
+    pkg_cache_index_t *index = calloc(1, sizeof(pkg_cache_index_t));
+    index->dir_count = dirs->size;
+    index->dirs = malloc(sizeof(char *) * (dirs->size + 1));
+    index->dir_mtimes = malloc(sizeof(struct timespec) * (dirs->size + 1));
+    for (int i = 0; i < dirs->size; i++)
+    {
+        index->dirs[i] = strdup(name_arena_str(arena, dirs->names[i]));
+    }
+    index->key_capacity = 64;
+    index->keys = malloc(sizeof(pkg_name_t) * index->key_capacity);
+    trace_count(&trace_counters.allocations, 4 + dirs->size);
+
+    pkg_cache_index_read(index);
+
+    trace_record("index_pkg_cache", start_ms, trace_thread_id);
+    return index;
+}
+
+// Whether any of the index's dirs has changed since it was read, which takes
+// a stat per dir
+bool pkg_cache_index_is_stale(const pkg_cache_index_t *index)
+{
+    for (int i = 0; i < index->dir_count; i++)
+    {
+        struct stat s;
+        struct timespec mtime;
+        memset(&mtime, 0, sizeof(struct timespec));
+        if (stat(index->dirs[i], &s) == 0)
+        {
+            mtime = s.st_mtim;
+        }
+
+        if (mtime.tv_sec != index->dir_mtimes[i].tv_sec || mtime.tv_nsec != index->dir_mtimes[i].tv_nsec)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Whether there's an archive of the given version of the package called name
+bool pkg_cache_index_has(const pkg_cache_index_t *index, const char *name, size_t name_size, const char *version, size_t version_size)
+{
+    char key[512];
+    const size_t key_size = name_size + 1 + version_size;
+    if (key_size > sizeof(key))
+    {
+        return false;
+    }
+
+    memcpy(key, name, name_size);
+    key[name_size] = '-';
+    memcpy(key + name_size + 1, version, version_size);
+    const uint32_t hash_value = hash(key, key_size);
+
+    // Find the first key with this hash
+    int low = 0;
+    int high = index->key_count;
+    while (low < high)
+    {
+        const int middle = low + (high - low) / 2;
+        if (index->keys[middle].hash_value < hash_value)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    for (int i = low; i < index->key_count && index->keys[i].hash_value == hash_value; i++)
+    {
+        if (pkg_name_eql(index->arena, index->keys[i], key, key_size, hash_value))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void *pkg_cache_mark_worker(void *_job)
+{
+    pkg_cache_mark_job_t *job = (pkg_cache_mark_job_t *)_job;
+
+    pkg_state_list_t *list = job->list;
+    for (int i = job->start; i < job->start + job->count; i++)
+    {
+        list->ary[i].is_cached = pkg_cache_index_has(job->index, name_arena_str(job->arena, list->names[i]),
+                                                     list->names[i].size,
+                                                     name_arena_str(job->arena, list->new_versions[i]),
+                                                     list->new_versions[i].size);
+    }
+
+    return NULL;
+}
+
+// Sets is_cached on each package in list, splitting them between up to
+// thread_count threads (including the calling one)
+void pkg_cache_mark(const pkg_cache_index_t *index, const name_arena_t *arena, pkg_state_list_t *list, int thread_count)
+{
+    const double start_ms = get_time_ms();
+    const int count = list->size;
+
+    const int job_count = max(1, min(thread_count, count / PKG_CACHE_MARK_CHUNK_SIZE));
+    pkg_cache_mark_job_t *jobs = malloc(sizeof(pkg_cache_mark_job_t) * job_count);
+    pthread_t *workers = malloc(sizeof(pthread_t) * job_count);
+    bool *is_started = calloc(job_count, sizeof(bool));
+
+    for (int i = 0; i < job_count; i++)
+    {
+        const int start = (int)((int64_t)count * i / job_count);
+        jobs[i].index = index;
+        jobs[i].arena = arena;
+        jobs[i].list = list;
+        jobs[i].start = start;
+        jobs[i].count = (int)((int64_t)count * (i + 1) / job_count) - start;
+    }
+
+    // If a thread can't be created, its share is done on this one
+    for (int i = 1; i < job_count; i++)
+    {
+        is_started[i] = pthread_create(&workers[i], NULL, pkg_cache_mark_worker, &jobs[i]) == 0;
+    }
+
+    for (int i = 0; i < job_count; i++)
+    {
+        if (!is_started[i])
+        {
+            pkg_cache_mark_worker(&jobs[i]);
+        }
+    }
+
+    for (int i = 1; i < job_count; i++)
+    {
+        if (is_started[i])
+        {
+            pthread_join(workers[i], NULL);
+        }
+    }
+
+    free(jobs);
+    free(workers);
+    free(is_started);
+
+    trace_record("mark_cached", start_ms, trace_thread_id);
+}
+
+void pkg_cache_index_free(pkg_cache_index_t *index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < index->dir_count; i++)
+    {
+        free(index->dirs[i]);
+    }
+    free(index->dirs);
+    free(index->dir_mtimes);
+    name_arena_free(index->arena);
+    free(index->keys);
+    free(index);
+}
+
+typedef struct _download_totals
+{
+    off_t size; // Of every package that isn't cached
+    int count;
+    int cached_count;
+    off_t selected_size;
+    int selected_count;
+} download_totals_t;
+
+void download_totals_get(download_totals_t *totals, const pkg_state_list_t *upgrade_list)
+{
+    memset(totals, 0, sizeof(download_totals_t));
+    totals->count = upgrade_list->size;
+
+    for (int i = 0; i < upgrade_list->size; i++)
+    {
+        totals->size += pkg_state_download_cost(upgrade_list, i);
+        totals->cached_count += upgrade_list->ary[i].is_cached;
+    }
+
+    totals->selected_count = pkg_state_list_selected_count(upgrade_list);
+    for (int i = pkg_state_list_next_selected(upgrade_list, 0); i >= 0; i = pkg_state_list_next_selected(upgrade_list, i + 1))
+    {
+        totals->selected_size += pkg_state_download_cost(upgrade_list, i);
+    }
+}
+
+// Headless output
+// With --output, upgrade candidates are written to stdout instead of being
+// shown in termbox, either as one name per line or as one JSON object per
+// line. With --unsorted, each candidate is written as soon as its chunk of
+// the version scan has been merged, rather than after the sort.
+
+typedef enum _output_format
+{
+    OUTPUT_NONE,
+    OUTPUT_NAMES,
+    OUTPUT_NDJSON,
+} output_format_t;
+
+typedef struct _upgrade_printer
+{
+    output_format_t format;
+    FILE *file;
+    alpm_db_t *localdb;
+    alpm_list_t *dbs_sync;
+    const name_arena_t *arena;
+    int printed_count;
+} upgrade_printer_t;
+
+// Writes str as a JSON string, escaping anything JSON doesn't allow as is
+void write_json_str(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (const unsigned char *c = (const unsigned char *)str; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fputc('\\', file);
+            fputc(*c, file);
+        }
+        else if (*c < 0x20)
+        {
+            fprintf(file, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Prints the package at index in list
+void upgrade_printer_print(upgrade_printer_t *printer, pkg_state_list_t *list, int index)
+{
+    const char *name = name_arena_str(printer->arena, list->names[index]);
+
+    if (printer->format == OUTPUT_NAMES)
+    {
+        fprintf(printer->file, "%s\n", name);
+    }
+    else
+    {
+        // The installed version and the repo aren't kept in the list (or the
+        // cache), but both are a hash lookup away in libalpm
+        alpm_pkg_t *local_pkg = alpm_db_get_pkg(printer->localdb, name);
+        alpm_pkg_t *new_pkg = pkg_state_get_pkg(list, index, printer->arena, printer->dbs_sync);
+
+        fprintf(printer->file, "{\"name\":");
+        write_json_str(printer->file, name);
+        fprintf(printer->file, ",\"old_version\":");
+        write_json_str(printer->file, local_pkg != NULL ? alpm_pkg_get_version(local_pkg) : "");
+        fprintf(printer->file, ",\"new_version\":");
+        write_json_str(printer->file, name_arena_str(printer->arena, list->new_versions[index]));
+        fprintf(printer->file, ",\"isize\":%lld,\"repo\":", (long long)list->isizes[index]);
+        write_json_str(printer->file, new_pkg != NULL ? alpm_db_get_name(alpm_pkg_get_db(new_pkg)) : "");
+        fprintf(printer->file, "}\n");
+    }
+
+    printer->printed_count++;
+}
+
+// Background loading
+// When the upgrade list isn't cached, the TUI opens straight away, and the
+// graph, keep closure and version scan run on a loader thread instead. The
+// scan hands its candidates over in batches as it merges them, and the UI
+// thread merges each batch into the visible (sorted) list.
+//
+// libalpm isn't thread-safe, so while the loader runs, both threads only call
+// into it with alpm_mutex held. The arena is only written by the loader until
+// it finishes; the UI thread only reads names from batches it's been handed,
+// which live in blocks that never move.
+
+#define TRACE_LOADER_THREAD_ID -1
+
+pthread_mutex_t alpm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct _upgrade_loader
+{
+    pthread_t thread;
+
+    // Set up before the thread starts, and not changed until it's finished
+    alpm_handle_t *handle;
+    alpm_db_t *localdb;
+    alpm_list_t *dbs_sync;
+    name_arena_t *arena;
+    const pkg_name_list_t *keep_names;
+    int thread_count;
+    name_set_t *previous_names; // The packages in the old cache, for marking new ones
+
+    pthread_mutex_t mutex; // Guards everything below
+    pkg_state_list_t *pending; // Candidates found since the UI thread last took them
+    const char *phase; // What the loader is doing, for the status line
+    double progress; // Of the version scan, from 0 to 1
+    bool is_finished;
+
+    bool is_cancelled; // Set atomically by the UI thread to stop the scan early
+
+    // Only touched by the UI thread once is_finished is set
+    pkg_graph_t *graph;
+    keep_closure_t *closure;
+} upgrade_loader_t;
+
+void upgrade_loader_set_phase(upgrade_loader_t *loader, const char *phase)
+{
+    pthread_mutex_lock(&loader->mutex);
+    loader->phase = phase;
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+// Hands the newly found candidates in states, from start to the end, over to
+// the UI thread
+void upgrade_loader_push(upgrade_loader_t *loader, const pkg_state_list_t *states, int start, double progress)
+{
+    pthread_mutex_lock(&loader->mutex);
+
+    for (int i = start; i < states->size; i++)
+    {
+        const int index = pkg_state_list_add(loader->pending);
+        pkg_state_list_copy(loader->pending, index, states, i);
+        loader->pending->ary[index].is_new = loader->previous_names != NULL
+                                             && !name_set_has(loader->previous_names, states->names[i]);
+    }
+    loader->progress = progress;
+
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+bool upgrade_loader_is_cancelled(upgrade_loader_t *loader)
+{
+    return loader != NULL && __atomic_load_n(&loader->is_cancelled, __ATOMIC_RELAXED);
+}
+
+// Upgrade candidate scan
+// libalpm isn't safe to call from several threads at once (lookups can load a
+// syncdb's package cache, and every call writes the handle's errno), so the
+// sync packages and version strings are first gathered into a read-only
+// snapshot on the calling thread. Only the version comparisons, which
+// don't touch the handle, are spread across the worker threads.
+
+typedef struct _version_snapshot
+{
+    alpm_pkg_t *new_pkg; // The first package with the same name in the syncdbs
+    alpm_pkg_t *local_pkg;
+    const char *local_version;
+    const char *new_version;
+} version_snapshot_t;
+
+typedef struct _upgrade_scan
+{
+    const version_snapshot_t *snapshots;
+    int snapshot_count;
+    int chunk_size;
+    int chunk_count;
+    int next_chunk; // Claimed by the workers with an atomic fetch-and-add
+    int next_thread_id; // Identifies each worker's events in the trace
+    int **chunk_results; // The snapshot indices of each chunk's candidates, ending with -1
+
+    // Only used by the calling thread
+    int merged_count; // The number of chunks merged into upgrade_list so far
+    name_arena_t *arena;
+    alpm_list_t *dbs_sync;
+    pkg_state_list_t *upgrade_list;
+    upgrade_printer_t *printer;
+    upgrade_loader_t *loader;
+} upgrade_scan_t;
+
+// Merges the results of every finished chunk that follows the chunks merged
+// so far into the upgrade list, in chunk order, which is graph order. Names
+// are only interned here, since the arena isn't thread-safe.
+void upgrade_scan_merge(upgrade_scan_t *scan)
+{
+    const int first_count = scan->upgrade_list->size;
+
+    pthread_mutex_lock(&alpm_mutex);
+    while (scan->merged_count < scan->chunk_count)
+    {
+        int *candidates = __atomic_load_n(&scan->chunk_results[scan->merged_count], __ATOMIC_ACQUIRE);
+        if (candidates == NULL)
+        {
+            break;
+        }
+
+        for (int i = 0; candidates[i] >= 0; i++)
+        {
+            const version_snapshot_t *snapshot = &scan->snapshots[candidates[i]];
+            pkg_state_list_add_pkg(scan->upgrade_list, scan->arena, snapshot->new_pkg, snapshot->local_pkg, scan->dbs_sync);
+        }
+        free(candidates);
+        scan->merged_count++;
+    }
+    pthread_mutex_unlock(&alpm_mutex);
+
+    if (scan->loader != NULL)
+    {
+        upgrade_loader_push(scan->loader, scan->upgrade_list, first_count,
+                            (double)scan->merged_count / scan->chunk_count);
+    }
+
+    if (scan->printer != NULL && scan->upgrade_list->size > first_count)
+    {
+        for (int i = first_count; i < scan->upgrade_list->size; i++)
+        {
+            upgrade_printer_print(scan->printer, scan->upgrade_list, i);
+        }
+        fflush(scan->printer->file);
+    }
+}
+
+// Compares versions until every chunk has been claimed. If is_merging is set
+// (only for the calling thread), finished chunks are merged in between.
+void upgrade_scan_compare(upgrade_scan_t *scan, bool is_merging)
+{
+    const int thread_id = __atomic_fetch_add(&scan->next_thread_id, 1, __ATOMIC_RELAXED);
+    const double start_ms = get_time_ms();
+
+    while (true)
+    {
+        const int chunk = __atomic_fetch_add(&scan->next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= scan->chunk_count || upgrade_loader_is_cancelled(scan->loader))
+        {
+            break;
+        }
+
+        const int start = chunk * scan->chunk_size;
+        const int end = min(start + scan->chunk_size, scan->snapshot_count);
+        int *candidates = malloc(sizeof(int) * (end - start + 1));
+        int candidate_count = 0;
+
+        for (int i = start; i < end; i++)
+        {
+            const version_snapshot_t *snapshot = &scan->snapshots[i];
+            if (alpm_pkg_vercmp(snapshot->new_version, snapshot->local_version) > 0)
+            {
+                candidates[candidate_count++] = i;
+            }
+        }
+
+        candidates[candidate_count] = -1;
+        __atomic_store_n(&scan->chunk_results[chunk], candidates, __ATOMIC_RELEASE);
+
+        if (is_merging)
+        {
+            upgrade_scan_merge(scan);
+        }
+    }
+
+    trace_record("version_compare", start_ms, thread_id);
+}
+
+void *upgrade_scan_worker(void *_scan)
+{
+    upgrade_scan_compare((upgrade_scan_t *)_scan, false);
+    return NULL;
+}
+
+// Returns the package which would replace the installed package called name,
+// or NULL if there is none or it's ignored. Like alpm_sync_get_new_version,
+// only the first syncdb with a package of the same name counts. libalpm only
+// loads a syncdb's package cache the first time it's searched, so later repos
+// are only loaded if some package isn't found in the earlier ones.
+// Only the syncdbs from position first_index on are searched, for when the
+// earlier ones are known not to have the package. *repo_index (if it isn't
+// NULL) is set to the position of the syncdb with it, even if it's ignored, or
+// to -1 if there is none.
+alpm_pkg_t *find_sync_pkg_from(alpm_handle_t *handle, const char *name, alpm_list_t *dbs_sync, int first_index, int *repo_index)
+{
+    alpm_pkg_t *new_pkg = NULL;
+    int index = 0;
+    for (alpm_list_t *curr = dbs_sync; new_pkg == NULL && curr != NULL; curr = curr->next, index++)
+    {
+        if (index >= first_index)
+        {
+            new_pkg = alpm_db_get_pkg((alpm_db_t *)curr->data, name);
+        }
+    }
+
+    if (repo_index != NULL)
+    {
+        *repo_index = new_pkg != NULL ? index - 1 : -1;
+    }
+
+    // Honor IgnorePkg and IgnoreGroup, like pacman -Su does
+    if (new_pkg != NULL && alpm_pkg_should_ignore(handle, new_pkg))
+    {
+        return NULL;
+    }
+
+    return new_pkg;
+}
+
+alpm_pkg_t *find_sync_pkg(alpm_handle_t *handle, const char *name, alpm_list_t *dbs_sync)
+{
+    return find_sync_pkg_from(handle, name, dbs_sync, 0, NULL);
+}
+
+// Appends the newer sync version of every package in graph that isn't in
+// held to upgrade_list, using thread_count threads (including the calling
+// one). This gives the same results, in the same order, as calling
+// alpm_sync_get_new_version on each package in turn.
+// If printer isn't NULL, the candidates are also printed as they're found, and
+// likewise handed to loader if it isn't NULL.
+void find_upgrades(alpm_handle_t *handle, pkg_graph_t *graph, name_arena_t *arena, const bitset_t *held, alpm_list_t *dbs_sync, int thread_count, pkg_state_list_t *upgrade_list, upgrade_printer_t *printer, upgrade_loader_t *loader)
+{
+    const double snapshot_start_ms = get_time_ms();
+    version_snapshot_t *snapshots = malloc(sizeof(version_snapshot_t) * (graph->size + 1));
+    int snapshot_count = 0;
+
+    pthread_mutex_lock(&alpm_mutex);
+    for (int id = 0; id < graph->size; id++)
+    {
+        // Packages in the keep list's closure are never upgrade candidates
+        if (bitset_test(held, id))
+        {
+            continue;
+        }
+
+        alpm_pkg_t *new_pkg = find_sync_pkg_from(handle, name_arena_str(arena, graph->names[id]), dbs_sync, 0,
+                                                 &graph->sync_repo_indices[id]);
+        if (new_pkg != NULL)
+        {
+            version_snapshot_t *snapshot = &snapshots[snapshot_count++];
+            snapshot->new_pkg = new_pkg;
+            snapshot->local_pkg = graph->pkgs[id];
+            snapshot->local_version = alpm_pkg_get_version(graph->pkgs[id]);
+            snapshot->new_version = alpm_pkg_get_version(new_pkg);
+        }
+    }
+    pthread_mutex_unlock(&alpm_mutex);
+
+    trace_record("version_snapshot", snapshot_start_ms, trace_thread_id);
+    trace_count(&trace_counters.packages_visited, snapshot_count);
+
+    upgrade_scan_t scan;
+    scan.snapshots = snapshots;
+    scan.snapshot_count = snapshot_count;
+    // Several chunks per thread, so that threads which finish early can
+    // take over work from slower ones
+    scan.chunk_size = snapshot_count / (thread_count * 8) + 1;
+    if (scan.chunk_size < 64)
+    {
+        scan.chunk_size = 64;
+    }
+    scan.chunk_count = (snapshot_count + scan.chunk_size - 1) / scan.chunk_size;
+    scan.next_chunk = 0;
+    scan.next_thread_id = 1;
+    scan.chunk_results = calloc(scan.chunk_count + 1, sizeof(int *));
+    scan.merged_count = 0;
+    scan.arena = arena;
+    scan.upgrade_list = upgrade_list;
+    scan.dbs_sync = dbs_sync;
+    scan.printer = printer;
+    scan.loader = loader;
+
+    const int worker_count = min(thread_count, scan.chunk_count) - 1;
+    pthread_t *workers = malloc(sizeof(pthread_t) * (worker_count + 1));
+    int started_count = 0;
+    for (int i = 0; i < worker_count; i++)
+    {
+        // If a thread can't be created, the remaining threads pick up its share
+        if (pthread_create(&workers[started_count], NULL, upgrade_scan_worker, &scan) == 0)
+        {
+            started_count++;
+        }
+    }
+
+    // Only merge early when streaming, so the common case doesn't pay for it
+    upgrade_scan_compare(&scan, printer != NULL || loader != NULL);
+
+    for (int i = 0; i < started_count; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    upgrade_scan_merge(&scan);
+
+    // Chunks are left unmerged if the scan was cancelled
+    for (int chunk = scan.merged_count; chunk < scan.chunk_count; chunk++)
+    {
+        free(scan.chunk_results[chunk]);
+    }
+
+    free(workers);
+    free(scan.chunk_results);
+    free(snapshots);
+}
+
+// Merges the upgrades of just the packages in ids into upgrade_list (which
+// must be sorted), e.g. after they're released from the keep list. Only those
+// packages are looked up, so nothing else is scanned again. *tracked_index is
+// updated as in pkg_state_list_merge_sorted. upgrade_list must have been
+// sorted by mode. Packages in pkg_cache (if it isn't NULL) are marked as
+// cached, and the packages added are printed with printer (if it isn't NULL).
+// Returns the number of packages added.
+int add_upgrades_of(alpm_handle_t *handle, pkg_graph_t *graph, name_arena_t *arena, const int *ids, int id_count, alpm_list_t *dbs_sync, const pkg_cache_index_t *pkg_cache, sort_mode_t mode, pkg_state_list_t *upgrade_list, int *tracked_index, upgrade_printer_t *printer)
+{
+    pkg_state_list_t *additions = pkg_state_list_new(id_count + 1);
+
+    for (int i = 0; i < id_count; i++)
+    {
+        alpm_pkg_t *new_pkg = find_sync_pkg_from(handle, name_arena_str(arena, graph->names[ids[i]]), dbs_sync, 0,
+                                                 &graph->sync_repo_indices[ids[i]]);
+        if (new_pkg != NULL
+            && alpm_pkg_vercmp(alpm_pkg_get_version(new_pkg), alpm_pkg_get_version(graph->pkgs[ids[i]])) > 0)
+        {
+            pkg_state_list_add_pkg(additions, arena, new_pkg, graph->pkgs[ids[i]], dbs_sync);
+        }
+    }
+
+    if (pkg_cache != NULL)
+    {
+        pkg_cache_mark(pkg_cache, arena, additions, 1);
+    }
+
+    pkg_state_list_sort(additions, mode, arena, NULL);
+    for (int i = 0; printer != NULL && i < additions->size; i++)
+    {
+        upgrade_printer_print(printer, additions, i);
+    }
+    pkg_state_list_merge_sorted(upgrade_list, additions, arena, tracked_index);
+
+    const int added_count = additions->size;
+    pkg_state_list_free(additions);
+
+    return added_count;
+}
+
+// Appends the candidates to fresh again, as find_upgrades would, after the
+// syncdbs from position first_changed_repo on changed and nothing else did.
+// upgrade_list holds the candidates found before. A package whose first
+// syncdb is an earlier one is unaffected, so its old entry (if it has one) is
+// copied, and only the other packages are looked up again, in the changed
+// syncdbs alone. Packages that were never looked up are searched for in
+// every syncdb.
+void find_upgrades_in_repos(alpm_handle_t *handle, pkg_graph_t *graph, name_arena_t *arena, const bitset_t *held, alpm_list_t *dbs_sync, int first_changed_repo, const pkg_state_list_t *upgrade_list, pkg_state_list_t *fresh)
+{
+    const double start_ms = get_time_ms();
+    name_set_t *list_indices = name_set_new(arena);
+    for (int i = 0; i < upgrade_list->size; i++)
+    {
+        name_set_add(list_indices, upgrade_list->names[i], i);
+    }
+
+    int looked_up_count = 0;
+    pthread_mutex_lock(&alpm_mutex);
+    for (int id = 0; id < graph->size; id++)
+    {
+        if (bitset_test(held, id))
+        {
+            continue;
+        }
+
+        const int repo_index = graph->sync_repo_indices[id];
+        if (repo_index >= 0 && repo_index < first_changed_repo)
+        {
+            const int list_index = name_set_get(list_indices, graph->names[id]);
+            if (list_index >= 0)
+            {
+                pkg_state_list_copy(fresh, pkg_state_list_add(fresh), upgrade_list, list_index);
+            }
+            continue;
+        }
+
+        alpm_pkg_t *new_pkg = find_sync_pkg_from(handle, name_arena_str(arena, graph->names[id]), dbs_sync,
+                                                 repo_index == -2 ? 0 : first_changed_repo,
+                                                 &graph->sync_repo_indices[id]);
+        if (new_pkg != NULL
+            && alpm_pkg_vercmp(alpm_pkg_get_version(new_pkg), alpm_pkg_get_version(graph->pkgs[id])) > 0)
+        {
+            pkg_state_list_add_pkg(fresh, arena, new_pkg, graph->pkgs[id], dbs_sync);
+        }
+        looked_up_count++;
+    }
+    pthread_mutex_unlock(&alpm_mutex);
+
+    name_set_free(list_indices);
+    trace_record("rescan_changed_repos", start_ms, trace_thread_id);
+    trace_count(&trace_counters.packages_visited, looked_up_count);
+}
+
+// Upgrade candidate cache
+// The upgrade list is saved to ~/.config/lps/upgrade_cache, along with a key
+// derived from the state of the syncdbs, the localdb and the keep file. When
+// the key still matches on the next launch, the list is read back from the
+// cache instead of being recomputed. The sort keys are kept too, so the list
+// can be sorted by any mode without touching libalpm.
+//
+// The file is a upgrade_cache_header_t, followed by entry_count
+// upgrade_cache_entry_t, followed by the characters the entries refer to.
+
+#define UPGRADE_CACHE_MAGIC "LPSCACHE"
+// Also bumped when the list itself is computed differently (3: dependencies
+// are resolved through provides)
+#define UPGRADE_CACHE_FORMAT_VERSION 3
+
+typedef struct _upgrade_cache_header
+{
+    char magic[8];
+    uint32_t format_version;
+    uint32_t entry_count;
+    uint64_t key;
+    uint64_t strings_size;
+} upgrade_cache_header_t;
+
+typedef struct _upgrade_cache_entry
+{
+    uint32_t name_offset; // Offsets are relative to the start of the strings
+    uint32_t name_size;
+    uint32_t version_offset;
+    uint32_t version_size;
+    int64_t isize;
+    int64_t download_size;
+    int64_t old_isize;
+    int32_t repo_index;
+    uint32_t padding;
+} upgrade_cache_entry_t;
+
+typedef struct _upgrade_cache
+{
+    void *map;
+    size_t map_size;
+    const upgrade_cache_header_t *header;
+    const upgrade_cache_entry_t *entries;
+    const char *strings;
+} upgrade_cache_t;
+
+uint64_t hash_file_state(uint64_t key, const char *path)
+{
+    struct stat s;
+    if (stat(path, &s) == -1)
+    {
+        // Missing files still change the key, so that their appearance is noticed
+        memset(&s, 0, sizeof(struct stat));
+    }
+
+    key = fnv1a_64(key, path, strlen(path));
+    key = fnv1a_64(key, &s.st_ino, sizeof(s.st_ino));
+    key = fnv1a_64(key, &s.st_size, sizeof(s.st_size));
+    key = fnv1a_64(key, &s.st_mtim.tv_sec, sizeof(s.st_mtim.tv_sec));
+    key = fnv1a_64(key, &s.st_mtim.tv_nsec, sizeof(s.st_mtim.tv_nsec));
+    return key;
+}
+
+// Computes a key which changes whenever the relevant parts of pacman.conf
+// (summarized by config_hash), any of the registered syncdbs, the localdb or
+// the keep list (summarized by keep_hash) change
+uint64_t upgrade_cache_key(uint64_t config_hash, const char *db_path, alpm_list_t *dbs_sync, uint64_t keep_hash)
+{
+    uint64_t key = FNV_OFFSET_BASIS;
+    const uint32_t format_version = UPGRADE_CACHE_FORMAT_VERSION;
+    key = fnv1a_64(key, &format_version, sizeof(format_version));
+    key = fnv1a_64(key, &config_hash, sizeof(config_hash));
+
+    char path[PATH_MAX];
+    for (alpm_list_t *curr = dbs_sync; curr != NULL; curr = curr->next)
+    {
+        snprintf(path, PATH_MAX, "%s/sync/%s.db", db_path, alpm_db_get_name((alpm_db_t *)curr->data));
+        key = hash_file_state(key, path);
+    }
+
+    // Installing, upgrading or removing a package adds or removes an entry in
+    // the localdb directory, which updates its mtime
+    snprintf(path, PATH_MAX, "%s/local", db_path);
+    key = hash_file_state(key, path);
+
+    // The keep list's contents rather than its files, which are rewritten
+    // whenever its journal is compacted
+    key = fnv1a_64(key, &keep_hash, sizeof(keep_hash));
+
+    return key;
+}
+
+// Maps the cache file at path, returning NULL if it doesn't exist or is invalid
+upgrade_cache_t *upgrade_cache_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) == -1 || (size_t)s.st_size < sizeof(upgrade_cache_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    upgrade_cache_t *cache = malloc(sizeof(upgrade_cache_t));
+    cache->map = map;
+    cache->map_size = s.st_size;
+    cache->header = (const upgrade_cache_header_t *)map;
+    cache->entries = (const upgrade_cache_entry_t *)(cache->header + 1);
+    cache->strings = (const char *)(cache->entries + cache->header->entry_count);
+
+    const uint64_t expected_size = sizeof(upgrade_cache_header_t)
+                                   + (uint64_t)cache->header->entry_count * sizeof(upgrade_cache_entry_t)
+                                   + cache->header->strings_size;
+
+    bool is_valid = memcmp(cache->header->magic, UPGRADE_CACHE_MAGIC, 8) == 0
+                    && cache->header->format_version == UPGRADE_CACHE_FORMAT_VERSION
+                    && expected_size == cache->map_size;
+
+    for (uint32_t i = 0; is_valid && i < cache->header->entry_count; i++)
+    {
+        const upgrade_cache_entry_t *entry = &cache->entries[i];
+        is_valid = (uint64_t)entry->name_offset + entry->name_size <= cache->header->strings_size
+                   && (uint64_t)entry->version_offset + entry->version_size <= cache->header->strings_size;
+    }
+
+    if (!is_valid)
+    {
+        munmap(map, s.st_size);
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+// Appends every cached entry to upgrade_list, in their cached order
+void upgrade_cache_load(const upgrade_cache_t *cache, name_arena_t *arena, pkg_state_list_t *upgrade_list)
+{
+    for (uint32_t i = 0; i < cache->header->entry_count; i++)
+    {
+        const upgrade_cache_entry_t *entry = &cache->entries[i];
+        const int index = pkg_state_list_add(upgrade_list);
+        upgrade_list->names[index] = name_arena_intern_n(arena, &cache->strings[entry->name_offset], entry->name_size);
+        upgrade_list->new_versions[index] = name_arena_intern_n(arena, &cache->strings[entry->version_offset],
+                                                                entry->version_size);
+        upgrade_list->isizes[index] = entry->isize;
+        upgrade_list->download_sizes[index] = entry->download_size;
+        upgrade_list->ary[index].old_isize = entry->old_isize;
+        upgrade_list->repo_indices[index] = entry->repo_index;
+    }
+}
+
+// Returns the set of every package name in the cache, or NULL if there's no
+// cache (in which case nothing counts as new)
+name_set_t *upgrade_cache_names(const upgrade_cache_t *cache, name_arena_t *arena)
+{
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    name_set_t *previous_names = name_set_new(arena);
+    for (uint32_t i = 0; i < cache->header->entry_count; i++)
+    {
+        const upgrade_cache_entry_t *entry = &cache->entries[i];
+        name_set_add(previous_names, name_arena_intern_n(arena, &cache->strings[entry->name_offset], entry->name_size), 0);
+    }
+
+    return previous_names;
+}
+
+// Marks every package in upgrade_list which isn't in the cache as new, and
+// returns the number of them
+int upgrade_cache_mark_new(const upgrade_cache_t *cache, name_arena_t *arena, pkg_state_list_t *upgrade_list)
+{
+    name_set_t *previous_names = upgrade_cache_names(cache, arena);
+
+    int new_count = 0;
+    for (int i = 0; i < upgrade_list->size; i++)
+    {
+        pkg_state_t *state = &upgrade_list->ary[i];
+        state->is_new = previous_names != NULL && !name_set_has(previous_names, upgrade_list->names[i]);
+        new_count += state->is_new;
+    }
+
+    if (previous_names != NULL)
+    {
+        name_set_free(previous_names);
+    }
+
+    return new_count;
+}
+
+// Atomically replaces the cache at path with the contents of upgrade_list
+int upgrade_cache_write(const char *path, uint64_t key, const name_arena_t *arena, const pkg_state_list_t *upgrade_list)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    upgrade_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UPGRADE_CACHE_MAGIC, 8);
+    header.format_version = UPGRADE_CACHE_FORMAT_VERSION;
+    header.entry_count = upgrade_list->size;
+    header.key = key;
+    header.strings_size = 0;
+
+    upgrade_cache_entry_t *entries = calloc(upgrade_list->size + 1, sizeof(upgrade_cache_entry_t));
+    for (int i = 0; i < upgrade_list->size; i++)
+    {
+        entries[i].name_offset = header.strings_size;
+        entries[i].name_size = upgrade_list->names[i].size;
+        header.strings_size += upgrade_list->names[i].size;
+        entries[i].version_offset = header.strings_size;
+        entries[i].version_size = upgrade_list->new_versions[i].size;
+        header.strings_size += upgrade_list->new_versions[i].size;
+        entries[i].isize = upgrade_list->isizes[i];
+        entries[i].download_size = upgrade_list->download_sizes[i];
+        entries[i].old_isize = upgrade_list->ary[i].old_isize;
+        entries[i].repo_index = upgrade_list->repo_indices[i];
+    }
+
+    bool write_failed = fwrite(&header, sizeof(header), 1, file) != 1
+                        || fwrite(entries, sizeof(upgrade_cache_entry_t), upgrade_list->size, file) != (size_t)upgrade_list->size;
+
+    for (int i = 0; !write_failed && i < upgrade_list->size; i++)
+    {
+        const pkg_name_t name = upgrade_list->names[i];
+        const pkg_name_t new_version = upgrade_list->new_versions[i];
+        write_failed = fwrite(name_arena_str(arena, name), 1, name.size, file) != name.size
+                       || fwrite(name_arena_str(arena, new_version), 1, new_version.size, file) != new_version.size;
+    }
+
+    free(entries);
+
+    if (fclose(file) != 0 || write_failed || rename(tmp_path, path) == -1)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+void upgrade_cache_close(upgrade_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    munmap(cache->map, cache->map_size);
+    free(cache);
+}
+
+// Loader thread
+// Runs the same pipeline as an uncached startup (graph, closure, version
+// scan) for the background loading described above.
+
+void *upgrade_loader_run(void *arg)
+{
+    upgrade_loader_t *loader = arg;
+    trace_thread_id = TRACE_LOADER_THREAD_ID;
+
+    upgrade_loader_set_phase(loader, "Reading the local database");
+    double phase_start_ms = get_time_ms();
+    pthread_mutex_lock(&alpm_mutex);
+    loader->graph = pkg_graph_new(loader->localdb, loader->arena);
+    pthread_mutex_unlock(&alpm_mutex);
+    trace_record("build_graph", phase_start_ms, TRACE_LOADER_THREAD_ID);
+
+    upgrade_loader_set_phase(loader, "Resolving the keep list");
+    phase_start_ms = get_time_ms();
+    loader->closure = keep_closure_new(loader->graph);
+    keep_closure_add_names(loader->closure, loader->keep_names, NULL, NULL);
+    trace_record("dependency_closure", phase_start_ms, TRACE_LOADER_THREAD_ID);
+
+    if (!upgrade_loader_is_cancelled(loader))
+    {
+        upgrade_loader_set_phase(loader, "Comparing versions");
+        phase_start_ms = get_time_ms();
+        pkg_state_list_t *found = pkg_state_list_new(5);
+        find_upgrades(loader->handle, loader->graph, loader->arena, loader->closure->held, loader->dbs_sync,
+                      loader->thread_count, found, NULL, loader);
+        pkg_state_list_free(found);
+        trace_record("version_scan", phase_start_ms, TRACE_LOADER_THREAD_ID);
+    }
+
+    pthread_mutex_lock(&loader->mutex);
+    loader->is_finished = true;
+    pthread_mutex_unlock(&loader->mutex);
+
+    return NULL;
+}
+
+// Starts loading the upgrade list on a new thread. previous_names is owned by
+// the loader from then on. Returns NULL if the thread couldn't be started.
+upgrade_loader_t *upgrade_loader_start(alpm_handle_t *handle, alpm_db_t *localdb, alpm_list_t *dbs_sync, name_arena_t *arena, const pkg_name_list_t *keep_names, int thread_count, name_set_t *previous_names)
+{
+    upgrade_loader_t *loader = calloc(1, sizeof(upgrade_loader_t));
+    loader->handle = handle;
+    loader->localdb = localdb;
+    loader->dbs_sync = dbs_sync;
+    loader->arena = arena;
+    loader->keep_names = keep_names;
+    loader->thread_count = thread_count;
+    loader->previous_names = previous_names;
+    loader->pending = pkg_state_list_new(5);
+    loader->phase = "Starting";
+    pthread_mutex_init(&loader->mutex, NULL);
+
+    if (pthread_create(&loader->thread, NULL, upgrade_loader_run, loader) != 0)
+    {
+        pkg_state_list_free(loader->pending);
+        pthread_mutex_destroy(&loader->mutex);
+        free(loader);
+        return NULL;
+    }
+
+    return loader;
+}
+
+// Swaps the candidates found since the last call into *batch (which must be
+// empty), and fills in the loader's progress. Once this returns true, every
+// candidate has been handed over and upgrade_loader_join won't block.
+bool upgrade_loader_take(upgrade_loader_t *loader, pkg_state_list_t **batch, const char **phase, double *progress)
+{
+    pthread_mutex_lock(&loader->mutex);
+
+    pkg_state_list_t *pending = loader->pending;
+    loader->pending = *batch;
+    *batch = pending;
+    *phase = loader->phase;
+    *progress = loader->progress;
+    const bool is_finished = loader->is_finished;
+
+    pthread_mutex_unlock(&loader->mutex);
+
+    return is_finished;
+}
+
+// Waits for the loader thread to exit, first asking it to stop early if
+// is_cancelling is set. The caller takes over the graph and closure.
+void upgrade_loader_join(upgrade_loader_t *loader, bool is_cancelling)
+{
+    if (is_cancelling)
+    {
+        __atomic_store_n(&loader->is_cancelled, true, __ATOMIC_RELAXED);
+    }
+
+    pthread_join(loader->thread, NULL);
+}
+
+void upgrade_loader_free(upgrade_loader_t *loader)
+{
+    if (loader->previous_names != NULL)
+    {
+        name_set_free(loader->previous_names);
+    }
+
+    pkg_state_list_free(loader->pending);
+    pthread_mutex_destroy(&loader->mutex);
+    free(loader);
+}
+
+// Live refresh
+// While the terminal is open, the sync and local databases and the keep list
+// are watched with inotify, so that a pacman -Sy, an install or another lps
+// changing the keep list shows up without restarting. Events are only acted
+// on once they've stopped for WATCH_SETTLE_MS and pacman has released its
+// lock, so a transaction is picked up once, as a whole. Only what changed is
+// reloaded: a syncdb is registered again, while the local db needs a new
+// handle, since libalpm can't reload it in place. After a syncdb change, only
+// the packages which weren't found in an earlier syncdb, and so could have a
+// new version, are looked up again. A local db or keep list change moves the
+// installed versions or the keep closure, so every package is scanned again.
+// Either way, only the candidates which appeared, left or changed are merged
+// into the list, so the rest keep their place, selection and cached details.
+
+#define WATCH_SETTLE_MS 250
+#define WATCH_POLL_MS 250 // termbox can't wait on the inotify fd, so it's checked this often
+
+typedef enum _watch_change
+{
+    WATCH_SYNC = 1,
+    WATCH_LOCAL = 2,
+    WATCH_KEEP = 4,
+} watch_change_t;
+
+typedef struct _db_watcher
+{
+    int fd; // Non-blocking
+    int sync_wd;
+    int local_wd;
+    int keep_wd;
+    int changes; // The watch_change_t flags seen since they were last taken
+    pkg_name_list_t *changed_repos; // The syncdbs whose files changed
+    bool is_every_repo; // Set if events were dropped, so any syncdb may have changed
+    double last_event_ms;
+    char lock_path[PATH_MAX + 16]; // pacman's db.lck, which exists during a transaction
+} db_watcher_t;
+
+// Watches the syncdbs and local db under db_path and the keep list in
+// config_dir_path. Returns NULL if inotify isn't available.
+db_watcher_t *db_watcher_new(const char *db_path, const char *config_dir_path)
+{
+    const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    db_watcher_t *watcher = calloc(1, sizeof(db_watcher_t));
+    watcher->fd = fd;
+    watcher->changed_repos = pkg_name_list_new(5);
+    snprintf(watcher->lock_path, sizeof(watcher->lock_path), "%s/db.lck", db_path);
+
+    // Syncdbs are replaced by a rename when pacman downloads them, and local
+    // db entries are directories created and deleted by transactions
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/sync", db_path);
+    watcher->sync_wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+    snprintf(path, sizeof(path), "%s/local", db_path);
+    watcher->local_wd = inotify_add_watch(fd, path, IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
+    // Another process appends to its journal through a file it keeps open,
+    // which only shows up as modifications
+    watcher->keep_wd = inotify_add_watch(fd, config_dir_path, IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_DELETE);
+
+    return watcher;
+}
+
+// Reads every pending event, without blocking. The names of changed syncdbs
+// are interned in arena.
+void db_watcher_read(db_watcher_t *watcher, name_arena_t *arena)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t size;
+    while ((size = read(watcher->fd, buf, sizeof(buf))) > 0)
+    {
+        for (ssize_t offset = 0; offset < size;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)&buf[offset];
+            offset += sizeof(struct inotify_event) + event->len;
+
+            const size_t name_size = event->len > 0 ? strlen(event->name) : 0;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                watcher->changes |= WATCH_SYNC | WATCH_LOCAL | WATCH_KEEP;
+                watcher->is_every_repo = true;
+            }
+            else if (event->wd == watcher->sync_wd && name_size > 3 && strcmp(&event->name[name_size - 3], ".db") == 0)
+            {
+                watcher->changes |= WATCH_SYNC;
+                pkg_name_list_add(watcher->changed_repos, name_arena_intern_n(arena, event->name, name_size - 3));
+            }
+            else if (event->wd == watcher->local_wd)
+            {
+                watcher->changes |= WATCH_LOCAL;
+            }
+            else if (event->wd == watcher->keep_wd && strncmp(event->name, "keep_packages", 13) == 0)
+            {
+                watcher->changes |= WATCH_KEEP;
+            }
+            else
+            {
+                continue;
+            }
+
+            watcher->last_event_ms = get_time_ms();
+        }
+    }
+}
+
+// Returns the changes seen since the last call once they've settled and
+// pacman isn't mid-transaction, or 0 until then. *first_changed_repo is set
+// to the position in dbs_sync of the first syncdb which changed.
+int db_watcher_take(db_watcher_t *watcher, alpm_list_t *dbs_sync, const name_arena_t *arena, int *first_changed_repo)
+{
+    if (watcher->changes == 0 || get_time_ms() - watcher->last_event_ms < WATCH_SETTLE_MS
+        || access(watcher->lock_path, F_OK) == 0)
+    {
+        return 0;
+    }
+
+    *first_changed_repo = -1;
+    int repo_index = 0;
+    for (alpm_list_t *curr = dbs_sync; curr != NULL && *first_changed_repo < 0; curr = curr->next, repo_index++)
+    {
+        const char *repo = alpm_db_get_name((alpm_db_t *)curr->data);
+        for (int i = 0; i < watcher->changed_repos->size && !watcher->is_every_repo; i++)
+        {
+            if (strcmp(name_arena_str(arena, watcher->changed_repos->names[i]), repo) == 0)
+            {
+                *first_changed_repo = repo_index;
+            }
+        }
+
+        if (watcher->is_every_repo)
+        {
+            *first_changed_repo = repo_index;
+        }
+    }
+
+    // Repos which aren't in pacman.conf don't matter
+    int changes = watcher->changes;
+    if (*first_changed_repo < 0)
+    {
+        changes &= ~WATCH_SYNC;
+    }
+
+    watcher->changes = 0;
+    watcher->changed_repos->size = 0;
+    watcher->is_every_repo = false;
+    return changes;
+}
+
+void db_watcher_free(db_watcher_t *watcher)
+{
+    if (watcher == NULL)
+    {
+        return;
+    }
+
+    close(watcher->fd);
+    pkg_name_list_free(watcher->changed_repos);
+    free(watcher);
+}
+
+// Registers the syncdbs from position first_index on again, so that libalpm
+// reads them afresh the next time they're searched. The syncdbs after a
+// changed one are registered again too: a syncdb is always registered at the
+// end, and the order of dbs_sync decides which repo an upgrade comes from.
+void syncdbs_reload_from(alpm_handle_t *handle, int first_index)
+{
+    alpm_list_t *dbs_sync = alpm_get_syncdbs(handle);
+    const int db_count = alpm_list_count(dbs_sync);
+    alpm_db_t **dbs = malloc(sizeof(alpm_db_t *) * (db_count + 1));
+    char **names = malloc(sizeof(char *) * (db_count + 1));
+
+    int reload_count = 0;
+    int repo_index = 0;
+    for (alpm_list_t *curr = dbs_sync; curr != NULL; curr = curr->next, repo_index++)
+    {
+        if (repo_index >= first_index)
+        {
+            dbs[reload_count] = curr->data;
+            names[reload_count] = strdup(alpm_db_get_name(curr->data));
+            reload_count++;
+        }
+    }
+
+    for (int i = 0; i < reload_count; i++)
+    {
+        alpm_db_unregister(dbs[i]);
+    }
+
+    for (int i = 0; i < reload_count; i++)
+    {
+        if (alpm_register_syncdb(handle, names[i], 0) == NULL)
+        {
+            fprintf(stderr, "Warning: the %s syncdb failed to register\n", names[i]);
+        }
+        free(names[i]);
+    }
+
+    free(dbs);
+    free(names);
+}
+
+// Loads the databases which changes (watch_change_t flags) says changed
+// again. A local db change takes a new *handle, and frees *graph (if it isn't
+// NULL), whose packages belonged to the old one. Returns -1 if a new handle
+// couldn't be taken, leaving *handle and *graph as they were.
+int dbs_reload_changed(alpm_handle_t **handle, pkg_graph_t **graph, int changes, int first_changed_repo, const char *root_dir, const char *db_path, const pacman_config_t *pacman_config, const name_arena_t *arena)
+{
+    if (changes & WATCH_LOCAL)
+    {
+        // libalpm can't reload the local db in place, so it takes a new handle.
+        // The old one is only released once that works.
+        alpm_errno_t alpm_errno = 0;
+        alpm_handle_t *new_handle = alpm_initialize(root_dir, db_path, &alpm_errno);
+        if (new_handle == NULL)
+        {
+            return -1;
+        }
+        pacman_config_register(pacman_config, new_handle, arena);
+
+        if (*graph != NULL)
+        {
+            pkg_graph_free(*graph);
+            *graph = NULL;
+        }
+        alpm_release(*handle);
+        *handle = new_handle;
+    }
+    else if (changes & WATCH_SYNC)
+    {
+        syncdbs_reload_from(*handle, first_changed_repo);
+    }
+
+    return 0;
+}
+
+// Whether a and b hold the same names, in any order
+bool pkg_name_list_has_same_names(const pkg_name_list_t *a, const pkg_name_list_t *b, const name_arena_t *arena)
+{
+    if (a->size != b->size)
+    {
+        return false;
+    }
+
+    name_set_t *names = name_set_new(arena);
+    for (int i = 0; i < a->size; i++)
+    {
+        name_set_add(names, a->names[i], i);
+    }
+
+    bool is_same = true;
+    for (int i = 0; i < b->size && is_same; i++)
+    {
+        is_same = name_set_get(names, b->names[i]) >= 0;
+    }
+
+    name_set_free(names);
+    return is_same;
+}
+
+typedef struct _list_diff
+{
+    int added_count;
+    int removed_count;
+    int changed_count; // Still candidates, but with a different version or size
+} list_diff_t;
+
+// Brings list (sorted by mode) up to date with fresh, the candidates found by
+// a new scan, touching only the packages which differ. Packages keep their
+// selection, and *tracked_index (if it isn't NULL) keeps indexing the same
+// package, or the nearest one left if it was removed. Additions count as new,
+// and they and changed packages are marked if they're in pkg_cache (if it
+// isn't NULL).
+list_diff_t pkg_state_list_apply(pkg_state_list_t *list, const pkg_state_list_t *fresh, const name_arena_t *arena, sort_mode_t mode, const pkg_cache_index_t *pkg_cache, int *tracked_index)
+{
+    list_diff_t diff = {0, 0, 0};
+
+    name_set_t *fresh_ids = name_set_new(arena);
+    for (int i = 0; i < fresh->size; i++)
+    {
+        name_set_add(fresh_ids, fresh->names[i], i);
+    }
+
+    bool *is_matched = calloc(fresh->size + 1, sizeof(bool));
+    bitset_t *removed = bitset_new(list->size);
+    for (int i = 0; i < list->size; i++)
+    {
+        const int fresh_index = name_set_get(fresh_ids, list->names[i]);
+        if (fresh_index < 0)
+        {
+            bitset_set(removed, i);
+            diff.removed_count++;
+            continue;
+        }
+
+        is_matched[fresh_index] = true;
+        pkg_state_t *state = &list->ary[i];
+        const pkg_state_t *fresh_state = &fresh->ary[fresh_index];
+
+        // The package found before may have been freed along with its syncdb
+        state->underlying_pkg = fresh_state->underlying_pkg;
+        state->has_details = fresh_state->has_details;
+        state->desc = fresh_state->desc;
+
+        // Interned names are equal exactly when their offsets are
+        if (list->new_versions[i].offset != fresh->new_versions[fresh_index].offset
+            || list->isizes[i] != fresh->isizes[fresh_index]
+            || list->download_sizes[i] != fresh->download_sizes[fresh_index]
+            || state->old_isize != fresh_state->old_isize || list->repo_indices[i] != fresh->repo_indices[fresh_index]
+            || state->old_version.offset != fresh_state->old_version.offset)
+        {
+            list->new_versions[i] = fresh->new_versions[fresh_index];
+            list->isizes[i] = fresh->isizes[fresh_index];
+            list->download_sizes[i] = fresh->download_sizes[fresh_index];
+            state->old_isize = fresh_state->old_isize;
+            list->repo_indices[i] = fresh->repo_indices[fresh_index];
+            state->old_version = fresh_state->old_version;
+            diff.changed_count++;
+        }
+    }
+
+    if (diff.removed_count > 0)
+    {
+        const int cursor_index = tracked_index != NULL ? *tracked_index : -1;
+        const int new_cursor_index = pkg_state_list_remove_marked(list, removed, cursor_index);
+        if (cursor_index >= 0)
+        {
+            *tracked_index = new_cursor_index;
+        }
+    }
+
+    // A new version can move a package (e.g. by its size), and may already
+    // have been downloaded
+    if (diff.changed_count > 0)
+    {
+        if (pkg_cache != NULL)
+        {
+            pkg_cache_mark(pkg_cache, arena, list, 1);
+        }
+        pkg_state_list_sort(list, mode, arena, tracked_index);
+    }
+
+    pkg_state_list_t *additions = pkg_state_list_new(5);
+    for (int i = 0; i < fresh->size; i++)
+    {
+        if (!is_matched[i])
+        {
+            const int index = pkg_state_list_add(additions);
+            pkg_state_list_copy(additions, index, fresh, i);
+            pkg_state_list_set_selected(additions, index, false);
+            additions->ary[index].is_new = true;
+        }
+    }
+    diff.added_count = additions->size;
+
+    if (pkg_cache != NULL)
+    {
+        pkg_cache_mark(pkg_cache, arena, additions, 1);
+    }
+    pkg_state_list_sort(additions, mode, arena, NULL);
+    pkg_state_list_merge_sorted(list, additions, arena, tracked_index);
+
+    pkg_state_list_free(additions);
+    bitset_free(removed);
+    free(is_matched);
+    name_set_free(fresh_ids);
+    return diff;
+}
+
+// Daemon
+// With --daemon, lps computes the upgrade list, keeps it (along with the graph
+// and the keep closure) in memory, and answers queries on a Unix socket until
+// it's sent shutdown, SIGINT or SIGTERM. The databases and the keep list are
+// watched as in the terminal's live refresh, and the list is brought up to
+// date (under the lock, between requests) once a change has settled. With --attach, the
+// terminal and --output take the list from a running daemon instead of
+// computing it, and keep list changes are made through the daemon, which owns
+// the keep list while it runs.
+//
+// An attached terminal is a thin client: the list's tsv rows carry what the
+// details pane, the '/' filter and the columns show, and the keep and why
+// panes are filled in by requests, so it never parses a database. Its handle
+// only registers the syncdbs, for the repo names. It polls the generation, and
+// fetches the list again once the daemon has changed it.
+//
+// Requests are single lines. Each response is any number of lines followed by
+// ".ok" or ".error: MESSAGE" (no package name starts with a '.'):
+//   list [names|ndjson|tsv] [MODE]  the upgrade list, sorted by MODE (see
+//                                   --sort) if given; tsv is name, new
+//                                   version, isize, download size, old isize,
+//                                   repo index, is_new, installed version and
+//                                   description, tab-separated
+//   keeps [names|tsv]               the keep list, as stored; tsv adds the
+//                                   number of packages only kept for each
+//                                   entry, or -1 if it isn't installed
+//   why NAME [tsv]                  the chain from a keep root down to NAME;
+//                                   tsv adds whether each is in the keep list
+//                                   and the names that require it (space
+//                                   separated), and a package that isn't held
+//                                   is its own chain instead of an error
+//   generation                      a number that changes whenever the list
+//                                   or the keep list does
+//   keep ENTRY                      adds a name or pattern to the keep list,
+//                                   replying with the candidates it held back
+//   unkeep ENTRY                    drops an entry from the keep list,
+//                                   replying with the candidates it released
+//   shutdown                        stops the daemon
+// Each client is served on its own thread, but requests are applied one at a
+// time, and the response is only written once the lock is released, so a slow
+// client can't hold up the others.
+
+#define DAEMON_POLL_TIMEOUT_MS 500
+
+typedef struct _daemon_state
+{
+    pthread_mutex_t lock; // Held while a request is applied
+    alpm_handle_t *handle;
+    alpm_db_t *localdb;
+    alpm_list_t *dbs_sync;
+    name_arena_t *arena;
+    pkg_graph_t *graph;
+    keep_closure_t *closure;
+    pkg_state_list_t *upgrade_list;
+    pkg_cache_index_t *pkg_cache;
+    sort_mode_t sort_mode; // The mode upgrade_list is sorted by
+    keep_store_t *keep_store;
+    pkg_name_list_t *keep_names; // As stored
+    pkg_name_list_t *keep_roots; // With the patterns expanded
+    bool is_keep_save_failed;
+    unsigned long generation; // Bumped whenever the list or the keep list changes
+    bool is_stopping; // Set by a shutdown request, read by the accepting thread
+    int listen_fd;
+
+    // Only used by the accepting thread
+    struct _daemon_client **clients; // Those whose threads haven't been joined yet
+    int client_count;
+    int client_capacity;
+    db_watcher_t *watcher; // NULL if inotify isn't available, for refreshing
+    const char *root_dir;
+    const char *db_path;
+    const pacman_config_t *pacman_config;
+    int thread_count;
+} daemon_state_t;
+
+typedef struct _daemon_client
+{
+    daemon_state_t *state;
+    int fd; // Closed by the accepting thread, once the client's thread is joined
+    pthread_t thread;
+    bool is_done; // Set atomically by the client's thread as it exits
+} daemon_client_t;
+
+volatile sig_atomic_t daemon_signal_count = 0;
+
+void daemon_handle_signal(int signal_number)
+{
+    (void)signal_number;
+    daemon_signal_count++;
+}
+
+// Writes all size bytes at buf to fd. Returns -1 if it can't.
+int write_all(int fd, const char *buf, size_t size)
+{
+    size_t written = 0;
+    while (written < size)
+    {
+        const ssize_t write_size = write(fd, buf + written, size - written);
+        if (write_size == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (write_size <= 0)
+        {
+            return -1;
+        }
+        written += write_size;
+    }
+
+    return 0;
+}
+
+// Fills address with the Unix socket address for path. Returns false if path
+// is too long for one.
+bool unix_socket_address(struct sockaddr_un *address, const char *path)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+// Returns a socket connected to the daemon at path, or -1
+int unix_socket_connect(const char *path)
+{
+    struct sockaddr_un address;
+    if (!unix_socket_address(&address, path))
+    {
+        return -1;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Listens on a Unix socket at path, replacing a socket file left behind by a
+// daemon that's no longer running. Returns -1 (with errno set) if it can't,
+// e.g. with EADDRINUSE if another daemon is listening there.
+int daemon_listen(const char *path)
+{
+    struct sockaddr_un address;
+    if (!unix_socket_address(&address, path))
+    {
+        return -1;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    int bind_err = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    if (bind_err == -1 && errno == EADDRINUSE)
+    {
+        const int probe_fd = unix_socket_connect(path);
+        if (probe_fd >= 0)
+        {
+            close(probe_fd);
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+
+        // Nothing answered, so the file is stale
+        unlink(path);
+        bind_err = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    }
+
+    if (bind_err == -1 || listen(fd, 16) == -1)
+    {
+        const int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+// Writes the package at index in list as one line of the list command's tsv
+// format. The description's tabs and line breaks are written as spaces.
+void write_pkg_state_tsv(FILE *file, pkg_state_list_t *list, int index, const name_arena_t *arena, alpm_db_t *localdb, alpm_list_t *dbs_sync)
+{
+    const char *name = name_arena_str(arena, list->names[index]);
+    alpm_pkg_t *local_pkg = alpm_db_get_pkg(localdb, name);
+    fprintf(file, "%s\t%s\t%lld\t%lld\t%lld\t%d\t%d\t%s\t", name, name_arena_str(arena, list->new_versions[index]),
+            (long long)list->isizes[index], (long long)list->download_sizes[index],
+            (long long)list->ary[index].old_isize, list->repo_indices[index], list->ary[index].is_new,
+            local_pkg != NULL ? alpm_pkg_get_version(local_pkg) : "");
+
+    for (const char *desc = pkg_state_get_desc(list, index, arena, dbs_sync); *desc != '\0'; desc++)
+    {
+        fputc(*desc == '\t' || *desc == '\n' || *desc == '\r' ? ' ' : *desc, file);
+    }
+    fputc('\n', file);
+}
+
+// Appends the package on a line of the list command's tsv format to list,
+// along with its installed version and description (if the line has them).
+// Returns false if the line is malformed.
+bool pkg_state_list_add_tsv(pkg_state_list_t *list, name_arena_t *arena, char *line)
+{
+    // strsep, unlike strtok_r, keeps empty fields, such as a missing description
+    char *fields[9];
+    int field_count = 0;
+    for (char *field = strsep(&line, "\t"); field != NULL && field_count < 9; field = strsep(&line, "\t"))
+    {
+        fields[field_count++] = field;
+    }
+
+    if (field_count < 7)
+    {
+        return false;
+    }
+
+    const int index = pkg_state_list_add(list);
+    list->names[index] = name_arena_intern(arena, fields[0]);
+    list->new_versions[index] = name_arena_intern(arena, fields[1]);
+    list->isizes[index] = strtoll(fields[2], NULL, 10);
+    list->download_sizes[index] = strtoll(fields[3], NULL, 10);
+    list->ary[index].old_isize = strtoll(fields[4], NULL, 10);
+    list->repo_indices[index] = atoi(fields[5]);
+    list->ary[index].is_new = atoi(fields[6]) != 0;
+    if (field_count == 9)
+    {
+        list->ary[index].has_details = true;
+        list->ary[index].old_version = name_arena_intern(arena, fields[7]);
+        list->ary[index].desc = name_arena_intern(arena, fields[8]);
+    }
+    return true;
+}
+
+// Returns the index of the keep list entry called entry, or -1. entry isn't
+// interned, so that requests which are turned down don't grow the arena.
+int daemon_find_keep_entry(const daemon_state_t *state, const char *entry)
+{
+    for (int i = 0; i < state->keep_names->size; i++)
+    {
+        if (strcmp(name_arena_str(state->arena, state->keep_names->names[i]), entry) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Applies request (one line, without its newline) to state, writing the
+// response to out. The caller holds state->lock.
+void daemon_handle_request(daemon_state_t *state, char *request, FILE *out)
+{
+    char *argument = strchr(request, ' ');
+    if (argument != NULL)
+    {
+        *argument++ = '\0';
+        argument += strspn(argument, " ");
+    }
+    const bool has_argument = argument != NULL && argument[0] != '\0';
+
+    const char *error = NULL;
+    if (strcmp(request, "list") == 0)
+    {
+        char *save = NULL;
+        const char *format = has_argument ? strtok_r(argument, " ", &save) : "names";
+        const char *mode_name = has_argument ? strtok_r(NULL, " ", &save) : NULL;
+
+        sort_mode_t mode = state->sort_mode;
+        if (mode_name != NULL)
+        {
+            mode = SORT_MODE_COUNT;
+            for (int i = 0; i < SORT_MODE_COUNT; i++)
+            {
+                if (strcmp(mode_name, sort_mode_names[i]) == 0)
+                {
+                    mode = i;
+                }
+            }
+        }
+
+        if (mode == SORT_MODE_COUNT)
+        {
+            error = "the sort mode must be isize, dsize, delta, name or repo";
+        }
+        else if (strcmp(format, "names") != 0 && strcmp(format, "ndjson") != 0 && strcmp(format, "tsv") != 0)
+        {
+            error = "the format must be names, ndjson or tsv";
+        }
+        else
+        {
+            // Another mode only orders this response, since the list (and its
+            // mode) are shared with every other client
+            sort_entry_t *order = mode != state->sort_mode
+                                      ? pkg_state_list_order(state->upgrade_list, mode, state->arena)
+                                      : NULL;
+
+            upgrade_printer_t printer = {strcmp(format, "ndjson") == 0 ? OUTPUT_NDJSON : OUTPUT_NAMES, out,
+                                         state->localdb, state->dbs_sync, state->arena, 0};
+            for (int i = 0; i < state->upgrade_list->size; i++)
+            {
+                const int index = order != NULL ? order[i].index : i;
+                if (strcmp(format, "tsv") == 0)
+                {
+                    write_pkg_state_tsv(out, state->upgrade_list, index, state->arena, state->localdb,
+                                        state->dbs_sync);
+                }
+                else
+                {
+                    upgrade_printer_print(&printer, state->upgrade_list, index);
+                }
+            }
+            free(order);
+        }
+    }
+    else if (strcmp(request, "keeps") == 0)
+    {
+        const bool is_tsv = has_argument && strcmp(argument, "tsv") == 0;
+        if (has_argument && !is_tsv && strcmp(argument, "names") != 0)
+        {
+            error = "the format must be names or tsv";
+        }
+
+        for (int i = 0; error == NULL && i < state->keep_names->size; i++)
+        {
+            const pkg_name_t name = state->keep_names->names[i];
+            if (is_tsv)
+            {
+                const int id = pkg_graph_find(state->graph, name);
+                fprintf(out, "%s\t%d\n", name_arena_str(state->arena, name),
+                        id >= 0 ? keep_closure_release_count(state->closure, id) : -1);
+            }
+            else
+            {
+                fprintf(out, "%s\n", name_arena_str(state->arena, name));
+            }
+        }
+    }
+    else if (strcmp(request, "why") == 0)
+    {
+        char *format = has_argument ? strchr(argument, ' ') : NULL;
+        if (format != NULL)
+        {
+            *format++ = '\0';
+        }
+        const bool is_tsv = format != NULL && strcmp(format, "tsv") == 0;
+        const int id = has_argument ? name_set_get_id_cstr(state->graph->ids, argument) : -1;
+
+        if (!has_argument)
+        {
+            error = "expected a package name";
+        }
+        else if (format != NULL && !is_tsv)
+        {
+            error = "the format must be tsv";
+        }
+        else if (id < 0)
+        {
+            error = "not installed";
+        }
+        else if (is_tsv)
+        {
+            why_path_t *path = why_path_new();
+            why_path_fill(path, state->closure, id);
+            for (int i = 0; i < path->names->size; i++)
+            {
+                fprintf(out, "%s\t%d\t", name_arena_str(state->arena, path->names->names[i]), path->is_kept[i]);
+                for (int rdep = path->required_by_offsets[i]; rdep < path->required_by_offsets[i + 1]; rdep++)
+                {
+                    fprintf(out, rdep > path->required_by_offsets[i] ? " %s" : "%s",
+                            name_arena_str(state->arena, path->required_by->names[rdep]));
+                }
+                fprintf(out, "\n");
+            }
+            why_path_free(path);
+        }
+        else if (!bitset_test(state->closure->held, id))
+        {
+            error = "not held by the keep list";
+        }
+        else
+        {
+            int *path = malloc(sizeof(int) * (state->graph->size + 1));
+            const int path_size = keep_closure_path(state->closure, id, path);
+            for (int i = 0; i < path_size; i++)
+            {
+                fprintf(out, "%s\n", name_arena_str(state->arena, state->graph->names[path[i]]));
+            }
+            free(path);
+        }
+    }
+    else if (strcmp(request, "keep") == 0 || strcmp(request, "unkeep") == 0)
+    {
+        const bool is_added = strcmp(request, "keep") == 0;
+        pkg_matcher_t *matcher = has_argument && pkg_matcher_is_pattern(argument)
+                                     ? pkg_matcher_new(argument, state->dbs_sync)
+                                     : NULL;
+        const int entry_index = has_argument ? daemon_find_keep_entry(state, argument) : -1;
+
+        if (!has_argument)
+        {
+            error = "expected a package name or pattern";
+        }
+        else if (is_added && pkg_matcher_is_pattern(argument) && matcher == NULL)
+        {
+            error = "not a valid pattern";
+        }
+        else if (is_added && entry_index >= 0)
+        {
+            error = "already in the keep list";
+        }
+        else if (!is_added && entry_index < 0)
+        {
+            error = "not in the keep list";
+        }
+        else if (is_added)
+        {
+            const pkg_name_t entry = name_arena_intern(state->arena, argument);
+            keep_list_add(state->keep_names, state->keep_roots, entry, state->closure, state->localdb,
+                          state->dbs_sync, state->arena);
+            state->is_keep_save_failed |= keep_store_record(state->keep_store, true, entry, state->arena) == -1;
+
+            for (int i = 0; i < state->upgrade_list->size; i++)
+            {
+                const int id = pkg_graph_find(state->graph, state->upgrade_list->names[i]);
+                if (id >= 0 && bitset_test(state->closure->held, id))
+                {
+                    fprintf(out, "%s\n", name_arena_str(state->arena, state->upgrade_list->names[i]));
+                }
+            }
+            pkg_state_list_remove_held(state->upgrade_list, state->graph, state->closure->held, 0);
+            state->generation++;
+        }
+        else
+        {
+            const pkg_name_t entry = state->keep_names->names[entry_index];
+            int *released_ids = malloc(sizeof(int) * (state->graph->size + 1));
+            const int released_count = keep_list_drop(state->keep_names, state->keep_roots, entry_index,
+                                                      state->closure, state->dbs_sync, state->arena, released_ids);
+            state->is_keep_save_failed |= keep_store_record(state->keep_store, false, entry, state->arena) == -1;
+
+            upgrade_printer_t printer = {OUTPUT_NAMES, out, state->localdb, state->dbs_sync, state->arena, 0};
+            add_upgrades_of(state->handle, state->graph, state->arena, released_ids, released_count, state->dbs_sync,
+                            state->pkg_cache, state->sort_mode, state->upgrade_list, NULL, &printer);
+            free(released_ids);
+            state->generation++;
+        }
+
+        if (matcher != NULL)
+        {
+            pkg_matcher_free(matcher);
+        }
+    }
+    else if (strcmp(request, "generation") == 0)
+    {
+        fprintf(out, "%lu\n", state->generation);
+    }
+    else if (strcmp(request, "shutdown") == 0)
+    {
+        __atomic_store_n(&state->is_stopping, true, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        error = "unknown command";
+    }
+
+    if (error != NULL)
+    {
+        fprintf(out, ".error: %s\n", error);
+    }
+    else
+    {
+        fprintf(out, ".ok\n");
+    }
+}
+
+void *daemon_client_run(void *_client)
+{
+    daemon_client_t *client = _client;
+    daemon_state_t *state = client->state;
+    // A copy of the fd, since client->fd has to stay open until the thread is
+    // joined, for daemon_clients_join to shut it down
+    const int requests_fd = dup(client->fd);
+    FILE *requests = requests_fd != -1 ? fdopen(requests_fd, "r") : NULL;
+
+    char *request = NULL;
+    size_t request_capacity = 0;
+    while (requests != NULL && getline(&request, &request_capacity, requests) != -1)
+    {
+        request[strcspn(request, "\r\n")] = '\0';
+
+        char *response = NULL;
+        size_t response_size = 0;
+        FILE *out = open_memstream(&response, &response_size);
+
+        pthread_mutex_lock(&state->lock);
+        daemon_handle_request(state, request, out);
+        pthread_mutex_unlock(&state->lock);
+
+        fclose(out);
+        const int write_err = write_all(client->fd, response, response_size);
+        free(response);
+        if (write_err == -1)
+        {
+            break;
+        }
+    }
+
+    free(request);
+    if (requests != NULL)
+    {
+        fclose(requests);
+    }
+    else if (requests_fd != -1)
+    {
+        close(requests_fd);
+    }
+    __atomic_store_n(&client->is_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Joins the threads of the clients that have disconnected, or of every client
+// if is_every_client is set, after shutting their sockets down so that they
+// stop at their next read or write. Only called by the accepting thread.
+void daemon_clients_join(daemon_state_t *state, bool is_every_client)
+{
+    int kept_count = 0;
+    for (int i = 0; i < state->client_count; i++)
+    {
+        daemon_client_t *client = state->clients[i];
+        if (!is_every_client && !__atomic_load_n(&client->is_done, __ATOMIC_ACQUIRE))
+        {
+            state->clients[kept_count++] = client;
+            continue;
+        }
+
+        // A request that's already being applied is answered first
+        shutdown(client->fd, SHUT_RDWR);
+        pthread_join(client->thread, NULL);
+        close(client->fd);
+        free(client);
+    }
+    state->client_count = kept_count;
+}
+
+// Brings the upgrade list up to date with the databases and the keep list,
+// where changes (watch_change_t flags) says which changed. The caller holds
+// state->lock. If the databases can't be loaded again, the list is left as it
+// is until the next change.
+void daemon_refresh(daemon_state_t *state, int changes, int first_changed_repo)
+{
+    bool is_list_stale = (changes & (WATCH_SYNC | WATCH_LOCAL)) != 0;
+    bool is_keep_changed = false;
+
+    // Another lps that isn't attached may have changed the keep list, while
+    // the daemon's own changes leave it as it is
+    if (changes & WATCH_KEEP)
+    {
+        pkg_name_list_t *stored_names = pkg_name_list_new(state->keep_names->size + 1);
+        if (keep_store_reload(state->keep_store, state->arena, stored_names) == -1)
+        {
+            perror("Failed to read the keep list again");
+        }
+        else if (!pkg_name_list_has_same_names(stored_names, state->keep_names, state->arena))
+        {
+            state->keep_names->size = 0;
+            for (int i = 0; i < stored_names->size; i++)
+            {
+                pkg_name_list_add(state->keep_names, stored_names->names[i]);
+            }
+            is_list_stale = true;
+            is_keep_changed = true;
+        }
+        pkg_name_list_free(stored_names);
+    }
+
+    if (!is_list_stale)
+    {
+        return;
+    }
+
+    const double start_ms = get_time_ms();
+    if (dbs_reload_changed(&state->handle, &state->graph, changes, first_changed_repo, state->root_dir,
+                           state->db_path, state->pacman_config, state->arena) == -1)
+    {
+        fprintf(stderr, "Failed to load the databases again, so the list wasn't refreshed\n");
+        return;
+    }
+    state->localdb = alpm_get_localdb(state->handle);
+    state->dbs_sync = alpm_get_syncdbs(state->handle);
+
+    // As in the terminal, a change to the syncdbs alone only looks up the
+    // packages it can affect
+    const bool is_closure_kept = !(changes & WATCH_LOCAL) && !is_keep_changed
+                                 && !keep_names_match_repos(state->keep_names, state->arena);
+    if (!is_closure_kept)
+    {
+        // Patterns in the keep list match installed packages, and their repos
+        keep_closure_free(state->closure);
+        state->closure = NULL;
+        state->keep_roots->size = 0;
+        keep_roots_expand(state->keep_roots, state->keep_names, state->localdb, state->dbs_sync, state->arena);
+        ensure_keep_closure(&state->graph, &state->closure, state->localdb, state->arena, state->keep_roots);
+    }
+
+    pkg_state_list_t *fresh = pkg_state_list_new(state->upgrade_list->size + 1);
+    if (is_closure_kept)
+    {
+        find_upgrades_in_repos(state->handle, state->graph, state->arena, state->closure->held, state->dbs_sync,
+                               first_changed_repo, state->upgrade_list, fresh);
+    }
+    else
+    {
+        find_upgrades(state->handle, state->graph, state->arena, state->closure->held, state->dbs_sync,
+                      state->thread_count, fresh, NULL, NULL);
+    }
+    const list_diff_t diff = pkg_state_list_apply(state->upgrade_list, fresh, state->arena, state->sort_mode, NULL,
+                                                  NULL);
+    pkg_state_list_free(fresh);
+
+    // An upgrade usually downloads archives too, so every package is marked again
+    if (state->pkg_cache != NULL)
+    {
+        pkg_cache_index_read(state->pkg_cache);
+        pkg_cache_mark(state->pkg_cache, state->arena, state->upgrade_list, state->thread_count);
+        if (state->sort_mode == SORT_DOWNLOAD_SIZE)
+        {
+            pkg_state_list_sort(state->upgrade_list, state->sort_mode, state->arena, NULL);
+        }
+    }
+    trace_record("live_refresh", start_ms, 0);
+    state->generation++;
+
+    fprintf(stderr, "Refreshed: %d new, %d gone, %d changed\n", diff.added_count, diff.removed_count,
+            diff.changed_count);
+}
+
+// Accepts clients until a shutdown request, SIGINT or SIGTERM. Clients which
+// are still connected are disconnected, and their threads joined, before it
+// returns, so that the state can be freed. Returns -1 if the socket couldn't
+// be polled.
+int daemon_serve(daemon_state_t *state)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = daemon_handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int err_return = 0;
+    while (!__atomic_load_n(&state->is_stopping, __ATOMIC_RELAXED) && daemon_signal_count == 0)
+    {
+        // Polled with a timeout, so that a shutdown is noticed without another
+        // client connecting, and settled database changes without another event
+        struct pollfd polls[2] = {
+            {state->listen_fd, POLLIN, 0},
+            {state->watcher != NULL ? state->watcher->fd : -1, POLLIN, 0},
+        };
+        const int ready_count = poll(polls, 2, state->watcher != NULL ? WATCH_POLL_MS : DAEMON_POLL_TIMEOUT_MS);
+        if (ready_count == -1 && errno != EINTR)
+        {
+            err_return = -1;
+            break;
+        }
+
+        if (state->watcher != NULL)
+        {
+            pthread_mutex_lock(&state->lock);
+            db_watcher_read(state->watcher, state->arena);
+            int first_changed_repo = -1;
+            const int changes = db_watcher_take(state->watcher, state->dbs_sync, state->arena, &first_changed_repo);
+            if (changes != 0)
+            {
+                daemon_refresh(state, changes, first_changed_repo);
+            }
+            pthread_mutex_unlock(&state->lock);
+        }
+
+        if (ready_count <= 0 || !(polls[0].revents & POLLIN))
+        {
+            continue;
+        }
+
+        const int client_fd = accept4(state->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            continue;
+        }
+
+        daemon_clients_join(state, false);
+
+        daemon_client_t *client = malloc(sizeof(daemon_client_t));
+        client->state = state;
+        client->fd = client_fd;
+        client->is_done = false;
+        if (pthread_create(&client->thread, NULL, daemon_client_run, client) != 0)
+        {
+            close(client_fd);
+            free(client);
+            continue;
+        }
+
+        if (state->client_count == state->client_capacity)
+        {
+            state->client_capacity = state->client_capacity * 2 + 4;
+            state->clients = realloc(state->clients, sizeof(daemon_client_t *) * state->client_capacity);
+        }
+        state->clients[state->client_count++] = client;
+    }
+
+    daemon_clients_join(state, true);
+    free(state->clients);
+    state->clients = NULL;
+    return err_return;
+}
+
+/// Client
+
+typedef struct _daemon_conn
+{
+    int fd;
+    FILE *responses;
+} daemon_conn_t;
+
+// Connects to the daemon listening at socket_path. Returns NULL if none is.
+daemon_conn_t *daemon_conn_open(const char *socket_path)
+{
+    const int fd = unix_socket_connect(socket_path);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    daemon_conn_t *conn = malloc(sizeof(daemon_conn_t));
+    conn->fd = fd;
+    conn->responses = fdopen(dup(fd), "r");
+    if (conn->responses == NULL)
+    {
+        close(fd);
+        free(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+// Sends request, calling on_line (unless it's NULL) on each line of the
+// response. Returns 0 if the daemon answered .ok. Otherwise, copies its error
+// (or what went wrong with the connection) into error and returns -1.
+int daemon_conn_request(daemon_conn_t *conn, const char *request, void (*on_line)(char *line, void *context), void *context, char *error, size_t error_capacity)
+{
+    // A request is always a single line
+    if (strchr(request, '\n') != NULL)
+    {
+        snprintf(error, error_capacity, "requests can't contain newlines");
+        return -1;
+    }
+
+    if (write_all(conn->fd, request, strlen(request)) == -1 || write_all(conn->fd, "\n", 1) == -1)
+    {
+        snprintf(error, error_capacity, "%s", strerror(errno));
+        return -1;
+    }
+
+    int err_return = -1;
+    snprintf(error, error_capacity, "the daemon closed the connection");
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, conn->responses) != -1)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line, ".ok") == 0)
+        {
+            err_return = 0;
+            break;
+        }
+        if (strncmp(line, ".error: ", 8) == 0)
+        {
+            snprintf(error, error_capacity, "%s", line + 8);
+            break;
+        }
+
+        if (on_line != NULL)
+        {
+            on_line(line, context);
+        }
+    }
+
+    free(line);
+    return err_return;
+}
+
+void daemon_conn_close(daemon_conn_t *conn)
+{
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    fclose(conn->responses);
+    close(conn->fd);
+    free(conn);
+}
+
+typedef struct _tsv_list_context
+{
+    pkg_state_list_t *list;
+    name_arena_t *arena;
+} tsv_list_context_t;
+
+void on_tsv_line(char *line, void *_context)
+{
+    tsv_list_context_t *context = _context;
+    pkg_state_list_add_tsv(context->list, context->arena, line);
+}
+
+void on_output_line(char *line, void *_count)
+{
+    printf("%s\n", line);
+    (*(int *)_count)++;
+}
+
+void on_generation_line(char *line, void *_generation)
+{
+    *(unsigned long *)_generation = strtoul(line, NULL, 10);
+}
+
+// Fetches the daemon's upgrade list into list, which should be empty
+int daemon_conn_fetch_list(daemon_conn_t *conn, pkg_state_list_t *list, name_arena_t *arena, char *error, size_t error_capacity)
+{
+    tsv_list_context_t context = {list, arena};
+    return daemon_conn_request(conn, "list tsv", on_tsv_line, &context, error, error_capacity);
+}
+
+typedef struct _keeps_context
+{
+    pkg_name_list_t *names;
+    int *release_counts;
+    int capacity; // Of release_counts
+    name_arena_t *arena;
+} keeps_context_t;
+
+void on_keeps_line(char *line, void *_context)
+{
+    keeps_context_t *context = _context;
+    char *count = strchr(line, '\t');
+    if (count == NULL)
+    {
+        return;
+    }
+    *count++ = '\0';
+
+    if (context->names->size >= context->capacity)
+    {
+        context->capacity *= 2;
+        context->release_counts = realloc(context->release_counts, sizeof(int) * context->capacity);
+    }
+    context->release_counts[context->names->size] = atoi(count);
+    pkg_name_list_add(context->names, name_arena_intern(context->arena, line));
+}
+
+// Fetches the daemon's keep list, along with the number of packages only kept
+// for each entry (-1 if it isn't installed) into *release_counts, which the
+// caller frees. Returns NULL if the request failed.
+pkg_name_list_t *daemon_conn_fetch_keeps(daemon_conn_t *conn, int **release_counts, name_arena_t *arena, char *error, size_t error_capacity)
+{
+    keeps_context_t context = {pkg_name_list_new(8), malloc(sizeof(int) * 8), 8, arena};
+    if (daemon_conn_request(conn, "keeps tsv", on_keeps_line, &context, error, error_capacity) == -1)
+    {
+        pkg_name_list_free(context.names);
+        free(context.release_counts);
+        return NULL;
+    }
+
+    *release_counts = context.release_counts;
+    return context.names;
+}
+
+typedef struct _name_list_context
+{
+    pkg_name_list_t *names;
+    name_arena_t *arena;
+} name_list_context_t;
+
+void on_name_line(char *line, void *_context)
+{
+    name_list_context_t *context = _context;
+    pkg_name_list_add(context->names, name_arena_intern(context->arena, line));
+}
+
+// Adds entry to the daemon's keep list (or drops it, unless is_added),
+// appending the candidates it held back (or released) to names
+int daemon_conn_keep_change(daemon_conn_t *conn, bool is_added, const char *entry, pkg_name_list_t *names, name_arena_t *arena, char *error, size_t error_capacity)
+{
+    char *request = malloc(strlen(entry) + 16);
+    sprintf(request, "%s %s", is_added ? "keep" : "unkeep", entry);
+    name_list_context_t context = {names, arena};
+    const int err = daemon_conn_request(conn, request, on_name_line, &context, error, error_capacity);
+    free(request);
+    return err;
+}
+
+typedef struct _why_context
+{
+    why_path_t *path;
+    name_arena_t *arena;
+} why_context_t;
+
+void on_why_line(char *line, void *_context)
+{
+    why_context_t *context = _context;
+    char *name = strsep(&line, "\t");
+    char *is_kept = strsep(&line, "\t");
+    if (is_kept == NULL)
+    {
+        return;
+    }
+
+    why_path_add(context->path, name_arena_intern(context->arena, name), strcmp(is_kept, "1") == 0);
+    for (char *required_by = strsep(&line, " "); required_by != NULL; required_by = strsep(&line, " "))
+    {
+        if (required_by[0] != '\0')
+        {
+            why_path_add_required_by(context->path, name_arena_intern(context->arena, required_by));
+        }
+    }
+}
+
+// Fills path with the chain through which the daemon's keep list holds name,
+// as why_path_fill does, leaving it empty if name isn't installed
+int daemon_conn_fetch_why(daemon_conn_t *conn, why_path_t *path, const char *name, name_arena_t *arena, char *error, size_t error_capacity)
+{
+    char *request = malloc(strlen(name) + 16);
+    sprintf(request, "why %s tsv", name);
+    why_path_clear(path);
+    why_context_t context = {path, arena};
+    const int err = daemon_conn_request(conn, request, on_why_line, &context, error, error_capacity);
+    free(request);
+
+    if (err == -1)
+    {
+        why_path_clear(path);
+        return strcmp(error, "not installed") == 0 ? 0 : -1;
+    }
+
+    // Only a held package has a parent, unless it's a root itself
+    path->is_held = path->names->size > 1 || (path->names->size == 1 && path->is_kept[0]);
+    return 0;
+}
+
+// Description layout
+// Descriptions are decoded from UTF-8 once, measured with wcwidth, and wrapped
+// into lines for the details pane's width. The lines are cached by package, so
+// drawing a description again is just copying its glyphs into cells. The cache
+// is only thrown away when the pane's width changes.
+
+typedef struct _text_layout
+{
+    uint32_t *glyphs; // The code points of every line, one after another
+    uint8_t *widths; // The number of cells each glyph takes up
+    int *line_starts; // Line i is glyphs[line_starts[i]] to glyphs[line_starts[i + 1] - 1]
+    int line_count;
+} text_layout_t;
+
+typedef struct _layout_cache
+{
+    name_set_t *index; // Maps package names to indices in layouts
+    text_layout_t *layouts;
+    int size;
+    int capacity;
+    int width; // Every cached layout was wrapped to this width
+} layout_cache_t;
+
+// Decodes the UTF-8 sequence at str (which has size bytes left) into *out.
+// Returns the number of bytes used, decoding invalid sequences as U+FFFD.
+int utf8_decode(const char *str, size_t size, uint32_t *out)
+{
+    const unsigned char *bytes = (const unsigned char *)str;
+    int length;
+    uint32_t code_point;
+
+    if (bytes[0] < 0x80)
+    {
+        *out = bytes[0];
+        return 1;
+    }
+    else if ((bytes[0] & 0xE0) == 0xC0)
+    {
+        length = 2;
+        code_point = bytes[0] & 0x1F;
+    }
+    else if ((bytes[0] & 0xF0) == 0xE0)
+    {
+        length = 3;
+        code_point = bytes[0] & 0x0F;
+    }
+    else if ((bytes[0] & 0xF8) == 0xF0)
+    {
+        length = 4;
+        code_point = bytes[0] & 0x07;
+    }
+    else
+    {
+        *out = 0xFFFD;
+        return 1;
+    }
+
+    if ((size_t)length > size)
+    {
+        *out = 0xFFFD;
+        return 1;
+    }
+
+    for (int i = 1; i < length; i++)
+    {
+        if ((bytes[i] & 0xC0) != 0x80)
+        {
+            *out = 0xFFFD;
+            return 1;
+        }
+        code_point = (code_point << 6) | (bytes[i] & 0x3F);
+    }
+
+    // Reject overlong encodings, surrogates and values past U+10FFFF
+    static const uint32_t MIN_CODE_POINTS[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    if (code_point < MIN_CODE_POINTS[length] || (code_point >= 0xD800 && code_point <= 0xDFFF) || code_point > 0x10FFFF)
+    {
+        *out = 0xFFFD;
+        return 1;
+    }
+
+    *out = code_point;
+    return length;
+}
+
+// Wraps str into lines which are at most width cells wide, breaking lines at
+// spaces when possible and in the middle of words that don't fit on a line
+void text_layout_init(text_layout_t *layout, const char *str, int width)
+{
+    const size_t size = strlen(str);
+
+    // A glyph never takes up fewer bytes than cells
+    layout->glyphs = malloc(sizeof(uint32_t) * (size + 1));
+    layout->widths = malloc(sizeof(uint8_t) * (size + 1));
+    layout->line_starts = malloc(sizeof(int) * (size + 2));
+    layout->line_count = 0;
+
+    int glyph_count = 0;
+    int line_width = 0;
+    size_t pos = 0;
+
+    while (pos < size && width > 0)
+    {
+        if (str[pos] == ' ' || str[pos] == '\n' || str[pos] == '\t')
+        {
+            pos++;
+            continue;
+        }
+
+        // Decode the next word into the end of glyphs, before deciding where it goes
+        const int word_start = glyph_count;
+        int word_width = 0;
+        while (pos < size && str[pos] != ' ' && str[pos] != '\n' && str[pos] != '\t')
+        {
+            uint32_t code_point;
+            pos += utf8_decode(&str[pos], size - pos, &code_point);
+
+            int glyph_width = wcwidth(code_point);
+            if (glyph_width == 0)
+            {
+                // termbox can't combine characters within a cell
+                continue;
+            }
+            else if (glyph_width < 0)
+            {
+                code_point = 0xFFFD;
+                glyph_width = 1;
+            }
+
+            layout->glyphs[glyph_count] = code_point;
+            layout->widths[glyph_count] = glyph_width;
+            glyph_count++;
+            word_width += glyph_width;
+        }
+
+        if (word_start == glyph_count)
+        {
+            continue;
+        }
+
+        if (layout->line_count > 0 && line_width + 1 + word_width <= width)
+        {
+            // Join the word to the current line with a space
+            memmove(&layout->glyphs[word_start + 1], &layout->glyphs[word_start], sizeof(uint32_t) * (glyph_count - word_start));
+            memmove(&layout->widths[word_start + 1], &layout->widths[word_start], sizeof(uint8_t) * (glyph_count - word_start));
+            layout->glyphs[word_start] = ' ';
+            layout->widths[word_start] = 1;
+            glyph_count++;
+            line_width += 1 + word_width;
+            continue;
+        }
+
+        // Start new lines, splitting the word wherever it overflows one
+        layout->line_starts[layout->line_count++] = word_start;
+        line_width = 0;
+        for (int i = word_start; i < glyph_count; i++)
+        {
+            if (line_width + layout->widths[i] > width && line_width > 0)
+            {
+                layout->line_starts[layout->line_count++] = i;
+                line_width = 0;
+            }
+            line_width += layout->widths[i];
+        }
+    }
+
+    layout->line_starts[layout->line_count] = glyph_count;
+}
+
+void text_layout_free(text_layout_t *layout)
+{
+    free(layout->glyphs);
+    free(layout->widths);
+    free(layout->line_starts);
+}
+
+layout_cache_t *layout_cache_new(const name_arena_t *arena)
+{
+    layout_cache_t *cache = malloc(sizeof(layout_cache_t));
+    cache->index = name_set_new(arena);
+    cache->capacity = 16;
+    cache->size = 0;
+    cache->layouts = malloc(sizeof(text_layout_t) * cache->capacity);
+    cache->width = -1;
+    return cache;
+}
+
+// Throws away every cached layout, e.g. after the descriptions have been reloaded
+void layout_cache_clear(layout_cache_t *cache)
+{
+    for (int i = 0; i < cache->size; i++)
+    {
+        text_layout_free(&cache->layouts[i]);
+    }
+    cache->size = 0;
+
+    const name_arena_t *arena = cache->index->arena;
+    name_set_free(cache->index);
+    cache->index = name_set_new(arena);
+}
+
+// Throws away every cached layout if they weren't wrapped to width
+void layout_cache_set_width(layout_cache_t *cache, int width)
+{
+    if (cache->width == width)
+    {
+        return;
+    }
+
+    layout_cache_clear(cache);
+    cache->width = width;
+}
+
+// Returns the description of the package at index in list wrapped to the
+// cache's width, laying it out first if it isn't already cached
+const text_layout_t *layout_cache_get(layout_cache_t *cache, pkg_state_list_t *list, int index, const name_arena_t *arena, alpm_list_t *dbs_sync)
+{
+    const int cached_index = name_set_get(cache->index, list->names[index]);
+    if (cached_index >= 0)
+    {
+        return &cache->layouts[cached_index];
+    }
+
+    if (cache->size >= cache->capacity)
+    {
+        cache->capacity *= 2;
+        cache->layouts = realloc(cache->layouts, sizeof(text_layout_t) * cache->capacity);
+    }
+
+    text_layout_t *layout = &cache->layouts[cache->size];
+    text_layout_init(layout, pkg_state_get_desc(list, index, arena, dbs_sync), cache->width);
+    name_set_add(cache->index, list->names[index], cache->size);
+    cache->size++;
+
+    return layout;
+}
+
+void layout_cache_free(layout_cache_t *cache)
+{
+    for (int i = 0; i < cache->size; i++)
+    {
+        text_layout_free(&cache->layouts[i]);
+    }
+
+    free(cache->layouts);
+    name_set_free(cache->index);
+    free(cache);
+}
+
+// Filtering
+// '/' narrows the upgrade list to the packages whose name or description
+// contains every word of the query, ignoring ASCII case. Each package's text
+// is indexed by trigram the first time a filter needs it, so a query only
+// checks the packages in the postings of its rarest trigram. A query which
+// extends the previous one (i.e. another keystroke) only rechecks the
+// packages the previous one matched.
+//
+// Packages are indexed by name rather than by position, so the index survives
+// packages entering and leaving the upgrade list; only the mapping from
+// documents to list positions is rebuilt when the list changes.
+
+#define FILTER_MAX_QUERY 128
+
+typedef struct _trigram_postings
+{
+    uint32_t trigram; // The three bytes, plus 1 so that 0 marks an empty slot
+    int *docs; // In increasing order, without repeats
+    int size;
+    int capacity;
+} trigram_postings_t;
+
+typedef struct _filter_index
+{
+    name_set_t *doc_ids; // Maps package names to their documents
+    char *text; // Every document's lowercased "name\ndescription", NUL-terminated
+    size_t text_size;
+    size_t text_capacity;
+    size_t *text_starts; // doc_count entries
+    int *list_indices; // The position of each document in the upgrade list, or -1
+    int doc_count;
+    int doc_capacity;
+    trigram_postings_t *postings; // Open-addressed by trigram, with linear probing
+    int posting_count;
+    int posting_capacity; // Should always be powers of 2
+} filter_index_t;
+
+// The packages currently shown, as positions in the upgrade list (in order)
+typedef struct _pkg_view
+{
+    int *indices;
+    int size;
+    int capacity;
+} pkg_view_t;
+
+typedef struct _pkg_filter
+{
+    filter_index_t *index; // Built the first time the query isn't empty
+    char query[FILTER_MAX_QUERY]; // What view currently matches
+    int query_size;
+    pkg_view_t *view;
+    pthread_mutex_t *alpm_lock; // Held while looking up descriptions, if it isn't NULL
+} pkg_filter_t;
+
+char ascii_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+uint32_t trigram_at(const char *str)
+{
+    return ((uint32_t)(unsigned char)str[0] << 16 | (uint32_t)(unsigned char)str[1] << 8 | (unsigned char)str[2]) + 1;
+}
+
+filter_index_t *filter_index_new(const name_arena_t *arena)
+{
+    filter_index_t *index = calloc(1, sizeof(filter_index_t));
+    index->doc_ids = name_set_new(arena);
+    index->text_capacity = 4096;
+    index->text = malloc(index->text_capacity);
+    index->doc_capacity = 64;
+    index->text_starts = malloc(sizeof(size_t) * index->doc_capacity);
+    index->list_indices = malloc(sizeof(int) * index->doc_capacity);
+    index->posting_capacity = 1024;
+    index->postings = calloc(index->posting_capacity, sizeof(trigram_postings_t));
+    trace_count(&trace_counters.allocations, 5);
+    return index;
+}
+
+void filter_index_free(filter_index_t *index)
+{
+    for (int i = 0; i < index->posting_capacity; i++)
+    {
+        free(index->postings[i].docs);
+    }
+
+    name_set_free(index->doc_ids);
+    free(index->text);
+    free(index->text_starts);
+    free(index->list_indices);
+    free(index->postings);
+    free(index);
+}
+
+// Returns the postings slot for trigram, which is empty if it's never been seen
+trigram_postings_t *filter_index_slot(filter_index_t *index, uint32_t trigram)
+{
+    const uint32_t mask = index->posting_capacity - 1;
+    uint32_t slot = (trigram * 0x9E3779B1u) & mask;
+
+    while (index->postings[slot].trigram != 0 && index->postings[slot].trigram != trigram)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    return &index->postings[slot];
+}
+
+void filter_index_grow_postings(filter_index_t *index)
+{
+    trigram_postings_t *old_postings = index->postings;
+    const int old_capacity = index->posting_capacity;
+
+    index->posting_capacity *= 2;
+    index->postings = calloc(index->posting_capacity, sizeof(trigram_postings_t));
+    trace_count(&trace_counters.allocations, 1);
+
+    for (int i = 0; i < old_capacity; i++)
+    {
+        if (old_postings[i].trigram != 0)
+        {
+            *filter_index_slot(index, old_postings[i].trigram) = old_postings[i];
+        }
+    }
+
+    free(old_postings);
+}
+
+void filter_index_append_text(filter_index_t *index, const char *str)
+{
+    for (; *str != '\0'; str++)
+    {
+        if (index->text_size + 2 > index->text_capacity)
+        {
+            index->text_capacity *= 2;
+            index->text = realloc(index->text, index->text_capacity);
+            trace_count(&trace_counters.allocations, 1);
+        }
+
+        index->text[index->text_size++] = ascii_lower(*str);
+    }
+}
+
+// Adds the name and description of the package at list_index as a new document
+int filter_index_add(filter_index_t *index, pkg_state_list_t *list, int list_index, const name_arena_t *arena, alpm_list_t *dbs_sync)
+{
+    if (index->doc_count == index->doc_capacity)
+    {
+        index->doc_capacity *= 2;
+        index->text_starts = realloc(index->text_starts, sizeof(size_t) * index->doc_capacity);
+        index->list_indices = realloc(index->list_indices, sizeof(int) * index->doc_capacity);
+        trace_count(&trace_counters.allocations, 2);
+    }
+
+    const int doc = index->doc_count++;
+    name_set_add(index->doc_ids, list->names[list_index], doc);
+    index->list_indices[doc] = -1;
+
+    const size_t start = index->text_size;
+    index->text_starts[doc] = start;
+    filter_index_append_text(index, name_arena_str(arena, list->names[list_index]));
+    filter_index_append_text(index, "\n");
+    filter_index_append_text(index, pkg_state_get_desc(list, list_index, arena, dbs_sync));
+    index->text[index->text_size++] = '\0';
+
+    for (size_t i = start; i + 3 < index->text_size; i++)
+    {
+        if (index->posting_count * 2 >= index->posting_capacity)
+        {
+            filter_index_grow_postings(index);
+        }
+
+        trigram_postings_t *postings = filter_index_slot(index, trigram_at(&index->text[i]));
+        if (postings->trigram == 0)
+        {
+            postings->trigram = trigram_at(&index->text[i]);
+            index->posting_count++;
+        }
+
+        // Documents are added in order, so a repeat can only be the last entry
+        if (postings->size > 0 && postings->docs[postings->size - 1] == doc)
+        {
+            continue;
+        }
+
+        if (postings->size == postings->capacity)
+        {
+            postings->capacity = postings->capacity == 0 ? 4 : postings->capacity * 2;
+            postings->docs = realloc(postings->docs, sizeof(int) * postings->capacity);
+            trace_count(&trace_counters.allocations, 1);
+        }
+        postings->docs[postings->size++] = doc;
+    }
+
+    return doc;
+}
+
+// Points every document at its package's position in upgrade_list, indexing
+// any packages which haven't been seen before (with alpm_lock held, if it
+// isn't NULL)
+void filter_index_sync(filter_index_t *index, pkg_state_list_t *upgrade_list, const name_arena_t *arena, alpm_list_t *dbs_sync, pthread_mutex_t *alpm_lock)
+{
+    for (int doc = 0; doc < index->doc_count; doc++)
+    {
+        index->list_indices[doc] = -1;
+    }
+
+    bool is_locked = false;
+    for (int i = 0; i < upgrade_list->size; i++)
+    {
+        int doc = name_set_get(index->doc_ids, upgrade_list->names[i]);
+        if (doc < 0)
+        {
+            if (alpm_lock != NULL && !is_locked)
+            {
+                pthread_mutex_lock(alpm_lock);
+                is_locked = true;
+            }
+            doc = filter_index_add(index, upgrade_list, i, arena, dbs_sync);
+        }
+        index->list_indices[doc] = i;
+    }
+
+    if (is_locked)
+    {
+        pthread_mutex_unlock(alpm_lock);
+    }
+}
+
+// Whether the document contains every space-separated word of query (which
+// must already be lowercase)
+bool filter_index_matches(const filter_index_t *index, int doc, const char *query)
+{
+    const char *text = &index->text[index->text_starts[doc]];
+    char word[FILTER_MAX_QUERY];
+
+    while (*query != '\0')
+    {
+        const size_t word_size = strcspn(query, " ");
+        if (word_size > 0)
+        {
+            memcpy(word, query, word_size);
+            word[word_size] = '\0';
+            if (strstr(text, word) == NULL)
+            {
+                return false;
+            }
+        }
+
+        query += word_size;
+        query += strspn(query, " ");
+    }
+
+    return true;
+}
+
+// Returns the smallest postings list of any trigram in a word of query, or
+// NULL if no word has a trigram (in which case every document is a candidate).
+// *is_empty is set if some trigram isn't in any document.
+const trigram_postings_t *filter_index_rarest(filter_index_t *index, const char *query, bool *is_empty)
+{
+    const trigram_postings_t *rarest = NULL;
+    *is_empty = false;
+
+    for (int i = 0; query[i] != '\0' && query[i + 1] != '\0' && query[i + 2] != '\0'; i++)
+    {
+        if (query[i] == ' ' || query[i + 1] == ' ' || query[i + 2] == ' ')
+        {
+            continue;
+        }
+
+        const trigram_postings_t *postings = filter_index_slot(index, trigram_at(&query[i]));
+        if (postings->trigram == 0)
+        {
+            *is_empty = true;
+            return NULL;
+        }
+
+        if (rarest == NULL || postings->size < rarest->size)
+        {
+            rarest = postings;
+        }
+    }
+
+    return rarest;
+}
+
+pkg_view_t *pkg_view_new()
+{
+    pkg_view_t *view = malloc(sizeof(pkg_view_t));
+    view->capacity = 64;
+    view->indices = malloc(sizeof(int) * view->capacity);
+    view->size = 0;
+    trace_count(&trace_counters.allocations, 2);
+    return view;
+}
+
+void pkg_view_free(pkg_view_t *view)
+{
+    free(view->indices);
+    free(view);
+}
+
+void pkg_view_add(pkg_view_t *view, int list_index)
+{
+    if (view->size == view->capacity)
+    {
+        view->capacity *= 2;
+        view->indices = realloc(view->indices, sizeof(int) * view->capacity);
+        trace_count(&trace_counters.allocations, 1);
+    }
+
+    view->indices[view->size++] = list_index;
+}
+
+// Returns the position in view of the first package at or after list_index,
+// or of the last package if there are none after it (0 if view is empty)
+int pkg_view_find(const pkg_view_t *view, int list_index)
+{
+    int low = 0;
+    int high = view->size;
+
+    while (low < high)
+    {
+        const int mid = low + (high - low) / 2;
+        if (view->indices[mid] < list_index)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return max(0, min(low, view->size - 1));
+}
+
+int compare_ints(const void *a, const void *b)
+{
+    const int x = *(const int *)a;
+    const int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+pkg_filter_t *pkg_filter_new()
+{
+    pkg_filter_t *filter = calloc(1, sizeof(pkg_filter_t));
+    filter->view = pkg_view_new();
+    return filter;
+}
+
+void pkg_filter_free(pkg_filter_t *filter)
+{
+    if (filter->index != NULL)
+    {
+        filter_index_free(filter->index);
+    }
+
+    pkg_view_free(filter->view);
+    free(filter);
+}
+
+// Recomputes the view from scratch, e.g. after upgrade_list has changed
+void pkg_filter_update(pkg_filter_t *filter, pkg_state_list_t *upgrade_list, const name_arena_t *arena, alpm_list_t *dbs_sync)
+{
+    pkg_view_t *view = filter->view;
+    view->size = 0;
+
+    if (filter->query_size == 0)
+    {
+        for (int i = 0; i < upgrade_list->size; i++)
+        {
+            pkg_view_add(view, i);
+        }
+        return;
+    }
+
+    if (filter->index == NULL)
+    {
+        filter->index = filter_index_new(arena);
+    }
+    filter_index_t *index = filter->index;
+    filter_index_sync(index, upgrade_list, arena, dbs_sync, filter->alpm_lock);
+
+    bool is_empty;
+    const trigram_postings_t *rarest = filter_index_rarest(index, filter->query, &is_empty);
+    if (is_empty)
+    {
+        return;
+    }
+
+    // Queries without a trigram (at most two characters a word) check everything
+    const int candidate_count = rarest != NULL ? rarest->size : index->doc_count;
+    for (int i = 0; i < candidate_count; i++)
+    {
+        const int doc = rarest != NULL ? rarest->docs[i] : i;
+        if (index->list_indices[doc] >= 0 && filter_index_matches(index, doc, filter->query))
+        {
+            pkg_view_add(view, index->list_indices[doc]);
+        }
+    }
+
+    qsort(view->indices, view->size, sizeof(int), compare_ints);
+}
+
+// Changes the query, refining the current view if query extends the old one.
+// query is truncated to FILTER_MAX_QUERY - 1 bytes.
+void pkg_filter_set_query(pkg_filter_t *filter, const char *query, pkg_state_list_t *upgrade_list, const name_arena_t *arena, alpm_list_t *dbs_sync)
+{
+    const int query_size = min(strlen(query), FILTER_MAX_QUERY - 1);
+    const bool is_refining = filter->query_size > 0 && query_size >= filter->query_size
+                             && strncasecmp(query, filter->query, filter->query_size) == 0;
+
+    for (int i = 0; i < query_size; i++)
+    {
+        filter->query[i] = ascii_lower(query[i]);
+    }
+    filter->query[query_size] = '\0';
+    filter->query_size = query_size;
+
+    if (!is_refining)
+    {
+        pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+        return;
+    }
+
+    // Anything matching the new query also matched the old one
+    pkg_view_t *view = filter->view;
+    int kept_count = 0;
+    for (int i = 0; i < view->size; i++)
+    {
+        const int doc = name_set_get(filter->index->doc_ids, upgrade_list->names[view->indices[i]]);
+        if (filter_index_matches(filter->index, doc, filter->query))
+        {
+            view->indices[kept_count++] = view->indices[i];
+        }
+    }
+    view->size = kept_count;
+}
+
+// Moves the cursor to the package at list_index in the upgrade list, or the
+// nearest one in view after it, keeping it on the same row of the screen if
+// possible
+void pkg_view_track(const pkg_view_t *view, int list_index, int *base_index, int *selection_index)
+{
+    const int view_index = pkg_view_find(view, list_index);
+    *selection_index = min(*selection_index, view_index);
+    *base_index = view_index - *selection_index;
+}
+
+// Annotations
+// When the list pane is wide enough, each row shows the installed and new
+// versions, the repo and how big the version bump is, next to the name. The
+// installed version means a local db lookup (unless the row came from a
+// daemon, which sends it along), and with a cached upgrade list the local db
+// isn't otherwise read at all, so nothing is annotated up front.
+// Instead, each frame queues the rows on screen that aren't annotated yet,
+// followed by a screen's worth below and above them, for an annotator thread.
+// Annotations are memoized by package name, so scrolling back over rows (or
+// re-sorting) costs nothing, and they're only thrown away by a live refresh.
+//
+// The annotator calls into libalpm, so it holds alpm_mutex while it works,
+// which also guards the annotations themselves. It's only started once the
+// loader (if any) has finished, and from then on the UI thread holds
+// alpm_mutex all the time, except while waiting for input, which is when the
+// annotator gets to run.
+
+#define ANNOTATION_TEXT_SIZE 48
+// The list pane has to be wider than this to show anything but names
+#define ANNOTATION_MIN_WIDTH 56
+// How often frames are drawn while rows on screen are waiting for annotations
+#define ANNOTATION_POLL_MS 20
+
+typedef enum _version_bump
+{
+    BUMP_UNKNOWN, // The package isn't installed (any more)
+    BUMP_MAJOR, // The epoch or the first component of pkgver changed
+    BUMP_MINOR, // A later component of pkgver changed
+    BUMP_PKGREL, // Only pkgrel changed, i.e. a rebuild
+} version_bump_t;
+
+const char *version_bump_labels[] = {"?", "major", "minor", "pkgrel"};
+
+typedef struct _annotation
+{
+    char old_version[ANNOTATION_TEXT_SIZE]; // Truncated if it's longer
+    char repo[ANNOTATION_TEXT_SIZE];
+    version_bump_t bump;
+} annotation_t;
+
+typedef struct _annotation_item
+{
+    pkg_name_t name;
+    pkg_name_t new_version;
+    int repo_index;
+    bool has_old_version; // Whether old_version was given by a daemon, instead of being looked up
+    pkg_name_t old_version; // Empty if the package isn't installed
+    int generation; // Of the annotator when the item was queued
+} annotation_item_t;
+
+typedef struct _annotator
+{
+    pthread_t thread;
+
+    // Guarded by alpm_mutex
+    alpm_db_t *localdb;
+    alpm_list_t *dbs_sync;
+    const name_arena_t *arena;
+    name_set_t *index; // Maps package names to annotations
+    annotation_t *annotations;
+    int size;
+    int capacity;
+    int generation; // Bumped whenever the annotations are thrown away
+
+    // Guarded by mutex
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // Signalled when items are queued, or the thread should stop
+    annotation_item_t *items; // In order of priority
+    int item_count;
+    int item_capacity;
+    int next_item;
+    bool is_stopping;
+} annotator_t;
+
+// Whether the first size bytes of old_version and of new_version (each
+// compared as a version of its own) are equal
+bool version_parts_eql(const char *old_version, size_t old_size, const char *new_version, size_t new_size)
+{
+    char *old_part = strndup(old_version, old_size);
+    char *new_part = strndup(new_version, new_size);
+    const bool is_equal = alpm_pkg_vercmp(old_part, new_part) == 0;
+    free(old_part);
+    free(new_part);
+    return is_equal;
+}
+
+// Classifies the change from old_version to new_version (both
+// [epoch:]pkgver-pkgrel) by the most significant part which differs
+version_bump_t version_bump_classify(const char *old_version, const char *new_version)
+{
+    const char *old_colon = strchr(old_version, ':');
+    const char *new_colon = strchr(new_version, ':');
+    const long old_epoch = old_colon != NULL ? strtol(old_version, NULL, 10) : 0;
+    const long new_epoch = new_colon != NULL ? strtol(new_version, NULL, 10) : 0;
+    if (old_epoch != new_epoch)
+    {
+        return BUMP_MAJOR;
+    }
+
+    const char *old_pkgver = old_colon != NULL ? old_colon + 1 : old_version;
+    const char *new_pkgver = new_colon != NULL ? new_colon + 1 : new_version;
+
+    // pkgrel is whatever follows the last '-'
+    const char *old_dash = strrchr(old_pkgver, '-');
+    const char *new_dash = strrchr(new_pkgver, '-');
+    const size_t old_size = old_dash != NULL ? (size_t)(old_dash - old_pkgver) : strlen(old_pkgver);
+    const size_t new_size = new_dash != NULL ? (size_t)(new_dash - new_pkgver) : strlen(new_pkgver);
+    if (version_parts_eql(old_pkgver, old_size, new_pkgver, new_size))
+    {
+        return BUMP_PKGREL;
+    }
+
+    // The major version is up to the first separator
+    const char *separators = ".-_+~";
+    return version_parts_eql(old_pkgver, strcspn(old_pkgver, separators), new_pkgver, strcspn(new_pkgver, separators))
+               ? BUMP_MINOR
+               : BUMP_MAJOR;
+}
+
+// Annotates the package in item. The caller holds alpm_mutex.
+void annotator_add(annotator_t *annotator, const annotation_item_t *item)
+{
+    if (annotator->size >= annotator->capacity)
+    {
+        annotator->capacity *= 2;
+        annotator->annotations = realloc(annotator->annotations, sizeof(annotation_t) * annotator->capacity);
+        trace_count(&trace_counters.allocations, 1);
+    }
+
+    annotation_t *annotation = &annotator->annotations[annotator->size];
+    const char *old_version = "";
+    if (item->has_old_version)
+    {
+        old_version = name_arena_str(annotator->arena, item->old_version);
+    }
+    else
+    {
+        alpm_pkg_t *local_pkg = alpm_db_get_pkg(annotator->localdb, name_arena_str(annotator->arena, item->name));
+        old_version = local_pkg != NULL ? alpm_pkg_get_version(local_pkg) : "";
+    }
+    snprintf(annotation->old_version, sizeof(annotation->old_version), "%s", old_version);
+    annotation->bump = old_version[0] != '\0'
+                           ? version_bump_classify(old_version, name_arena_str(annotator->arena, item->new_version))
+                           : BUMP_UNKNOWN;
+
+    annotation->repo[0] = '\0';
+    int repo_index = 0;
+    for (alpm_list_t *curr = annotator->dbs_sync; curr != NULL; curr = curr->next, repo_index++)
+    {
+        if (repo_index == item->repo_index)
+        {
+            snprintf(annotation->repo, sizeof(annotation->repo), "%s", alpm_db_get_name((alpm_db_t *)curr->data));
+        }
+    }
+
+    name_set_add(annotator->index, item->name, annotator->size);
+    annotator->size++;
+}
+
+void *annotator_run(void *_annotator)
+{
+    annotator_t *annotator = _annotator;
+
+    pthread_mutex_lock(&annotator->mutex);
+    while (true)
+    {
+        while (!annotator->is_stopping && annotator->next_item >= annotator->item_count)
+        {
+            pthread_cond_wait(&annotator->cond, &annotator->mutex);
+        }
+
+        if (annotator->is_stopping)
+        {
+            break;
+        }
+
+        const annotation_item_t item = annotator->items[annotator->next_item++];
+        pthread_mutex_unlock(&annotator->mutex);
+
+        // Items queued before the annotations were last thrown away may be out of date
+        pthread_mutex_lock(&alpm_mutex);
+        if (item.generation == annotator->generation && name_set_get(annotator->index, item.name) < 0)
+        {
+            annotator_add(annotator, &item);
+        }
+        pthread_mutex_unlock(&alpm_mutex);
+
+        pthread_mutex_lock(&annotator->mutex);
+    }
+    pthread_mutex_unlock(&annotator->mutex);
+
+    return NULL;
+}
+
+// Starts the annotator thread. Returns NULL if it couldn't be started.
+annotator_t *annotator_start(alpm_db_t *localdb, alpm_list_t *dbs_sync, const name_arena_t *arena)
+{
+    annotator_t *annotator = calloc(1, sizeof(annotator_t));
+    annotator->localdb = localdb;
+    annotator->dbs_sync = dbs_sync;
+    annotator->arena = arena;
+    annotator->index = name_set_new(arena);
+    annotator->capacity = 64;
+    annotator->annotations = malloc(sizeof(annotation_t) * annotator->capacity);
+    annotator->item_capacity = 64;
+    annotator->items = malloc(sizeof(annotation_item_t) * annotator->item_capacity);
+    pthread_mutex_init(&annotator->mutex, NULL);
+    pthread_cond_init(&annotator->cond, NULL);
+
+    if (pthread_create(&annotator->thread, NULL, annotator_run, annotator) != 0)
+    {
+        pthread_mutex_destroy(&annotator->mutex);
+        pthread_cond_destroy(&annotator->cond);
+        name_set_free(annotator->index);
+        free(annotator->annotations);
+        free(annotator->items);
+        free(annotator);
+        return NULL;
+    }
+
+    return annotator;
+}
+
+// Returns the annotation of the package called name, or NULL if it hasn't
+// been annotated yet. The caller holds alpm_mutex.
+const annotation_t *annotator_get(const annotator_t *annotator, pkg_name_t name)
+{
+    const int index = name_set_get(annotator->index, name);
+    return index >= 0 ? &annotator->annotations[index] : NULL;
+}
+
+// Replaces the queue with the packages in view which aren't annotated yet,
+// out of the height rows from base_index, then the height rows below them,
+// then the height rows above them. Returns whether any of the rows from
+// base_index are still waiting. The caller holds alpm_mutex.
+bool annotator_request(annotator_t *annotator, const pkg_state_list_t *upgrade_list, const pkg_view_t *view, int base_index, int height)
+{
+    const int ranges[3][2] = {
+        {base_index, base_index + height},
+        {base_index + height, base_index + 2 * height},
+        {base_index - height, base_index},
+    };
+
+    pthread_mutex_lock(&annotator->mutex);
+    if (annotator->item_capacity < 3 * height)
+    {
+        annotator->item_capacity = 3 * height;
+        annotator->items = realloc(annotator->items, sizeof(annotation_item_t) * annotator->item_capacity);
+        trace_count(&trace_counters.allocations, 1);
+    }
+
+    annotator->item_count = 0;
+    annotator->next_item = 0;
+    bool is_waiting = false;
+    for (int range = 0; range < 3; range++)
+    {
+        for (int i = max(0, ranges[range][0]); i < min(view->size, ranges[range][1]); i++)
+        {
+            const int list_index = view->indices[i];
+            if (name_set_get(annotator->index, upgrade_list->names[list_index]) >= 0)
+            {
+                continue;
+            }
+
+            annotation_item_t *item = &annotator->items[annotator->item_count++];
+            item->name = upgrade_list->names[list_index];
+            item->new_version = upgrade_list->new_versions[list_index];
+            item->repo_index = upgrade_list->repo_indices[list_index];
+            item->has_old_version = upgrade_list->ary[list_index].has_details;
+            item->old_version = upgrade_list->ary[list_index].old_version;
+            item->generation = annotator->generation;
+            is_waiting |= range == 0;
+        }
+    }
+
+    if (annotator->item_count > 0)
+    {
+        pthread_cond_signal(&annotator->cond);
+    }
+    pthread_mutex_unlock(&annotator->mutex);
+
+    return is_waiting;
+}
+
+// Throws away every annotation (and anything queued), e.g. after the
+// databases have been reloaded. The caller holds alpm_mutex.
+void annotator_clear(annotator_t *annotator, alpm_db_t *localdb, alpm_list_t *dbs_sync)
+{
+    annotator->localdb = localdb;
+    annotator->dbs_sync = dbs_sync;
+    annotator->size = 0;
+    annotator->generation++;
+
+    const name_arena_t *arena = annotator->index->arena;
+    name_set_free(annotator->index);
+    annotator->index = name_set_new(arena);
+}
+
+// Stops the annotator thread and frees it. The caller must not hold
+// alpm_mutex, which the thread may be waiting for.
+void annotator_stop(annotator_t *annotator)
+{
+    if (annotator == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&annotator->mutex);
+    annotator->is_stopping = true;
+    pthread_cond_signal(&annotator->cond);
+    pthread_mutex_unlock(&annotator->mutex);
+    pthread_join(annotator->thread, NULL);
+
+    pthread_mutex_destroy(&annotator->mutex);
+    pthread_cond_destroy(&annotator->cond);
+    name_set_free(annotator->index);
+    free(annotator->annotations);
+    free(annotator->items);
+    free(annotator);
+}
+
+// Lays out a row of the list pane, width cells wide, into row (which has
+// room for width + 1 bytes): the name, the installed and new versions, the
+// repo and the bump. width is at least ANNOTATION_MIN_WIDTH. annotation is NULL
+// until the row has been annotated. Returns the length of the row.
+int format_list_row(char *row, int width, const char *name, const char *new_version, const annotation_t *annotation)
+{
+    // The repo and bump columns fit their longest usual values ("multilib", "pkgrel")
+    const int repo_width = 9;
+    const int bump_width = 6;
+    const int version_width = min(24, (width - repo_width - bump_width - 4) / 4);
+    const int name_width = width - repo_width - bump_width - 2 * version_width - 4;
+
+    snprintf(row, width + 1, "%-*.*s %-*.*s %-*.*s %-*.*s %-*.*s", name_width, name_width, name, version_width,
+             version_width, annotation != NULL ? annotation->old_version : "...", version_width, version_width,
+             new_version, repo_width, repo_width, annotation != NULL ? annotation->repo : "", bump_width, bump_width,
+             annotation != NULL ? version_bump_labels[annotation->bump] : "");
+    return strlen(row);
+}
+
+// Incremental rendering
+// Instead of clearing and redrawing the whole screen every frame, the
+// renderer remembers what each row of the list pane and the details pane
+// currently show, and only repaints what differs from the new frame. When the
+// list scrolls, the rows still on screen are shifted in termbox's cell buffer
+// rather than redrawn.
+
+// A name offset for rows that must be redrawn (e.g. after a resize)
+#define ROW_UNKNOWN UINT32_MAX
+// A name offset for rows below the end of the list
+#define ROW_BLANK (UINT32_MAX - 1)
+
+typedef struct _row_record
+{
+    uint32_t name_offset; // Identifies the package drawn on this row
+    uint32_t fg;
+    bool is_annotated; // Whether the annotation columns were filled in
+} row_record_t;
+
+// The status line, the selection's download total and the list's
+#define FOOTER_LINE_COUNT 3
+
+typedef struct _render_state
+{
+    int width; // Of the previous frame
+    int height;
+    int base_index;
+    row_record_t *rows; // What each row of the list pane shows, height entries
+    uint32_t detail_name_offset; // The package shown in the details pane
+    bool detail_is_new;
+    int *detail_row_ends; // The column after the last cell drawn on each row of the details pane
+    layout_cache_t *layouts; // Descriptions wrapped to the details pane's width
+    char footer[FOOTER_LINE_COUNT][128]; // The lines at the bottom of the details pane, bottom first, or "" where nothing is drawn
+
+    // Statistics about the cells written by write_str and change_cell
+    long frame_count;
+    long total_cells_written;
+    long max_cells_written;
+} render_state_t;
+
+render_state_t *render_state_new(const name_arena_t *arena)
+{
+    render_state_t *render = calloc(1, sizeof(render_state_t));
+    render->layouts = layout_cache_new(arena);
+    render->width = -1;
+    render->height = -1;
+    return render;
+}
+
+void render_state_free(render_state_t *render)
+{
+    free(render->rows);
+    free(render->detail_row_ends);
+    layout_cache_free(render->layouts);
+    free(render);
+}
+
+// Forces the next frame to redraw everything
+void render_invalidate(render_state_t *render)
+{
+    render->width = -1;
+    render->height = -1;
+}
+
+// Draws str (which has len characters) on a row of the list pane, unless the
+// row already shows record
+void draw_row_record(render_state_t *render, int row, row_record_t record, const char *str, int len)
+{
+    if (render->rows[row].name_offset == record.name_offset && render->rows[row].fg == record.fg
+        && render->rows[row].is_annotated == record.is_annotated)
+    {
+        return;
+    }
+
+    render->rows[row] = record;
+
+    const int half_width = tb_width() / 2;
+    write_str(0, row, str, record.fg, TB_DEFAULT);
+    for (int col = min(len, half_width); col < half_width; col++)
+    {
+        change_cell(col, row, ' ', record.fg, TB_DEFAULT);
+    }
+}
+
+// Draws a row of the list pane, with the annotation columns if annotator
+// isn't NULL
+void draw_list_row(render_state_t *render, const pkg_state_list_t *upgrade_list, const pkg_view_t *view, const name_arena_t *arena, const annotator_t *annotator, int row, int view_index, int selection_index)
+{
+    row_record_t record;
+    record.name_offset = ROW_BLANK;
+    record.fg = TB_DEFAULT;
+    record.is_annotated = false;
+
+    const char *pkg_name = "";
+    int len = 0;
+    char annotated_row[512];
+
+    if (view_index < view->size)
+    {
+        const int list_index = view->indices[view_index];
+        const pkg_name_t name = upgrade_list->names[list_index];
+        record.name_offset = name.offset;
+        pkg_name = name_arena_str(arena, name);
+        len = name.size;
+
+        if (annotator != NULL)
+        {
+            const annotation_t *annotation = annotator_get(annotator, name);
+            record.is_annotated = annotation != NULL;
+            // The last column is left blank to separate the list from the details
+            len = format_list_row(annotated_row, min(tb_width() / 2 - 1, sizeof(annotated_row) - 1), pkg_name,
+                                  name_arena_str(arena, upgrade_list->new_versions[list_index]), annotation);
+            pkg_name = annotated_row;
+        }
+
+        if (upgrade_list->ary[list_index].is_new)
+        {
+            record.fg = TB_GREEN;
+        }
+
+        if (pkg_state_list_is_selected(upgrade_list, list_index))
+        {
+            // If the background is bold, then the text blinks.
+            // So we only make the foreground bold.
+            record.fg = TB_YELLOW;
+            record.fg |= TB_BOLD;
+        }
+
+        if (row == selection_index)
+        {
+            record.fg |= TB_REVERSE;
+        }
+    }
+
+    draw_row_record(render, row, record, pkg_name, len);
+}
+
+// Writes str in the details pane, remembering how far it reached so that
+// only those cells need clearing for the next package
+void write_detail_str(render_state_t *render, int x, int y, const char *str, uint32_t fg)
+{
+    if (y >= render->height)
+    {
+        return;
+    }
+
+    write_str(x, y, str, fg, TB_DEFAULT);
+
+    const int end = x + strlen(str);
+    if (end > render->detail_row_ends[y])
+    {
+        render->detail_row_ends[y] = end;
+    }
+}
+
+// Clears whatever the previous package drew in the details pane
+void clear_details(render_state_t *render)
+{
+    const int half_width = tb_width() / 2;
+    for (int row = 0; row < render->height; row++)
+    {
+        for (int col = half_width; col < render->detail_row_ends[row]; col++)
+        {
+            change_cell(col, row, ' ', TB_DEFAULT, TB_DEFAULT);
+        }
+        render->detail_row_ends[row] = 0;
+    }
+
+    memset(render->footer, 0, sizeof(render->footer));
+}
+
+// Draws str on the line'th row from the bottom of the details pane, over
+// anything else there, unless it's already shown
+void draw_footer_line(render_state_t *render, int line, const char *str)
+{
+    const int row = render->height - 1 - line;
+    if (row < 0 || strcmp(render->footer[line], str) == 0)
+    {
+        return;
+    }
+
+    const int half_width = tb_width() / 2;
+    for (int col = half_width; col < render->detail_row_ends[row]; col++)
+    {
+        change_cell(col, row, ' ', TB_DEFAULT, TB_DEFAULT);
+    }
+    render->detail_row_ends[row] = 0;
+
+    write_detail_str(render, half_width, row, str, TB_BOLD);
+    snprintf(render->footer[line], sizeof(render->footer[line]), "%s", str);
+}
+
+// Draws the details of the package at index in upgrade_list
+void draw_details(render_state_t *render, pkg_state_list_t *upgrade_list, int index, const name_arena_t *arena, alpm_list_t *dbs_sync)
+{
+    const pkg_state_t *curr_pkg = &upgrade_list->ary[index];
+    const pkg_name_t name = upgrade_list->names[index];
+    if (render->detail_name_offset == name.offset && render->detail_is_new == curr_pkg->is_new)
+    {
+        return;
+    }
+
+    render->detail_name_offset = name.offset;
+    render->detail_is_new = curr_pkg->is_new;
+    clear_details(render);
+
+    const int half_width = tb_width() / 2;
+
+    const text_layout_t *layout = layout_cache_get(render->layouts, upgrade_list, index, arena, dbs_sync);
+    for (int line = 0; line < layout->line_count && line < render->height; line++)
+    {
+        int col = half_width;
+        for (int i = layout->line_starts[line]; i < layout->line_starts[line + 1]; i++)
+        {
+            change_cell(col, line, layout->glyphs[i], TB_DEFAULT, TB_DEFAULT);
+            col += layout->widths[i];
+        }
+        render->detail_row_ends[line] = col;
+    }
+
+    int curs_y = layout->line_count > 0 ? layout->line_count - 1 : 0;
+
+    if (curs_y < 3)
+    {
+        curs_y = 3;
+    }
+    else
+    {
+        curs_y++;
+    }
+
+    int curs_x = half_width;
+    write_detail_str(render, curs_x, curs_y, "Installed Size: ", TB_BOLD);
+    curs_x += strlen("Installed Size: ");
+    char size_str[50];
+    read_size(size_str, 50, upgrade_list->isizes[index]);
+    write_detail_str(render, curs_x, curs_y, size_str, TB_DEFAULT);
+
+    curs_y++;
+    write_detail_str(render, half_width, curs_y, "Download Size: ", TB_BOLD);
+    if (curr_pkg->is_cached)
+    {
+        char archive_size_str[32];
+        read_size(archive_size_str, sizeof(archive_size_str), upgrade_list->download_sizes[index]);
+        snprintf(size_str, 50, "None (%s cached)", archive_size_str);
+    }
+    else
+    {
+        read_size(size_str, 50, upgrade_list->download_sizes[index]);
+    }
+    write_detail_str(render, half_width + strlen("Download Size: "), curs_y, size_str, TB_DEFAULT);
+
+    curs_y++;
+    const off_t size_change = upgrade_list->isizes[index] - curr_pkg->old_isize;
+    write_detail_str(render, half_width, curs_y, "Size Change: ", TB_BOLD);
+    size_str[0] = size_change < 0 ? '-' : '+';
+    read_size(size_str + 1, 49, size_change < 0 ? -size_change : size_change);
+    write_detail_str(render, half_width + strlen("Size Change: "), curs_y, size_str, TB_DEFAULT);
+
+    if (curr_pkg->is_new)
+    {
+        curs_y++;
+        write_detail_str(render, half_width, curs_y, "New since the last run", TB_GREEN | TB_BOLD);
+    }
+}
+
+// Moves the list pane's rows up by delta rows (or down, if delta is negative)
+void shift_list_rows(render_state_t *render, int delta)
+{
+    struct tb_cell *cells = tb_cell_buffer();
+    const int width = tb_width();
+    const int height = tb_height();
+    const int half_width = width / 2;
+
+    if (delta > 0)
+    {
+        for (int row = 0; row + delta < height; row++)
+        {
+            memmove(&cells[row * width], &cells[(row + delta) * width], sizeof(struct tb_cell) * half_width);
+            render->rows[row] = render->rows[row + delta];
+        }
+
+        for (int row = height - delta; row < height; row++)
+        {
+            render->rows[row].name_offset = ROW_UNKNOWN;
+        }
+    }
+    else if (delta < 0)
+    {
+        for (int row = height - 1; row + delta >= 0; row--)
+        {
+            memmove(&cells[row * width], &cells[(row + delta) * width], sizeof(struct tb_cell) * half_width);
+            render->rows[row] = render->rows[row + delta];
+        }
+
+        for (int row = 0; row < -delta && row < height; row++)
+        {
+            render->rows[row].name_offset = ROW_UNKNOWN;
+        }
+    }
+}
+
+// Handles resizes and scrolling before the rows of a frame are drawn
+void render_begin_frame(render_state_t *render, int base_index)
+{
+    cells_written = 0;
+
+    const int width = tb_width();
+    const int height = tb_height();
+
+    if (width != render->width || height != render->height)
+    {
+        tb_clear();
+
+        render->rows = realloc(render->rows, sizeof(row_record_t) * (height + 1));
+        render->detail_row_ends = realloc(render->detail_row_ends, sizeof(int) * (height + 1));
+        for (int row = 0; row < height; row++)
+        {
+            render->rows[row].name_offset = ROW_UNKNOWN;
+            render->detail_row_ends[row] = 0;
+        }
+
+        render->width = width;
+        render->height = height;
+        render->base_index = base_index;
+        render->detail_name_offset = ROW_UNKNOWN;
+        memset(render->footer, 0, sizeof(render->footer));
+        layout_cache_set_width(render->layouts, width - width / 2);
+    }
+    else if (base_index != render->base_index)
+    {
+        const int delta = base_index - render->base_index;
+        if (abs(delta) < height)
+        {
+            shift_list_rows(render, delta);
+        }
+        else
+        {
+            for (int row = 0; row < height; row++)
+            {
+                render->rows[row].name_offset = ROW_UNKNOWN;
+            }
+        }
+
+        render->base_index = base_index;
+    }
+}
+
+void render_end_frame(render_state_t *render)
+{
+    tb_present();
+
+    render->frame_count++;
+    render->total_cells_written += cells_written;
+    if (cells_written > render->max_cells_written)
+    {
+        render->max_cells_written = cells_written;
+    }
+}
+
+// Draws the packages in view, where base_index and selection_index are
+// positions in view. footer holds the lines shown at the bottom of the details
+// pane, bottom first, where NULL lines are left blank. While the list is still
+// loading or filtered, view may be empty. annotator is NULL until the
+// annotation columns can be shown.
+void render_frame(render_state_t *render, pkg_state_list_t *upgrade_list, const pkg_view_t *view, const name_arena_t *arena, const annotator_t *annotator, alpm_list_t *dbs_sync, int base_index, int selection_index, const char *const *footer)
+{
+    render_begin_frame(render, base_index);
+
+    for (int row = 0; row < render->height; row++)
+    {
+        draw_list_row(render, upgrade_list, view, arena, annotator, row, base_index + row, selection_index);
+    }
+
+    if (view->size > 0)
+    {
+        draw_details(render, upgrade_list, view->indices[base_index + selection_index], arena, dbs_sync);
+    }
+    else if (render->detail_name_offset != ROW_BLANK)
+    {
+        render->detail_name_offset = ROW_BLANK;
+        clear_details(render);
+    }
+
+    for (int line = 0; line < FOOTER_LINE_COUNT; line++)
+    {
+        draw_footer_line(render, line, footer[line] != NULL ? footer[line] : "");
+    }
+
+    render_end_frame(render);
+}
+
+// Keep list pane
+// Lists the roots of the keep list, showing how many packages each one is the
+// only reason for keeping, so that they can be dropped from the list.
+
+// release_counts, if it isn't NULL, holds each entry's count from the daemon
+// (-1 if it isn't installed), in place of the closure
+void draw_keep_details(render_state_t *render, const pkg_name_list_t *keep_names, keep_closure_t *closure, const int *release_counts, const name_arena_t *arena, int keep_index)
+{
+    const uint32_t name_offset = keep_index < keep_names->size ? keep_names->names[keep_index].offset : ROW_BLANK;
+    if (render->detail_name_offset == name_offset)
+    {
+        return;
+    }
+
+    render->detail_name_offset = name_offset;
+    clear_details(render);
+
+    const int half_width = tb_width() / 2;
+    if (keep_index >= keep_names->size)
+    {
+        write_detail_str(render, half_width, 0, "The keep list is empty", TB_BOLD);
+    }
+    else
+    {
+        const pkg_name_t name = keep_names->names[keep_index];
+        write_detail_str(render, half_width, 0, name_arena_str(arena, name), TB_BOLD);
+
+        const int id = release_counts == NULL ? pkg_graph_find(closure->graph, name) : -1;
+        const bool is_installed = release_counts != NULL ? release_counts[keep_index] >= 0 : id >= 0;
+        if (!is_installed && pkg_matcher_is_pattern(name_arena_str(arena, name)))
+        {
+            write_detail_str(render, half_width, 2, "Pattern, matched against the installed packages", TB_DEFAULT);
+        }
+        else if (!is_installed)
+        {
+            write_detail_str(render, half_width, 2, "Not installed", TB_DEFAULT);
+        }
+        else
+        {
+            char count_str[80];
+            snprintf(count_str, sizeof(count_str), "%d",
+                     release_counts != NULL ? release_counts[keep_index] : keep_closure_release_count(closure, id));
+            write_detail_str(render, half_width, 2, "Only kept for this: ", TB_BOLD);
+            write_detail_str(render, half_width + strlen("Only kept for this: "), 2, count_str, TB_DEFAULT);
+        }
+    }
+
+    write_detail_str(render, half_width, 4, "d: stop keeping, Tab: back to upgrades", TB_DEFAULT);
+}
+
+void render_keep_frame(render_state_t *render, const pkg_name_list_t *keep_names, keep_closure_t *closure, const int *release_counts, const name_arena_t *arena, int base_index, int selection_index)
+{
+    render_begin_frame(render, base_index);
+
+    for (int row = 0; row < render->height; row++)
+    {
+        row_record_t record;
+        record.name_offset = ROW_BLANK;
+        record.fg = TB_DEFAULT;
+        record.is_annotated = false;
+
+        const char *name = "";
+        int len = 0;
+
+        if (base_index + row < keep_names->size)
+        {
+            const pkg_name_t keep_name = keep_names->names[base_index + row];
+            record.name_offset = keep_name.offset;
+            name = name_arena_str(arena, keep_name);
+            len = keep_name.size;
+
+            if (row == selection_index)
+            {
+                record.fg |= TB_REVERSE;
+            }
+        }
+
+        draw_row_record(render, row, record, name, len);
+    }
+
+    draw_keep_details(render, keep_names, closure, release_counts, arena, base_index + selection_index);
+
+    render_end_frame(render);
+}
+
+// Why pane
+// Shows the chain of packages through which the keep list holds a package,
+// from the keep root down to the package itself, along with what depends on
+// whichever package in that chain is selected.
+
+void draw_why_details(render_state_t *render, const why_path_t *path, const name_arena_t *arena, const char *target, int path_index)
+{
+    const pkg_name_list_t *names = path->names;
+    const uint32_t name_offset = path_index < names->size ? names->names[path_index].offset : ROW_BLANK;
+    if (render->detail_name_offset == name_offset)
+    {
+        return;
+    }
+
+    render->detail_name_offset = name_offset;
+    clear_details(render);
+
+    const int half_width = tb_width() / 2;
+    const int help_row = render->height - 1;
+    write_detail_str(render, half_width, help_row, "j/k: move along the path, Esc: back", TB_DEFAULT);
+
+    if (path_index >= names->size)
+    {
+        write_detail_str(render, half_width, 0, target, TB_BOLD);
+        write_detail_str(render, half_width, 2, "Not installed", TB_DEFAULT);
+        return;
+    }
+
+    write_detail_str(render, half_width, 0, name_arena_str(arena, names->names[path_index]), TB_BOLD);
+
+    if (path->is_kept[path_index])
+    {
+        write_detail_str(render, half_width, 2, "In the keep list", TB_DEFAULT);
+    }
+    else if (path->is_held)
+    {
+        write_detail_str(render, half_width, 2, "Needed by: ", TB_BOLD);
+        write_detail_str(render, half_width + strlen("Needed by: "), 2,
+                         name_arena_str(arena, names->names[path_index - 1]), TB_DEFAULT);
+        write_detail_str(render, half_width, 3, "Kept for: ", TB_BOLD);
+        write_detail_str(render, half_width + strlen("Kept for: "), 3, name_arena_str(arena, names->names[0]),
+                         TB_DEFAULT);
+    }
+    else
+    {
+        write_detail_str(render, half_width, 2, "Not held by the keep list", TB_DEFAULT);
+    }
+
+    const int rdep_start = path->required_by_offsets[path_index];
+    const int rdep_count = path->required_by_offsets[path_index + 1] - rdep_start;
+    char line[80];
+    snprintf(line, sizeof(line), "Required by (%d):", rdep_count);
+    write_detail_str(render, half_width, 5, line, TB_BOLD);
+
+    // Leave a blank row above the help
+    const int shown_count = min(rdep_count, max(0, help_row - 7));
+    for (int i = 0; i < shown_count; i++)
+    {
+        const bool is_last = i == shown_count - 1 && shown_count < rdep_count;
+        if (is_last)
+        {
+            snprintf(line, sizeof(line), "... and %d more", rdep_count - i);
+        }
+        write_detail_str(render, half_width + 2, 6 + i,
+                         is_last ? line : name_arena_str(arena, path->required_by->names[rdep_start + i]), TB_DEFAULT);
+    }
+}
+
+// Draws the path to a package, which is empty if target isn't installed
+void render_why_frame(render_state_t *render, const why_path_t *path, const name_arena_t *arena, const char *target, int base_index, int selection_index)
+{
+    render_begin_frame(render, base_index);
+
+    for (int row = 0; row < render->height; row++)
+    {
+        row_record_t record;
+        record.name_offset = ROW_BLANK;
+        record.fg = TB_DEFAULT;
+        record.is_annotated = false;
+
+        const char *name = "";
+        int len = 0;
+
+        if (base_index + row < path->names->size)
+        {
+            const pkg_name_t path_name = path->names->names[base_index + row];
+            record.name_offset = path_name.offset;
+            name = name_arena_str(arena, path_name);
+            len = path_name.size;
+
+            if (base_index + row == 0)
+            {
+                record.fg |= TB_BOLD;
+            }
+
+            if (row == selection_index)
+            {
+                record.fg |= TB_REVERSE;
+            }
+        }
+
+        draw_row_record(render, row, record, name, len);
+    }
+
+    draw_why_details(render, path, arena, target, base_index + selection_index);
 
+    render_end_frame(render);
+}
+
+// Prompts
+// The filter, the why pane and bulk selection read a line of input in the
+// status line.
+
+typedef enum _prompt_result
+{
+    PROMPT_EDITING,
+    PROMPT_ACCEPTED, // Enter was pressed
+    PROMPT_CANCELLED, // Esc was pressed, which also clears the input
+} prompt_result_t;
+
+// Applies a key to input, which has room for capacity characters (including
+// the NUL char)
+prompt_result_t prompt_handle_key(const struct tb_event *event, char *input, int *input_size, int capacity)
+{
+    const uint32_t ch = event->ch != 0 ? event->ch : event->key == TB_KEY_SPACE ? ' ' : 0;
+    prompt_result_t result = PROMPT_EDITING;
+
+    if (event->ch == 0 && event->key == TB_KEY_ENTER)
+    {
+        result = PROMPT_ACCEPTED;
+    }
+    else if (event->ch == 0 && event->key == TB_KEY_ESC)
+    {
+        result = PROMPT_CANCELLED;
+        *input_size = 0;
+    }
+    else if (event->ch == 0 && (event->key == TB_KEY_BACKSPACE || event->key == TB_KEY_BACKSPACE2))
+    {
+        *input_size = max(0, *input_size - 1);
+    }
+    // Only ASCII for now, since the details pane writes the prompt a byte per cell
+    else if (ch >= ' ' && ch < 127 && *input_size < capacity - 1)
+    {
+        input[(*input_size)++] = ch;
+    }
+
+    input[*input_size] = '\0';
+    return result;
+}
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [OPTION]...\n", program_name);
+    printf("Interactively select packages to upgrade, holding back the keep list.\n\n");
+    printf("  -c, --closure-stats  print how long the keep list's dependency closure took\n");
+    printf("                       and how many packages and edges it covered, then exit\n");
+    printf("  -s, --hash-stats     print the load and probe lengths of the package name\n");
+    printf("                       hash sets, then exit\n");
+    printf("  -l, --max-load=LOAD  grow name hash sets beyond LOAD (between 0.1 and 0.95,\n");
+    printf("                       default %.2f)\n", NAME_SET_DEFAULT_MAX_LOAD);
+    printf("  -j, --jobs=N         compare versions on N threads (default: one per CPU)\n");
+    printf("  -C, --no-cache       recompute the upgrade list even if the cached one is\n");
+    printf("                       up to date\n");
+    printf("      --config=PATH    read repos and ignored packages from PATH\n");
+    printf("                       (default: /etc/pacman.conf)\n");
+    printf("  -r, --root=PATH      override the RootDir from pacman.conf\n");
+    printf("  -b, --dbpath=PATH    override the DBPath from pacman.conf\n");
+    printf("  -R, --render-stats   print how many cells were written per frame on exit\n");
+    printf("  -n, --dry-run        compute the upgrade list and print its size, without\n");
+    printf("                       opening the terminal\n");
+    printf("  -o, --output=FORMAT  print the upgrade list to stdout instead of opening the\n");
+    printf("                       terminal, as FORMAT \"names\" (one per line) or \"ndjson\"\n");
+    printf("                       (name, old_version, new_version, isize and repo)\n");
+    printf("  -U, --unsorted       don't sort the upgrade list; with --output, print each\n");
+    printf("                       package as soon as it's found\n");
+    printf("  -S, --sort=MODE      sort by MODE: \"isize\" (installed size, the default),\n");
+    printf("                       \"dsize\" (download size), \"delta\" (installed size\n");
+    printf("                       change), \"name\" or \"repo\"; o cycles through them in\n");
+    printf("                       the terminal\n");
+    printf("  -t, --trace=FILE     time each startup phase, writing Chrome trace-event JSON\n");
+    printf("                       to FILE and a summary to stderr (or set LPS_TRACE=FILE)\n");
+    printf("  -d, --daemon         compute the upgrade list, then keep it in memory and\n");
+    printf("                       answer queries on a Unix socket until told to shut down\n");
+    printf("  -a, --attach         take the upgrade list from a running daemon, and make\n");
+    printf("                       keep list changes through it\n");
+    printf("      --socket=PATH    the daemon's socket (default: $XDG_RUNTIME_DIR/lps.sock,\n");
+    printf("                       or ~/.config/lps/lps.sock)\n");
+    printf("  -h, --help           display this help and exit\n");
+    printf("\nExit status is 0 if there are packages to upgrade, 20 if there are none,\n");
+    printf("2 for invalid options, and another non-zero value for other errors.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int err_return = 0;
+    int tb_err = 0;
+
+    // Lets wcwidth measure the display width of non-ASCII descriptions
+    setlocale(LC_CTYPE, "");
+
+    bool print_closure_stats = false;
+    bool print_hash_stats = false;
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    bool use_cache = true;
+    bool print_render_stats = false;
+    bool is_dry_run = false;
+    output_format_t output_format = OUTPUT_NONE;
+    bool is_sorted = true;
+    sort_mode_t sort_mode = SORT_INSTALLED_SIZE;
+    const char *pacman_config_path = "/etc/pacman.conf";
+    const char *root_dir_override = NULL;
+    const char *db_path_override = NULL;
+    const char *trace_path = getenv("LPS_TRACE");
+    bool is_daemon = false;
+    bool is_attached = false;
+    const char *socket_path_override = NULL;
+
+    static const struct option long_options[] = {
+        {"closure-stats", no_argument, NULL, 'c'},
+        {"hash-stats", no_argument, NULL, 's'},
+        {"max-load", required_argument, NULL, 'l'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"no-cache", no_argument, NULL, 'C'},
+        {"render-stats", no_argument, NULL, 'R'},
+        {"config", required_argument, NULL, 'f'},
+        {"root", required_argument, NULL, 'r'},
+        {"dbpath", required_argument, NULL, 'b'},
+        {"trace", required_argument, NULL, 't'},
+        {"dry-run", no_argument, NULL, 'n'},
+        {"output", required_argument, NULL, 'o'},
+        {"unsorted", no_argument, NULL, 'U'},
+        {"sort", required_argument, NULL, 'S'},
+        {"daemon", no_argument, NULL, 'd'},
+        {"attach", no_argument, NULL, 'a'},
+        {"socket", required_argument, NULL, 'P'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "csl:j:CRr:b:t:no:US:dah", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            print_closure_stats = true;
+            break;
+        case 's':
+            print_hash_stats = true;
+            break;
+        case 'l':
+            name_set_default_max_load = strtod(optarg, NULL);
+            if (name_set_default_max_load < 0.1 || name_set_default_max_load > 0.95)
+            {
+                fprintf(stderr, "%s: max load must be between 0.1 and 0.95\n", argv[0]);
+                return 2;
+            }
+            break;
+        case 'j':
+            thread_count = atoi(optarg);
+            if (thread_count < 1)
+            {
+                fprintf(stderr, "%s: the number of jobs must be at least 1\n", argv[0]);
+                return 2;
+            }
+            break;
+        case 'C':
+            use_cache = false;
+            break;
+        case 'R':
+            print_render_stats = true;
+            break;
+        case 'f':
+            pacman_config_path = optarg;
+            break;
+        case 'r':
+            root_dir_override = optarg;
+            break;
+        case 'b':
+            db_path_override = optarg;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'n':
+            is_dry_run = true;
+            break;
+        case 'o':
+            if (strcmp(optarg, "names") == 0)
+            {
+                output_format = OUTPUT_NAMES;
+            }
+            else if (strcmp(optarg, "ndjson") == 0)
+            {
+                output_format = OUTPUT_NDJSON;
+            }
+            else
+            {
+                fprintf(stderr, "%s: the output format must be names or ndjson\n", argv[0]);
+                return 2;
+            }
+            break;
+        case 'U':
+            is_sorted = false;
+            break;
+        case 'S':
+            sort_mode = SORT_MODE_COUNT;
+            for (int mode = 0; mode < SORT_MODE_COUNT; mode++)
+            {
+                if (strcmp(optarg, sort_mode_names[mode]) == 0)
+                {
+                    sort_mode = mode;
+                }
+            }
+
+            if (sort_mode == SORT_MODE_COUNT)
+            {
+                fprintf(stderr, "%s: the sort mode must be isize, dsize, delta, name or repo\n", argv[0]);
+                return 2;
+            }
+            break;
+        case 'd':
+            is_daemon = true;
+            break;
+        case 'a':
+            is_attached = true;
+            break;
+        case 'P':
+            socket_path_override = optarg;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (is_daemon && (is_attached || is_dry_run || output_format != OUTPUT_NONE || !is_sorted))
+    {
+        fprintf(stderr, "%s: --daemon can't be used with --attach, --dry-run, --output or --unsorted\n", argv[0]);
+        return 2;
+    }
+
+    if ((is_daemon || is_attached) && (print_closure_stats || print_hash_stats))
+    {
+        fprintf(stderr, "%s: --daemon and --attach can't be used with --closure-stats or --hash-stats\n", argv[0]);
+        return 2;
+    }
+
+    if (thread_count < 1)
+    {
+        thread_count = 1;
+    }
+
+    trace_init(trace_path);
+
+    keep_store_t *keep_store = NULL;
+    bool is_keep_save_failed = false;
+    name_arena_t *arena = name_arena_new();
+    pkg_name_list_t *keep_package_names = NULL; // As stored, where some entries may be patterns
+    pkg_name_list_t *keep_root_names = NULL; // With the patterns expanded, for the closure
+    pkg_name_list_t *unfound_package_names = NULL;
+    daemon_conn_t *daemon_conn = NULL; // With --attach
+    pkg_graph_t *graph = NULL;
+    keep_closure_t *closure = NULL;
+
+    pacman_config_t *pacman_config = NULL;
+    alpm_handle_t *handle = NULL;
     pkg_state_list_t *upgrade_list = NULL;
+    upgrade_cache_t *upgrade_cache = NULL;
+    name_set_t *previous_names = NULL;
+    upgrade_loader_t *loader = NULL;
+    pkg_state_list_t *loader_batch = NULL;
+    db_watcher_t *watcher = NULL;
+    annotator_t *annotator = NULL;
+    bool is_alpm_held = false; // Whether the UI thread holds alpm_mutex until it next waits for input
+    pkg_cache_index_t *pkg_cache = NULL;
+    bool is_cache_write_failed = false;
+    render_state_t *render = NULL;
+    pkg_filter_t *filter = NULL;
+    why_path_t *why_path = NULL;
+    int *keep_release_counts = NULL; // From the daemon, for the keep pane
+    unsigned long daemon_generation = 0; // Of the list and keep list fetched from the daemon
     alpm_errno_t alpm_errno = 0;
 
-    alpm_handle_t *handle = alpm_initialize("/", "/var/lib/pacman", &alpm_errno);
+    double phase_start_ms = get_time_ms();
+    pacman_config = pacman_config_new(arena, pacman_config_path);
+    trace_record("parse_pacman_conf", phase_start_ms, 0);
+    if (pacman_config == NULL)
+    {
+        err_return = 40;
+        goto exit;
+    }
+
+    const char *root_dir = root_dir_override != NULL ? root_dir_override : pacman_config->root_dir;
+    const char *db_path = db_path_override != NULL ? db_path_override : pacman_config->db_path;
+    phase_start_ms = get_time_ms();
+    handle = alpm_initialize(root_dir, db_path, &alpm_errno);
+    trace_record("alpm_initialize", phase_start_ms, 0);
+
+    if (alpm_errno != 0)
+    {
+        printf("errno: %d\n", alpm_errno);
+
+        // Apparently we don't need to free the result of alpm_strerror
+        const char *strerror = alpm_strerror(alpm_errno);
+        printf("strerror: %s\n", strerror);
+        err_return = 10;
+        goto exit;
+    }
+
+    alpm_db_t *localdb = alpm_get_localdb(handle);
+
+    phase_start_ms = get_time_ms();
+    pacman_config_register(pacman_config, handle, arena);
+
+    // Will contain all of the previously registered syncdbs
+    alpm_list_t *dbs_sync = alpm_get_syncdbs(handle);
+    trace_record("register_syncdbs", phase_start_ms, 0);
+
+    const char *home_path = getenv("HOME");
+    char config_dir_path[PATH_MAX];
+    char cache_path[PATH_MAX + 16];
+    snprintf(config_dir_path, sizeof(config_dir_path), "%s/.config/lps", home_path);
+    snprintf(cache_path, sizeof(cache_path), "%s/upgrade_cache", config_dir_path);
+
+    char socket_path[PATH_MAX + 16];
+    const char *runtime_dir_path = getenv("XDG_RUNTIME_DIR");
+    if (socket_path_override != NULL)
+    {
+        snprintf(socket_path, sizeof(socket_path), "%s", socket_path_override);
+    }
+    else if (runtime_dir_path != NULL && runtime_dir_path[0] != '\0')
+    {
+        snprintf(socket_path, sizeof(socket_path), "%s/lps.sock", runtime_dir_path);
+    }
+    else
+    {
+        snprintf(socket_path, sizeof(socket_path), "%s/lps.sock", config_dir_path);
+    }
+
+    struct stat s;
+    int stat_err = stat(config_dir_path, &s);
+    if (stat_err == -1)
+    {
+        if (errno == ENOENT)
+        {
+            if (mkdir(config_dir_path, 0755) == -1)
+            {
+                perror("Failed to create config directory");
+                err_return = 30;
+                goto exit;
+            }
+        }
+        else
+        {
+            perror("stat");
+            err_return = 31;
+            goto exit;
+        }
+    }
+    else if (!S_ISDIR(s.st_mode))
+    {
+        fprintf(stderr, "Config dir is not a directory");
+        err_return = 32;
+        goto exit;
+    }
 
-    if (alpm_errno != 0)
+    // An attached session gets the upgrade list from the daemon, which also
+    // owns the keep list until it exits
+    if (is_attached)
     {
-        printf("errno: %d\n", alpm_errno);
+        daemon_conn = daemon_conn_open(socket_path);
+        if (daemon_conn == NULL)
+        {
+            fprintf(stderr, "No lps daemon is listening on %s\n", socket_path);
+            err_return = 50;
+            goto exit;
+        }
+    }
 
-        // Apparently we don't need to free the result of alpm_strerror
-        const char *strerror = alpm_strerror(alpm_errno);
-        printf("strerror: %s\n", strerror);
-        err_return = 10;
-        goto exit;
+    phase_start_ms = get_time_ms();
+    if (daemon_conn != NULL)
+    {
+        char error[256];
+        keep_package_names = daemon_conn_fetch_keeps(daemon_conn, &keep_release_counts, arena, error, sizeof(error));
+        if (keep_package_names == NULL)
+        {
+            fprintf(stderr, "The daemon failed to list the keep list: %s\n", error);
+            err_return = 54;
+            goto exit;
+        }
+    }
+    else
+    {
+        keep_package_names = pkg_name_list_new(5);
+        keep_store = keep_store_open(config_dir_path, arena, keep_package_names);
+        if (keep_store == NULL)
+        {
+            err_return = 35;
+            goto exit;
+        }
     }
 
-    // TODO(Chris): Parse in /etc/pacman.conf to dynamically find out which syncdbs are enabled
-    alpm_db_t *localdb = alpm_get_localdb(handle);
-    alpm_db_t *core = alpm_register_syncdb(handle, "core", 0);
-    alpm_db_t *extra = alpm_register_syncdb(handle, "extra", 0);
-    alpm_db_t *community = alpm_register_syncdb(handle, "community", 0);
-    alpm_db_t *multilib = alpm_register_syncdb(handle, "multilib", 0);
-    // Will contain all of the previously registered syncdbs
-    alpm_list_t *dbs_sync = alpm_get_syncdbs(handle);
-    alpm_list_t *packages = alpm_db_get_pkgcache(localdb);
+    // Add default keep packages if the keep list is empty. They're saved like
+    // any other change, so that adding to the list doesn't drop them.
+    if (keep_package_names->size <= 0 && daemon_conn == NULL)
+    {
+        pkg_name_list_add(keep_package_names, name_arena_intern(arena, "pacman"));
+        pkg_name_list_add(keep_package_names, name_arena_intern(arena, "glibc"));
+        for (int i = 0; i < keep_package_names->size; i++)
+        {
+            is_keep_save_failed |= keep_store_record(keep_store, true, keep_package_names->names[i], arena) == -1;
+        }
+    }
 
-    if (core == NULL)
+    // A journal left over from an earlier session is folded in while the list loads
+    if (daemon_conn == NULL && (keep_store->journal_count >= KEEP_JOURNAL_COMPACT_COUNT || keep_store->has_old_journal))
     {
-        printf("core syncdb failed to register.\n");
-        err_return = 1;
-        goto exit;
+        is_keep_save_failed |= keep_store_compact(keep_store) == -1;
     }
+    trace_record("parse_keep_file", phase_start_ms, 0);
 
-    if (extra == NULL)
+    // The daemon expands the patterns for an attached session, which never
+    // reads the local db
+    keep_root_names = pkg_name_list_new(keep_package_names->size + 1);
+    if (daemon_conn == NULL)
     {
-        printf("extra syncdb failed to register.\n");
-        err_return = 1;
-        goto exit;
+        keep_roots_expand(keep_root_names, keep_package_names, localdb, dbs_sync, arena);
     }
 
-    if (community == NULL)
+    // The cache is only used if nothing that affects the upgrade list has
+    // changed since it was written
+    const uint64_t keep_hash = pacman_config_hash_list(FNV_OFFSET_BASIS, arena, keep_root_names);
+    const uint64_t cache_key = upgrade_cache_key(pacman_config->hash, db_path, dbs_sync, keep_hash);
+    upgrade_cache = upgrade_cache_open(cache_path);
+    upgrade_list = pkg_state_list_new(5);
+
+    upgrade_printer_t printer;
+    printer.format = output_format;
+    printer.file = stdout;
+    printer.localdb = localdb;
+    printer.dbs_sync = dbs_sync;
+    printer.arena = arena;
+    printer.printed_count = 0;
+
+    const bool is_cache_hit = daemon_conn == NULL && use_cache && !print_closure_stats && !print_hash_stats
+                              && upgrade_cache != NULL && upgrade_cache->header->key == cache_key;
+
+    // Without a usable cache, an interactive session opens the terminal first
+    // and fills the list in as the loader thread finds upgrades
+    const bool is_background_load = !is_cache_hit && daemon_conn == NULL && !is_daemon && is_sorted && output_format == OUTPUT_NONE && !is_dry_run
+                                    && !print_closure_stats && !print_hash_stats;
+
+    // The terminal shows download totals, which leave out cached packages, as
+    // does sorting by download size
+    if (!print_closure_stats && !print_hash_stats && (output_format == OUTPUT_NONE || sort_mode == SORT_DOWNLOAD_SIZE))
     {
-        printf("community syncdb failed to register.\n");
-        err_return = 1;
-        goto exit;
+        pkg_cache = pkg_cache_index_new(pacman_config->cache_dirs, arena);
     }
 
-    if (multilib == NULL)
+    if (daemon_conn != NULL)
     {
-        printf("multilib syncdb failed to register.\n");
-        err_return = 1;
-        goto exit;
+        char error[256];
+        int request_err = 0;
+        phase_start_ms = get_time_ms();
+        if (output_format != OUTPUT_NONE)
+        {
+            // The daemon prints the list itself, sorted as asked
+            char request[64];
+            snprintf(request, sizeof(request), "list %s %s", output_format == OUTPUT_NDJSON ? "ndjson" : "names",
+                     sort_mode_names[sort_mode]);
+            request_err = daemon_conn_request(daemon_conn, request, on_output_line, &printer.printed_count, error,
+                                              sizeof(error));
+        }
+        else
+        {
+            // The generation comes first, so that a change made meanwhile is fetched again
+            request_err = daemon_conn_request(daemon_conn, "generation", on_generation_line, &daemon_generation,
+                                              error, sizeof(error));
+            if (request_err == 0)
+            {
+                request_err = daemon_conn_fetch_list(daemon_conn, upgrade_list, arena, error, sizeof(error));
+            }
+        }
+        trace_record("daemon_list", phase_start_ms, 0);
+
+        if (request_err == -1)
+        {
+            fprintf(stderr, "The daemon failed to list the upgrades: %s\n", error);
+            err_return = 51;
+            goto exit;
+        }
+
+        if (pkg_cache != NULL)
+        {
+            pkg_cache_mark(pkg_cache, arena, upgrade_list, thread_count);
+        }
+
+        if (is_sorted)
+        {
+            phase_start_ms = get_time_ms();
+            pkg_state_list_sort(upgrade_list, sort_mode, arena, NULL);
+            trace_record("sort", phase_start_ms, 0);
+        }
     }
+    else if (is_cache_hit)
+    {
+        phase_start_ms = get_time_ms();
+        upgrade_cache_load(upgrade_cache, arena, upgrade_list);
+        trace_record("load_upgrade_cache", phase_start_ms, 0);
 
-    const char *home_path = getenv("HOME");
-    char config_path[200];
-    char config_dir_path[200];
-    snprintf(config_path, 200, "%s/.config/lps/keep_packages", home_path);
-    snprintf(config_dir_path, 200, "%s/.config/lps", home_path);
+        if (pkg_cache != NULL)
+        {
+            pkg_cache_mark(pkg_cache, arena, upgrade_list, thread_count);
+        }
 
-    struct stat s;
-    int stat_err = stat(config_dir_path, &s);
-    if (stat_err == -1)
+        // The cache may have been sorted by another mode
+        if (is_sorted)
+        {
+            phase_start_ms = get_time_ms();
+            pkg_state_list_sort(upgrade_list, sort_mode, arena, NULL);
+            trace_record("sort", phase_start_ms, 0);
+        }
+    }
+    else if (is_background_load)
     {
-        if (errno == ENOENT)
+        previous_names = upgrade_cache_names(upgrade_cache, arena);
+    }
+    else
+    {
+        const double graph_start_ms = get_time_ms();
+        graph = pkg_graph_new(localdb, arena);
+        const double graph_end_ms = get_time_ms();
+        trace_record("build_graph", graph_start_ms, 0);
+
+        unfound_package_names = pkg_name_list_new(5); // TODO(Chris): Do something with the unfound packages?
+        closure = keep_closure_new(graph);
+        int closure_edges = 0;
+        const double closure_start_ms = get_time_ms();
+        const int closure_nodes = keep_closure_add_names(closure, keep_root_names, unfound_package_names,
+                                                         &closure_edges);
+        const double closure_end_ms = get_time_ms();
+        trace_record("dependency_closure", closure_start_ms, 0);
+
+        if (print_closure_stats)
         {
-            if (mkdir(config_dir_path, 0755) == -1)
+            const int root_count = keep_root_names->size - unfound_package_names->size;
+            printf("graph: %d packages, %d edges (%d through provides), built in %.3f ms\n",
+                   graph->size, graph->edge_count, graph->provided_edge_count, graph_end_ms - graph_start_ms);
+            printf("closure: %d roots (%d not installed), %d packages, %d edges, computed in %.3f ms\n",
+                   root_count, unfound_package_names->size, closure_nodes, closure_edges,
+                   closure_end_ms - closure_start_ms);
+        }
+
+        if (print_hash_stats)
+        {
+            name_set_print_stats(stdout, "interned names", arena->index);
+            name_set_print_stats(stdout, "package ids", graph->ids);
+            name_set_print_stats(stdout, "provided names", graph->provides->slots);
+        }
+
+        if (print_closure_stats || print_hash_stats)
+        {
+            pkg_name_list_free(unfound_package_names);
+            goto exit;
+        }
+
+        /// Initialize packages to upgrade
+
+        phase_start_ms = get_time_ms();
+        find_upgrades(handle, graph, arena, closure->held, dbs_sync, thread_count, upgrade_list,
+                      output_format != OUTPUT_NONE && !is_sorted ? &printer : NULL, NULL);
+        trace_record("version_scan", phase_start_ms, 0);
+
+        pkg_name_list_free(unfound_package_names);
+
+        if (pkg_cache != NULL)
+        {
+            pkg_cache_mark(pkg_cache, arena, upgrade_list, thread_count);
+        }
+
+        // The cache only ever holds a sorted list
+        if (is_sorted)
+        {
+            phase_start_ms = get_time_ms();
+            pkg_state_list_sort(upgrade_list, sort_mode, arena, NULL);
+            trace_record("sort", phase_start_ms, 0);
+
+            upgrade_cache_mark_new(upgrade_cache, arena, upgrade_list);
+
+            if (upgrade_cache_write(cache_path, cache_key, arena, upgrade_list) == -1)
             {
-                perror("Failed to create config directory");
-                err_return = 30;
-                goto exit;
+                perror("Failed to write upgrade cache");
             }
         }
-        else
+    }
+
+    upgrade_cache_close(upgrade_cache);
+    upgrade_cache = NULL;
+
+    if (is_daemon)
+    {
+        ensure_keep_closure(&graph, &closure, localdb, arena, keep_root_names);
+
+        daemon_state_t daemon_state;
+        memset(&daemon_state, 0, sizeof(daemon_state));
+        pthread_mutex_init(&daemon_state.lock, NULL);
+        daemon_state.handle = handle;
+        daemon_state.localdb = localdb;
+        daemon_state.dbs_sync = dbs_sync;
+        daemon_state.arena = arena;
+        daemon_state.graph = graph;
+        daemon_state.closure = closure;
+        daemon_state.upgrade_list = upgrade_list;
+        daemon_state.pkg_cache = pkg_cache;
+        daemon_state.sort_mode = sort_mode;
+        daemon_state.keep_store = keep_store;
+        daemon_state.keep_names = keep_package_names;
+        daemon_state.keep_roots = keep_root_names;
+        daemon_state.watcher = db_watcher_new(db_path, config_dir_path);
+        daemon_state.root_dir = root_dir;
+        daemon_state.db_path = db_path;
+        daemon_state.pacman_config = pacman_config;
+        daemon_state.thread_count = thread_count;
+
+        daemon_state.listen_fd = daemon_listen(socket_path);
+        if (daemon_state.listen_fd == -1)
         {
-            perror("stat");
-            err_return = 31;
+            fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+            err_return = 52;
             goto exit;
         }
+
+        fprintf(stderr, "Listening on %s\n", socket_path);
+        const int serve_err = daemon_serve(&daemon_state);
+        if (serve_err == -1)
+        {
+            perror("poll");
+            err_return = 53;
+        }
+
+        // A refresh may have replaced any of these
+        handle = daemon_state.handle;
+        graph = daemon_state.graph;
+        closure = daemon_state.closure;
+
+        close(daemon_state.listen_fd);
+        unlink(socket_path);
+        db_watcher_free(daemon_state.watcher);
+        pthread_mutex_destroy(&daemon_state.lock);
+        is_keep_save_failed |= daemon_state.is_keep_save_failed;
+        goto exit;
     }
-    else if (!S_ISDIR(s.st_mode))
+
+    // Used by the benchmark, so this has to run the same pipeline
+    // as an interactive session up to the point where the terminal is opened
+    if (is_dry_run)
+    {
+        printf("%d packages to upgrade\n", upgrade_list->size);
+        goto exit;
+    }
+
+    // Anything streamed during the scan has already been printed
+    if (output_format != OUTPUT_NONE)
+    {
+        for (int i = printer.printed_count; i < upgrade_list->size; i++)
+        {
+            upgrade_printer_print(&printer, upgrade_list, i);
+        }
+        fflush(stdout);
+    }
+
+    if (upgrade_list->size <= 0 && printer.printed_count <= 0 && !is_background_load)
+    {
+        err_return = 20;
+        fprintf(stderr, "There are no currently packages to upgrade. Try `sudo pacman -Sy` or removing packages from the keep list.\n");
+        goto exit;
+    }
+
+    if (output_format != OUTPUT_NONE)
     {
-        fprintf(stderr, "Config dir is not a directory");
-        err_return = 32;
         goto exit;
     }
 
-    // TODO(Chris): Avoid using "a+" to create the file, even if it does
-    // NOTE(Chris): Use "a+" as an easy way to create the file, even if it doesn't exist
-    keep_file = fopen(config_path, "a+");
-    if (keep_file == NULL)
+    phase_start_ms = get_time_ms();
+    tb_err = tb_init();
+    trace_record("tb_init", phase_start_ms, 0);
+
+    if (tb_err < 0)
     {
-        perror("Failed to open config file");
-        err_return = 35;
+        printf("Failed to initialize termbox\n");
+        err_return = 100;
         goto exit;
     }
 
-    keep_package_names = pkg_name_list_new(5);
+    /// Main input loop
+
+    render = render_state_new(arena);
+    filter = pkg_filter_new();
+
+    char status[FILTER_MAX_QUERY + 64];
+    if (is_background_load)
+    {
+        loader = upgrade_loader_start(handle, localdb, dbs_sync, arena, keep_root_names, thread_count, previous_names);
+        if (loader == NULL)
+        {
+            err_return = 16;
+            goto exit_tb;
+        }
+
+        previous_names = NULL;
+        loader_batch = pkg_state_list_new(5);
+        filter->alpm_lock = &alpm_mutex;
+    }
+
+    // An attached session's list belongs to the daemon
+    if (daemon_conn == NULL)
+    {
+        watcher = db_watcher_new(db_path, config_dir_path);
+    }
+
+    // Without columns, the list works as before, so failing to start the annotator isn't fatal
+    if (loader == NULL)
+    {
+        pthread_mutex_lock(&alpm_mutex);
+        is_alpm_held = true;
+        annotator = annotator_start(localdb, dbs_sync, arena);
+    }
+
+    // Every key but q works on the packages in view, which are the whole
+    // upgrade list unless it's filtered. base_index and selection_index are
+    // positions in view.
+    pkg_view_t *view = filter->view;
+    pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+    char filter_input[FILTER_MAX_QUERY]; // The query as typed
+    int filter_input_size = 0;
+    bool is_filter_prompt = false; // Whether keys are being typed into the query
+    char why_input[FILTER_MAX_QUERY]; // The package the why pane was asked about
+    int why_input_size = 0;
+    bool is_why_prompt = false;
+    char match_input[FILTER_MAX_QUERY]; // The pattern for + or -
+    int match_input_size = 0;
+    bool is_match_prompt = false;
+    bool is_match_select = false; // Whether the pattern selects (+) or deselects (-)
+    char status_notice[FILTER_MAX_QUERY + 64] = ""; // The outcome of + or -, or a refresh, shown until the next key
+
+    int selection_index = 0;
+    int base_index = 0;
+    bool is_keep_pane = false; // Whether the keep list is shown instead of the upgrade list
+    int keep_selection_index = 0;
+    int keep_base_index = 0;
+    bool is_why_pane = false;
+    int why_selection_index = 0;
+    int why_base_index = 0;
+    double daemon_polled_ms = get_time_ms();
+    bool is_daemon_lost = false; // Once the daemon stops answering, the list is left as it is
+    const char *loading_phase = NULL;
+    double loading_progress = 0;
     while (true)
     {
-        pkg_name_t *new_name = pkg_name_new(keep_package_names);
-        char *result = fgets(new_name->name, MAX_PACKAGE_NAME_SIZE, keep_file);
-        if (result == NULL)
+        // Merge in whatever the loader has found since the last frame
+        if (loader != NULL)
+        {
+            const bool is_loaded = upgrade_loader_take(loader, &loader_batch, &loading_phase, &loading_progress);
+
+            if (loader_batch->size > 0)
+            {
+                const int cursor_index = base_index + selection_index;
+                pkg_cache_mark(pkg_cache, arena, loader_batch, thread_count);
+                pkg_state_list_sort(loader_batch, sort_mode, arena, NULL);
+                int tracked_index = cursor_index < view->size ? view->indices[cursor_index] : -1;
+                pkg_state_list_merge_sorted(upgrade_list, loader_batch, arena, &tracked_index);
+                loader_batch->size = 0;
+
+                // Keep the cursor on the same package, and on the same row of the screen if possible
+                pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+                pkg_view_track(view, tracked_index, &base_index, &selection_index);
+            }
+
+            if (is_loaded)
+            {
+                upgrade_loader_join(loader, false);
+                graph = loader->graph;
+                closure = loader->closure;
+                upgrade_loader_free(loader);
+                loader = NULL;
+                filter->alpm_lock = NULL;
+                render_invalidate(render);
+
+                pthread_mutex_lock(&alpm_mutex);
+                is_alpm_held = true;
+                annotator = annotator_start(localdb, dbs_sync, arena);
+
+                is_cache_write_failed = upgrade_cache_write(cache_path, cache_key, arena, upgrade_list) == -1;
+
+                if (upgrade_list->size <= 0)
+                {
+                    err_return = 20;
+                    goto exit_tb;
+                }
+            }
+        }
+
+        // Pick up archives that have been downloaded (or cleaned out) since the index was read
+        if (pkg_cache_index_is_stale(pkg_cache))
+        {
+            pkg_cache_index_read(pkg_cache);
+            pkg_cache_mark(pkg_cache, arena, upgrade_list, thread_count);
+
+            if (sort_mode == SORT_DOWNLOAD_SIZE)
+            {
+                const int cursor_index = base_index + selection_index;
+                int tracked_index = cursor_index < view->size ? view->indices[cursor_index] : -1;
+                pkg_state_list_sort(upgrade_list, sort_mode, arena, &tracked_index);
+                pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+                pkg_view_track(view, tracked_index, &base_index, &selection_index);
+            }
+
+            render_invalidate(render);
+        }
+
+        // Events are left queued while the loader owns the graph and the arena
+        int watch_changes = 0;
+        int first_changed_repo = -1;
+        if (watcher != NULL && loader == NULL)
+        {
+            db_watcher_read(watcher, arena);
+            watch_changes = db_watcher_take(watcher, dbs_sync, arena, &first_changed_repo);
+        }
+
+        if (watch_changes != 0)
+        {
+            phase_start_ms = get_time_ms();
+            bool is_list_stale = (watch_changes & (WATCH_SYNC | WATCH_LOCAL)) != 0;
+            bool is_keep_changed = false;
+
+            // Writes made by this session show up too, but leave the list as it
+            // is. The store isn't reopened, since closing the journal would
+            // itself look like another change.
+            if (watch_changes & WATCH_KEEP)
+            {
+                pkg_name_list_t *stored_names = pkg_name_list_new(keep_package_names->size + 1);
+                if (keep_store_reload(keep_store, arena, stored_names) == -1)
+                {
+                    snprintf(status_notice, sizeof(status_notice), "Failed to read the keep list again");
+                    pkg_name_list_free(stored_names);
+                }
+                else if (!pkg_name_list_has_same_names(stored_names, keep_package_names, arena))
+                {
+                    pkg_name_list_free(keep_package_names);
+                    keep_package_names = stored_names;
+                    keep_selection_index = 0;
+                    keep_base_index = 0;
+                    is_list_stale = true;
+                    is_keep_changed = true;
+                }
+                else
+                {
+                    pkg_name_list_free(stored_names);
+                }
+            }
+
+            if (is_list_stale)
+            {
+                // The list is left as it is until the next change, if the
+                // databases can't be loaded
+                if (dbs_reload_changed(&handle, &graph, watch_changes, first_changed_repo, root_dir, db_path,
+                                       pacman_config, arena) == -1)
+                {
+                    snprintf(status_notice, sizeof(status_notice), "Failed to load the databases again");
+                    continue;
+                }
+                localdb = alpm_get_localdb(handle);
+                dbs_sync = alpm_get_syncdbs(handle);
+                if (annotator != NULL)
+                {
+                    annotator_clear(annotator, localdb, dbs_sync);
+                }
+
+                // A change to the syncdbs alone leaves the graph and the keep
+                // closure as they are, unless the keep list picks packages by
+                // repo, and only the packages it can affect are looked up again.
+                // Anything else scans every package again.
+                const bool is_closure_kept = closure != NULL && !(watch_changes & WATCH_LOCAL) && !is_keep_changed
+                                             && !keep_names_match_repos(keep_package_names, arena);
+                if (!is_closure_kept)
+                {
+                    // Patterns in the keep list match installed packages, and their repos
+                    if (closure != NULL)
+                    {
+                        keep_closure_free(closure);
+                        closure = NULL;
+                    }
+                    keep_root_names->size = 0;
+                    keep_roots_expand(keep_root_names, keep_package_names, localdb, dbs_sync, arena);
+                    ensure_keep_closure(&graph, &closure, localdb, arena, keep_root_names);
+                }
+
+                pkg_state_list_t *fresh = pkg_state_list_new(upgrade_list->size + 1);
+                // The scans lock alpm_mutex themselves, and the annotator has nothing queued meanwhile
+                pthread_mutex_unlock(&alpm_mutex);
+                if (is_closure_kept)
+                {
+                    find_upgrades_in_repos(handle, graph, arena, closure->held, dbs_sync, first_changed_repo,
+                                           upgrade_list, fresh);
+                }
+                else
+                {
+                    find_upgrades(handle, graph, arena, closure->held, dbs_sync, thread_count, fresh, NULL, NULL);
+                }
+                pthread_mutex_lock(&alpm_mutex);
+                const int cursor_index = base_index + selection_index;
+                int tracked_index = cursor_index < view->size ? view->indices[cursor_index] : -1;
+                const list_diff_t diff = pkg_state_list_apply(upgrade_list, fresh, arena, sort_mode, pkg_cache,
+                                                              &tracked_index);
+                pkg_state_list_free(fresh);
+                trace_record("live_refresh", phase_start_ms, 0);
+
+                // The why path and descriptions may have changed along with the versions
+                why_path_free(why_path);
+                why_path = NULL;
+                is_why_pane = false;
+                layout_cache_clear(render->layouts);
+
+                pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+                pkg_view_track(view, tracked_index, &base_index, &selection_index);
+                render_invalidate(render);
+
+                if (diff.added_count + diff.removed_count + diff.changed_count > 0)
+                {
+                    snprintf(status_notice, sizeof(status_notice), "Refreshed: %d new, %d gone, %d changed",
+                             diff.added_count, diff.removed_count, diff.changed_count);
+                }
+            }
+            continue;
+        }
+
+        // An attached session asks for the daemon's generation instead, and
+        // fetches the list and the keep list again once it has moved on
+        if (daemon_conn != NULL && !is_daemon_lost && get_time_ms() - daemon_polled_ms >= WATCH_POLL_MS)
+        {
+            daemon_polled_ms = get_time_ms();
+            char error[256];
+            unsigned long generation = daemon_generation;
+            pkg_state_list_t *fresh = NULL;
+            pkg_name_list_t *fresh_keep_names = NULL;
+            int *fresh_release_counts = NULL;
+
+            is_daemon_lost = daemon_conn_request(daemon_conn, "generation", on_generation_line, &generation, error,
+                                                 sizeof(error)) == -1;
+            if (!is_daemon_lost && generation != daemon_generation)
+            {
+                phase_start_ms = get_time_ms();
+                fresh = pkg_state_list_new(upgrade_list->size + 1);
+                is_daemon_lost = daemon_conn_fetch_list(daemon_conn, fresh, arena, error, sizeof(error)) == -1;
+                if (!is_daemon_lost)
+                {
+                    fresh_keep_names = daemon_conn_fetch_keeps(daemon_conn, &fresh_release_counts, arena, error,
+                                                               sizeof(error));
+                    is_daemon_lost = fresh_keep_names == NULL;
+                }
+            }
+
+            if (is_daemon_lost)
+            {
+                snprintf(status_notice, sizeof(status_notice), "Lost the daemon: %s", error);
+            }
+            else if (fresh != NULL)
+            {
+                daemon_generation = generation;
+                if (annotator != NULL)
+                {
+                    annotator_clear(annotator, localdb, dbs_sync);
+                }
+
+                const int cursor_index = base_index + selection_index;
+                int tracked_index = cursor_index < view->size ? view->indices[cursor_index] : -1;
+                const list_diff_t diff = pkg_state_list_apply(upgrade_list, fresh, arena, sort_mode, pkg_cache,
+                                                              &tracked_index);
+                trace_record("live_refresh", phase_start_ms, 0);
+
+                pkg_name_list_free(keep_package_names);
+                free(keep_release_counts);
+                keep_package_names = fresh_keep_names;
+                keep_release_counts = fresh_release_counts;
+                fresh_keep_names = NULL;
+
+                // The keep list may be shorter now
+                keep_base_index = max(0, min(keep_base_index, keep_package_names->size - 1));
+                keep_selection_index = max(0, min(keep_selection_index,
+                                                  keep_package_names->size - 1 - keep_base_index));
+
+                why_path_free(why_path);
+                why_path = NULL;
+                is_why_pane = false;
+                layout_cache_clear(render->layouts);
+
+                pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+                pkg_view_track(view, tracked_index, &base_index, &selection_index);
+                render_invalidate(render);
+
+                if (diff.added_count + diff.removed_count + diff.changed_count > 0)
+                {
+                    snprintf(status_notice, sizeof(status_notice), "Refreshed: %d new, %d gone, %d changed",
+                             diff.added_count, diff.removed_count, diff.changed_count);
+                }
+            }
+
+            if (fresh != NULL)
+            {
+                pkg_state_list_free(fresh);
+            }
+            pkg_name_list_free(fresh_keep_names);
+        }
+
+        const char *status_line = NULL;
+        if (is_why_prompt)
+        {
+            snprintf(status, sizeof(status), "Why is this held: %.*s_", why_input_size, why_input);
+            status_line = status;
+        }
+        else if (is_match_prompt)
+        {
+            snprintf(status, sizeof(status), "%s matching: %.*s_", is_match_select ? "Select" : "Deselect",
+                     match_input_size, match_input);
+            status_line = status;
+        }
+        else if (status_notice[0] != '\0')
+        {
+            status_line = status_notice;
+        }
+        else if (is_filter_prompt || filter_input_size > 0)
+        {
+            snprintf(status, sizeof(status), "/%.*s%s (%d of %d)", filter_input_size, filter_input,
+                     is_filter_prompt ? "_" : "", view->size, upgrade_list->size);
+            status_line = status;
+        }
+        else if (loader != NULL)
+        {
+            snprintf(status, sizeof(status), "Loading: %s (%d%%), %d found", loading_phase,
+                     (int)(loading_progress * 100), upgrade_list->size);
+            status_line = status;
+        }
+        else if (sort_mode != SORT_INSTALLED_SIZE)
+        {
+            snprintf(status, sizeof(status), "Sorted by %s", sort_mode_labels[sort_mode]);
+            status_line = status;
+        }
+
+        download_totals_t totals;
+        download_totals_get(&totals, upgrade_list);
+        char size_str[50];
+        char totals_line[128];
+        char selected_line[128];
+        read_size(size_str, sizeof(size_str), totals.size);
+        snprintf(totals_line, sizeof(totals_line), "Total: %d packages, %s to download (%d cached)",
+                 totals.count, size_str, totals.cached_count);
+        read_size(size_str, sizeof(size_str), totals.selected_size);
+        snprintf(selected_line, sizeof(selected_line), "Selected: %d packages, %s to download",
+                 totals.selected_count, size_str);
+        const char *footer[FOOTER_LINE_COUNT] = {status_line, totals.selected_count > 0 ? selected_line : NULL, totals_line};
+
+        // Recalculate selection_index in case of window resizing
+        const int bottom_line = tb_height() - 1;
+        if (selection_index >= bottom_line)
+        {
+            selection_index = bottom_line;
+        }
+
+        int poll_err = 0;
+        const int pkg_index = base_index + selection_index;
+        const int list_index = pkg_index < view->size ? view->indices[pkg_index] : -1;
+        int view_height = min(tb_height(), view->size - base_index);
+
+        phase_start_ms = get_time_ms();
+        bool is_annotation_pending = false;
+        if (is_keep_pane)
+        {
+            render_keep_frame(render, keep_package_names, closure, keep_release_counts, arena, keep_base_index,
+                              keep_selection_index);
+        }
+        else if (is_why_pane)
+        {
+            render_why_frame(render, why_path, arena, why_input, why_base_index, why_selection_index);
+        }
+        else
+        {
+            // The details pane looks packages up in the syncdbs, which the loader may be using
+            const bool is_locking = loader != NULL && view->size > 0;
+            if (is_locking)
+            {
+                pthread_mutex_lock(&alpm_mutex);
+            }
+            // The columns only fit a wide enough list pane
+            annotator_t *columns = tb_width() / 2 > ANNOTATION_MIN_WIDTH ? annotator : NULL;
+            render_frame(render, upgrade_list, view, arena, columns, dbs_sync, base_index, selection_index, footer);
+            if (is_locking)
+            {
+                pthread_mutex_unlock(&alpm_mutex);
+            }
+
+            if (columns != NULL)
+            {
+                is_annotation_pending = annotator_request(columns, upgrade_list, view, base_index, tb_height());
+            }
+        }
+        if (render->frame_count == 1)
         {
-            keep_package_names->size--; // Remove the last allocated item
-            break;
+            trace_record("first_present", phase_start_ms, 0);
         }
 
-        new_name->size = strlen(new_name->name) + 1;
-
-        if (new_name->name[new_name->size - 2] == '\n')
+        // While loading, wake up regularly to show the loader's progress. The
+        // annotator only gets to run while this waits.
+        struct tb_event event;
+        if (is_alpm_held)
         {
-            new_name->name[new_name->size - 2] = '\0';
-            new_name->size--;
+            pthread_mutex_unlock(&alpm_mutex);
         }
-
-        // printf("%s\n", new_name->name);
-    }
-
-    // Add default keep packages if none were read in from file
-    if (keep_package_names->size <= 0)
-    {
-        snprintf(pkg_name_new(keep_package_names)->name, MAX_PACKAGE_NAME_SIZE, "pacman");
-        snprintf(pkg_name_new(keep_package_names)->name, MAX_PACKAGE_NAME_SIZE, "glibc");
-    }
-
-    dependencies_set = name_set_new();
-    // name_set_add_dependencies(dependencies_set, localdb, "gnome-desktop");
-
-    // alpm_pkg_t *systemd = alpm_db_get_pkg(localdb, "systemd");
-    // alpm_list_t *system_deps = alpm_pkg_get_depends(systemd);
-    // printf("systemd deps: ");
-    // for (alpm_list_t *curr = system_deps; curr != NULL; curr = curr->next)
-    // {
-    //     alpm_depend_t *dependency = (alpm_depend_t *)curr->data;
-    //     printf("%s ", dependency->name);
-    // }
-    // printf("\n");
-
-    unfound_package_names = pkg_name_list_new(5); // TODO(Chris): Do something with the unfound packages?
-    for (int i = 0; i < keep_package_names->size; i++)
-    {
-        pkg_name_t *pkg_name = &keep_package_names->names[i];
-        alpm_pkg_t *pkg = alpm_db_get_pkg(localdb, keep_package_names->names[i].name);
-
-        if (pkg == NULL)
+        if (loader != NULL)
+        {
+            poll_err = tb_peek_event(&event, 50);
+        }
+        else if (is_annotation_pending)
         {
-            pkg_name_t *new_name = pkg_name_new(unfound_package_names);
-            *new_name = *pkg_name;
+            poll_err = tb_peek_event(&event, ANNOTATION_POLL_MS);
         }
         else
         {
-            // printf("keep_package_names: %s\n", keep_package_names->names[i].name);
-            name_set_add_dependencies(dependencies_set, localdb, pkg_name->name);
-            // name_set_add_cpy(dependencies_set, pkg_name);
+            const bool is_watching = watcher != NULL || (daemon_conn != NULL && !is_daemon_lost);
+            poll_err = is_watching ? tb_peek_event(&event, WATCH_POLL_MS) : tb_poll_event(&event);
+        }
+        if (is_alpm_held)
+        {
+            pthread_mutex_lock(&alpm_mutex);
         }
-    }
 
-    // printf("size: %lu\n", dependencies_set->size);
-    // for (int i = 0; i < dependencies_set->capacity; i++)
-    // {
-    //     if (dependencies_set->items[i].is_taken)
-    //     {
-    //         printf(" true: %s\n", dependencies_set->items[i].pkg_name.name);
-    //     }
-    //     else
-    //     {
-    //         printf("false:\n");
-    //     }
-    // }
+        if (poll_err == -1)
+        {
+            err_return = 15;
+            goto exit_tb;
+        }
 
-    // pkg_name_t test_name = {"qtcreator", 10};
-    // printf("qtcreator: %s\n", name_set_has(dependencies_set, &test_name) ? "true" : "false");
+        if (poll_err == 0)
+        {
+            continue;
+        }
 
-    // pkg_name_t test_name = {"systemd", 8};
-    // printf("%s: %s\n", test_name.name, name_set_has(dependencies_set, &test_name) ? "true" : "false");
+        if (event.type == TB_EVENT_KEY && is_filter_prompt)
+        {
+            if (prompt_handle_key(&event, filter_input, &filter_input_size, FILTER_MAX_QUERY) != PROMPT_EDITING)
+            {
+                is_filter_prompt = false;
+            }
 
-    /// Initialize packages to upgrade
+            pkg_filter_set_query(filter, filter_input, upgrade_list, arena, dbs_sync);
+            pkg_view_track(view, list_index, &base_index, &selection_index);
+            continue;
+        }
 
-    upgrade_list = pkg_state_list_new(5);
-    for (alpm_list_t *curr = packages; curr != NULL; curr = curr->next)
-    {
-        alpm_pkg_t *package = (alpm_pkg_t *)curr->data;
-        alpm_pkg_t *new_version = alpm_sync_get_new_version(package, dbs_sync);
-        if (new_version != NULL)
+        if (event.type == TB_EVENT_KEY)
         {
-            const char *raw_name = alpm_pkg_get_name(package);
-            pkg_name_t pkg_name;
-            snprintf(pkg_name.name, MAX_PACKAGE_NAME_SIZE, "%s", raw_name);
-            pkg_name.size = strlen(raw_name) + 1;
+            status_notice[0] = '\0';
+        }
 
-            if (!name_set_has(dependencies_set, &pkg_name))
+        if (event.type == TB_EVENT_KEY && is_match_prompt)
+        {
+            const prompt_result_t result = prompt_handle_key(&event, match_input, &match_input_size, FILTER_MAX_QUERY);
+            if (result == PROMPT_CANCELLED)
             {
-                pkg_state_list_add_pkg(upgrade_list, new_version);
-                // printf("%s\n", alpm_pkg_get_name(new_version));
+                is_match_prompt = false;
             }
-        }
-    }
-
-    name_set_free(dependencies_set);
-    pkg_name_list_free(unfound_package_names);
+            else if (result == PROMPT_ACCEPTED)
+            {
+                is_match_prompt = false;
 
-    qsort(upgrade_list->ary, upgrade_list->size, sizeof(pkg_state_t), compare_pkg_states);
+                pkg_matcher_t *matcher = match_input_size > 0 ? pkg_matcher_new(match_input, dbs_sync) : NULL;
+                if (matcher != NULL)
+                {
+                    const int match_count = pkg_state_list_select_matching(upgrade_list, matcher, arena, is_match_select);
+                    snprintf(status_notice, sizeof(status_notice), "%s %d packages matching %s",
+                             is_match_select ? "Selected" : "Deselected", match_count, match_input);
+                    pkg_matcher_free(matcher);
+                }
+                else if (match_input_size > 0)
+                {
+                    snprintf(status_notice, sizeof(status_notice), "Not a valid pattern: %s", match_input);
+                }
+            }
+            continue;
+        }
 
-    if (upgrade_list->size <= 0)
-    {
-        err_return = 20;
-        fprintf(stderr, "There are no currently packages to upgrade. Try `sudo pacman -Sy` or removing packages from the keep list.");
-        goto exit;
-    }
+        if (event.type == TB_EVENT_KEY && is_why_prompt)
+        {
+            const prompt_result_t result = prompt_handle_key(&event, why_input, &why_input_size, FILTER_MAX_QUERY);
+            if (result == PROMPT_CANCELLED)
+            {
+                is_why_prompt = false;
+            }
+            else if (result == PROMPT_ACCEPTED)
+            {
+                is_why_prompt = false;
 
-    tb_err = tb_init();
+                // Without a name, explain the package under the cursor
+                if (why_input_size == 0 && list_index >= 0)
+                {
+                    snprintf(why_input, sizeof(why_input), "%s", name_arena_str(arena, upgrade_list->names[list_index]));
+                }
 
-    if (tb_err < 0)
-    {
-        printf("Failed to initialize termbox\n");
-        err_return = 100;
-        goto exit;
-    }
+                if (why_input[0] != '\0')
+                {
+                    if (why_path == NULL)
+                    {
+                        why_path = why_path_new();
+                    }
 
-    /// Main input loop
+                    char error[256];
+                    if (daemon_conn != NULL)
+                    {
+                        if (daemon_conn_fetch_why(daemon_conn, why_path, why_input, arena, error, sizeof(error)) == -1)
+                        {
+                            snprintf(status_notice, sizeof(status_notice), "The daemon couldn't say why: %s", error);
+                            continue;
+                        }
+                    }
+                    else
+                    {
+                        ensure_keep_closure(&graph, &closure, localdb, arena, keep_root_names);
+                        const int id = name_set_get_id_cstr(graph->ids, why_input);
+                        if (id >= 0)
+                        {
+                            why_path_fill(why_path, closure, id);
+                        }
+                        else
+                        {
+                            why_path_clear(why_path);
+                        }
+                    }
+                    const int why_path_size = why_path->names->size;
 
-    int selection_index = 0;
-    int base_index = 0;
-    while (true)
-    {
-        // Recalculate selection_index in case of window resizing
-        const int bottom_line = tb_height() - 1;
-        if (selection_index >= bottom_line)
-        {
-            selection_index = bottom_line;
+                    // Start on the package itself, at the bottom of the path
+                    why_base_index = max(0, why_path_size - tb_height());
+                    why_selection_index = max(0, why_path_size - 1 - why_base_index);
+                    is_why_pane = true;
+                    render_invalidate(render);
+                }
+            }
+            continue;
         }
 
-        int poll_err = 0;
-        const int pkg_index = base_index + selection_index;
-        pkg_state_t *curr_pkg = &upgrade_list->ary[pkg_index];
-        const int half_width = tb_width() / 2;
-        int view_height = min(tb_height(), upgrade_list->size - base_index);
-        for (int i = 0; i < view_height; i++)
+        if (event.type == TB_EVENT_KEY && is_why_pane)
         {
-            const char *pkg_name = alpm_pkg_get_name(upgrade_list->ary[base_index + i].underlying_pkg);
-            const int len = strlen(pkg_name);
-
-            uint32_t fg = TB_DEFAULT;
+            const int path_index = why_base_index + why_selection_index;
 
-            if (upgrade_list->ary[base_index + i].is_selected)
+            if (event.ch == 'q')
             {
-                // If the background is bold, then the text blinks.
-                // So we only make the foreground bold.
-                fg = TB_YELLOW;
-                fg |= TB_BOLD;
+                goto exit_tb;
             }
-
-            if (i == selection_index)
+            else if ((event.ch == 0 && event.key == TB_KEY_ESC) || event.ch == 'y')
             {
-                fg |= TB_REVERSE;
+                is_why_pane = false;
+                render_invalidate(render);
             }
-
-            write_str(0, i, pkg_name, fg, TB_DEFAULT);
-            for (int col = len; col < half_width; col++)
+            else if (event.ch == 'j' && path_index < why_path->names->size - 1)
             {
-                tb_change_cell(col, i, ' ', fg, TB_DEFAULT);
+                if (why_selection_index == bottom_line)
+                {
+                    why_base_index++;
+                }
+                else
+                {
+                    why_selection_index++;
+                }
             }
-        }
-
-        const char *desc = alpm_pkg_get_desc(curr_pkg->underlying_pkg);
-        int curs_x = tb_width() / 2;
-        int curs_y = 0;
-        while (*desc != '\0')
-        {
-            char buf[80]; // Let's hope no words are longer than 80 characters
-
-            int chars_read = read_word(&desc, buf, 80);
-            if (curs_x + chars_read > tb_width())
+            else if (event.ch == 'k' && path_index > 0)
             {
-                curs_x = tb_width() / 2;
-                curs_y++;
+                if (why_selection_index == 0)
+                {
+                    why_base_index--;
+                }
+                else
+                {
+                    why_selection_index--;
+                }
             }
-            write_str(curs_x, curs_y, buf, TB_DEFAULT, TB_DEFAULT);
 
-            curs_x += chars_read;
+            continue;
         }
 
-        if (curs_y < 3)
+        if (event.type == TB_EVENT_KEY && is_keep_pane)
         {
-            curs_y = 3;
-        }
-        else
-        {
-            curs_y++;
-        }
+            const int keep_index = keep_base_index + keep_selection_index;
 
-        curs_x = tb_width() / 2;
-        write_str(curs_x, curs_y, "Installed Size: ", TB_BOLD, TB_DEFAULT);
-        curs_x += strlen("Installed Size: ");
-        char size_str[50];
-        // snprintf(size_str, 50, "%lu", alpm_pkg_get_isize(curr_pkg->underlying_pkg));
-        read_size(size_str, 50, alpm_pkg_get_isize(curr_pkg->underlying_pkg));
-        write_str(curs_x, curs_y, size_str, TB_DEFAULT, TB_DEFAULT);
+            if (event.ch == 0 && (event.key == TB_KEY_TAB || event.key == TB_KEY_ESC))
+            {
+                is_keep_pane = false;
+                render_invalidate(render);
+            }
+            else if (event.ch == 'q')
+            {
+                goto exit_tb;
+            }
+            else if (event.ch == 'j' && keep_index < keep_package_names->size - 1)
+            {
+                if (keep_selection_index == bottom_line)
+                {
+                    keep_base_index++;
+                }
+                else
+                {
+                    keep_selection_index++;
+                }
+            }
+            else if (event.ch == 'k' && keep_index > 0)
+            {
+                if (keep_selection_index == 0)
+                {
+                    keep_base_index--;
+                }
+                else
+                {
+                    keep_selection_index--;
+                }
+            }
+            else if (event.ch == 'd' && keep_index < keep_package_names->size && daemon_conn != NULL)
+            {
+                // The released packages, and the shorter keep list, arrive
+                // with the next fetch, which is made straight away
+                char error[256];
+                const pkg_name_t name = keep_package_names->names[keep_index];
+                pkg_name_list_t *released_names = pkg_name_list_new(5);
+                if (daemon_conn_keep_change(daemon_conn, false, name_arena_str(arena, name), released_names, arena,
+                                            error, sizeof(error)) == -1)
+                {
+                    snprintf(status_notice, sizeof(status_notice), "Failed to stop keeping %s: %s",
+                             name_arena_str(arena, name), error);
+                }
+                pkg_name_list_free(released_names);
+                daemon_polled_ms = 0;
+            }
+            else if (event.ch == 'd' && keep_index < keep_package_names->size)
+            {
+                const pkg_name_t name = keep_package_names->names[keep_index];
+                int *released_ids = malloc(sizeof(int) * (graph->size + 1));
+                const int released_count = keep_list_drop(keep_package_names, keep_root_names, keep_index, closure,
+                                                          dbs_sync, arena, released_ids);
+                is_keep_save_failed |= keep_store_record(keep_store, false, name, arena) == -1;
+
+                // Only the packages no other root needs are released, and they're merged
+                // into the upgrade list without scanning anything else
+                if (released_count > 0)
+                {
+                    int tracked_index = list_index;
+                    add_upgrades_of(handle, graph, arena, released_ids, released_count, dbs_sync, pkg_cache,
+                                    sort_mode, upgrade_list, &tracked_index, NULL);
 
-        tb_present();
+                    // Keep the upgrade list's cursor on the same package
+                    pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+                    pkg_view_track(view, tracked_index, &base_index, &selection_index);
+                }
+                free(released_ids);
 
-        struct tb_event event;
-        poll_err = tb_poll_event(&event);
+                if (keep_index >= keep_package_names->size && keep_index > 0)
+                {
+                    if (keep_selection_index > 0)
+                    {
+                        keep_selection_index--;
+                    }
+                    else
+                    {
+                        keep_base_index--;
+                    }
+                }
 
-        if (poll_err == -1)
-        {
-            err_return = 15;
-            goto exit_tb;
+                render_invalidate(render);
+            }
+
+            continue;
         }
 
         if (event.type == TB_EVENT_KEY)
@@ -707,14 +8628,14 @@ int main()
                 {
                 case TB_KEY_SPACE:
                 case TB_KEY_ENTER:
-                    if (true) // This is just here to get Qt Creator's formatting to work correctly
+                    if (list_index >= 0) // The list is empty until the loader finds something
                     {
-                        curr_pkg->is_selected = !curr_pkg->is_selected;
+                        pkg_state_list_set_selected(upgrade_list, list_index, !pkg_state_list_is_selected(upgrade_list, list_index));
 
                         // NOTE(Chris): This currently just copy-pastes the functionality of the 'j' key.
                         // We might want to make this a little more DRY in the future, but that might
                         // require making the whole input handling system more robust.
-                        if (base_index + selection_index < upgrade_list->size - 1)
+                        if (base_index + selection_index < view->size - 1)
                         {
                             if (selection_index == view_height - 1)
                             {
@@ -749,12 +8670,43 @@ int main()
                 case TB_KEY_CTRL_D:
                     base_index += tb_height() / 2;
 
-                    if (base_index >= upgrade_list->size - bottom_line)
+                    if (base_index >= view->size - bottom_line)
                     {
-                        base_index = upgrade_list->size - bottom_line - 1;
+                        base_index = view->size - bottom_line - 1;
 
                         selection_index += tb_height() / 2;
                     }
+
+                    // The list may not fill the screen yet
+                    if (base_index < 0)
+                    {
+                        base_index = 0;
+                    }
+                    selection_index = max(0, min(selection_index, view->size - 1 - base_index));
+                    break;
+                case TB_KEY_ESC:
+                    if (filter_input_size > 0)
+                    {
+                        filter_input_size = 0;
+                        filter_input[0] = '\0';
+                        pkg_filter_set_query(filter, filter_input, upgrade_list, arena, dbs_sync);
+                        pkg_view_track(view, list_index, &base_index, &selection_index);
+                    }
+                    break;
+                case TB_KEY_TAB:
+                    // The graph and closure belong to the loader until it's finished
+                    if (loader != NULL)
+                    {
+                        break;
+                    }
+
+                    // An attached session has the counts from the daemon already
+                    if (daemon_conn == NULL)
+                    {
+                        ensure_keep_closure(&graph, &closure, localdb, arena, keep_root_names);
+                    }
+                    is_keep_pane = true;
+                    render_invalidate(render);
                     break;
                 }
             }
@@ -765,7 +8717,7 @@ int main()
                 case 'q':
                     goto exit_tb;
                 case 'j':
-                    if (base_index + selection_index < upgrade_list->size - 1)
+                    if (base_index + selection_index < view->size - 1)
                     {
                         if (selection_index == view_height - 1)
                         {
@@ -791,101 +8743,261 @@ int main()
                     }
                     break;
                 case 'w':
-                    if (true)
+                    if (daemon_conn != NULL)
                     {
-                        // TODO(Chris): Improve the selection cursor changing so that it either
-                        // remains on the current package (if unselected) or moves to the closest
-                        // unselected package
-                        for (int i = 0; i < upgrade_list->size; i++)
+                        // The daemon replies with the packages each new entry holds back, which
+                        // leave the list at once. The keep list arrives with the next fetch.
+                        char error[256];
+                        pkg_name_list_t *held_names = pkg_name_list_new(5);
+                        for (int i = pkg_state_list_next_selected(upgrade_list, 0); i >= 0;
+                             i = pkg_state_list_next_selected(upgrade_list, i + 1))
                         {
-                            pkg_state_t *curr_pkg_state = &upgrade_list->ary[i];
-                            int changing_pkg_index = pkg_index;
-                            if (curr_pkg_state->is_selected)
+                            const char *name = name_arena_str(arena, upgrade_list->names[i]);
+                            if (daemon_conn_keep_change(daemon_conn, true, name, held_names, arena, error,
+                                                        sizeof(error)) == -1)
                             {
-                                pkg_name_t *new_keep_package = pkg_name_new(keep_package_names);
-                                snprintf(new_keep_package->name, MAX_PACKAGE_NAME_SIZE, "%s", alpm_pkg_get_name(curr_pkg_state->underlying_pkg));
-                                                                new_keep_package->size = strlen(new_keep_package->name);
-
-                                if (i <= changing_pkg_index)
-                                {
-                                    selection_index--;
-                                    changing_pkg_index--;
-                                }
-
-                                curr_pkg_state->is_selected = false;
-                                pkg_state_list_delete_at(upgrade_list, i);
-                                i--;
+                                snprintf(status_notice, sizeof(status_notice), "Failed to keep %s: %s", name, error);
                             }
                         }
 
-                        // Occurs if the user removes the first package while having their cursor on it
-                        if (selection_index < 0)
+                        if (held_names->size > 0)
                         {
-                            selection_index = 0;
+                            const int new_list_index = pkg_state_list_remove_named(upgrade_list, held_names, arena,
+                                                                                   list_index);
+                            if (new_list_index < 0)
+                            {
+                                // Nothing is left to upgrade
+                                pkg_name_list_free(held_names);
+                                goto exit_tb;
+                            }
+
+                            pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+                            pkg_view_track(view, new_list_index, &base_index, &selection_index);
+                        }
+                        pkg_name_list_free(held_names);
+                        daemon_polled_ms = 0;
+                    }
+                    else if (loader == NULL) // The graph and closure belong to the loader until it's finished
+                    {
+                        ensure_keep_closure(&graph, &closure, localdb, arena, keep_root_names);
+
+                        pkg_name_list_t *new_keep_names = pkg_name_list_new(5);
+                        for (int i = pkg_state_list_next_selected(upgrade_list, 0); i >= 0;
+                             i = pkg_state_list_next_selected(upgrade_list, i + 1))
+                        {
+                            pkg_name_list_add(new_keep_names, upgrade_list->names[i]);
+                            pkg_name_list_add(keep_package_names, upgrade_list->names[i]);
+                            pkg_name_list_add(keep_root_names, upgrade_list->names[i]);
+                            is_keep_save_failed |= keep_store_record(keep_store, true, upgrade_list->names[i],
+                                                                     arena) == -1;
                         }
 
-                        // Occurs if the user removes all the shown packages at once
-                        if (base_index >= upgrade_list->size)
+                        // Only the dependencies of the newly kept packages are walked. Every package
+                        // that's now held, selected or not, then leaves the list in one pass.
+                        if (new_keep_names->size > 0)
+                        {
+                            keep_closure_add_names(closure, new_keep_names, NULL, NULL);
+                            const int new_list_index = pkg_state_list_remove_held(upgrade_list, graph, closure->held, list_index);
+
+                            if (new_list_index < 0)
+                            {
+                                // Nothing is left to upgrade
+                                pkg_name_list_free(new_keep_names);
+                                goto exit_tb;
+                            }
+
+                            // Keep the cursor on the same row of the screen if possible
+                            pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+                            pkg_view_track(view, new_list_index, &base_index, &selection_index);
+                        }
+                        pkg_name_list_free(new_keep_names);
+                    }
+                    break;
+                case '/':
+                    is_filter_prompt = true;
+                    break;
+                case 'a':
+                    if (true)
+                    {
+                        // Selects every package shown, or clears them if they're all selected already
+                        bool is_all_selected = true;
+                        for (int i = 0; i < view->size && is_all_selected; i++)
                         {
-                            base_index = upgrade_list->size - view_height;
-                            selection_index = bottom_line;
+                            is_all_selected = pkg_state_list_is_selected(upgrade_list, view->indices[i]);
                         }
 
-                        // Occurs if the user "keeps" packages at the end of list
-                        if (selection_index >= upgrade_list->size - base_index)
+                        if (view->size == upgrade_list->size)
+                        {
+                            pkg_state_list_select_all(upgrade_list, !is_all_selected);
+                        }
+                        else
+                        {
+                            for (int i = 0; i < view->size; i++)
+                            {
+                                pkg_state_list_set_selected(upgrade_list, view->indices[i], !is_all_selected);
+                            }
+                        }
+                    }
+                    break;
+                case 'i':
+                    // A view as large as the list is all of it, so whole words can be flipped
+                    if (view->size == upgrade_list->size)
+                    {
+                        pkg_state_list_invert_selection(upgrade_list);
+                    }
+                    else
+                    {
+                        for (int i = 0; i < view->size; i++)
                         {
-                            selection_index = upgrade_list->size - base_index - 1;
+                            const int index = view->indices[i];
+                            pkg_state_list_set_selected(upgrade_list, index, !pkg_state_list_is_selected(upgrade_list, index));
                         }
                     }
                     break;
+                case '+':
+                case '-':
+                    match_input_size = 0;
+                    match_input[0] = '\0';
+                    is_match_select = event.ch == '+';
+                    is_match_prompt = true;
+                    break;
+                case 'y':
+                    // The graph and closure belong to the loader until it's finished
+                    if (loader == NULL)
+                    {
+                        why_input_size = 0;
+                        why_input[0] = '\0';
+                        is_why_prompt = true;
+                    }
+                    break;
+                case 'o':
+                    if (true)
+                    {
+                        // The selection bits are moved along with the packages
+                        sort_mode = (sort_mode + 1) % SORT_MODE_COUNT;
+                        int tracked_index = list_index;
+                        pkg_state_list_sort(upgrade_list, sort_mode, arena, &tracked_index);
+                        pkg_filter_update(filter, upgrade_list, arena, dbs_sync);
+                        pkg_view_track(view, tracked_index, &base_index, &selection_index);
+                    }
+                    break;
                 case 'G':
                     if (true) // NOTE(Chris): This is just here for Qt Creator's bracket formatting
                     {
-                        const int max_base_index = upgrade_list->size - bottom_line - 1;
-                        base_index = max_base_index;
+                        const int max_base_index = view->size - bottom_line - 1;
+                        base_index = max(0, max_base_index);
 
-                        selection_index = bottom_line;
+                        selection_index = max(0, min(bottom_line, view->size - 1 - base_index));
                     }
                     break;
                 }
             }
         }
-
-        tb_clear();
     }
 
 exit_tb:
     tb_shutdown();
 
-exit:
-    if (keep_file != NULL)
+    if (is_alpm_held)
+    {
+        // Anything still queued may refer to a handle which has just been released
+        if (annotator != NULL)
+        {
+            annotator_clear(annotator, localdb, dbs_sync);
+        }
+        pthread_mutex_unlock(&alpm_mutex);
+    }
+    annotator_stop(annotator);
+
+    if (loader != NULL)
     {
-        fclose(keep_file);
+        // Quit before the list finished loading
+        upgrade_loader_join(loader, true);
+        graph = loader->graph;
+        closure = loader->closure;
+        upgrade_loader_free(loader);
+    }
 
-        keep_file = fopen(config_path, "w");
+    if (loader_batch != NULL)
+    {
+        pkg_state_list_free(loader_batch);
+    }
 
-        for (int i = 0; i < keep_package_names->size; i++)
+    db_watcher_free(watcher);
+
+    why_path_free(why_path);
+    free(keep_release_counts);
+
+    if (is_cache_write_failed)
+    {
+        fprintf(stderr, "Failed to write upgrade cache\n");
+    }
+
+    if (err_return == 16)
+    {
+        fprintf(stderr, "Failed to start loading the upgrade list\n");
+    }
+    else if (err_return == 20)
+    {
+        fprintf(stderr, "There are no currently packages to upgrade. Try `sudo pacman -Sy` or removing packages from the keep list.\n");
+    }
+
+    if (print_render_stats && render->frame_count > 0)
+    {
+        fprintf(stderr, "render: %ld frames, %ld cells written, %.1f cells per frame on average, %ld at most\n",
+                render->frame_count, render->total_cells_written,
+                (double)render->total_cells_written / render->frame_count, render->max_cells_written);
+    }
+
+exit:
+    if (trace.is_enabled)
+    {
+        trace_count(&trace_counters.hash_probes, arena->index->probe_count);
+        if (graph != NULL)
+        {
+            trace_count(&trace_counters.hash_probes, graph->ids->probe_count);
+        }
+        if (render != NULL)
         {
-            fprintf(keep_file, "%s\n", keep_package_names->names[i].name);
+            trace_count(&trace_counters.hash_probes, render->layouts->index->probe_count);
         }
+        trace_finish();
+    }
+
+    // Every change has already been saved, but a compaction may still be running
+    if (keep_store_close(keep_store) == -1 || is_keep_save_failed)
+    {
+        fprintf(stderr, "Failed to save the keep list\n");
+    }
+
+    upgrade_cache_close(upgrade_cache);
+    daemon_conn_close(daemon_conn);
 
-        fclose(keep_file);
+    if (previous_names != NULL)
+    {
+        name_set_free(previous_names);
     }
 
     pkg_name_list_free(keep_package_names);
+    pkg_name_list_free(keep_root_names);
+
+    if (closure != NULL)
+    {
+        keep_closure_free(closure);
+    }
+
+    if (graph != NULL)
+    {
+        pkg_graph_free(graph);
+    }
 
     if (upgrade_list != NULL)
     {
-        bool was_at_least_one_selected = false;
-        for (int i = 0; i < upgrade_list->size; i++)
+        for (int i = pkg_state_list_next_selected(upgrade_list, 0); i >= 0; i = pkg_state_list_next_selected(upgrade_list, i + 1))
         {
-            if (upgrade_list->ary[i].is_selected)
-            {
-                printf("%s ", alpm_pkg_get_name(upgrade_list->ary[i].underlying_pkg));
-                was_at_least_one_selected = true;
-            }
+            printf("%s ", name_arena_str(arena, upgrade_list->names[i]));
         }
-        if (was_at_least_one_selected)
+        if (pkg_state_list_selected_count(upgrade_list) > 0)
         {
             printf("\n");
         }
@@ -898,5 +9010,21 @@ exit:
         alpm_release(handle);
     }
 
+    pacman_config_free(pacman_config);
+    pkg_cache_index_free(pkg_cache);
+
+    if (render != NULL)
+    {
+        render_state_free(render);
+    }
+
+    if (filter != NULL)
+    {
+        pkg_filter_free(filter);
+    }
+
+    // Every interned name is freed together here
+    name_arena_free(arena);
+
     return err_return;
 }